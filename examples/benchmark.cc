@@ -1,22 +1,46 @@
 /* Author:  Matthew Curry
  * Email:   mlcurry@sandia.gov
  *
- * Simple benchmarking application.  Sets up an n+m configuration, fails m data
- * buffers (in order to put Jerasure on even footing, as Gibraltar does not
- * automatically recover checksum buffers and Jerasure does), and recovers
- * them.  Results are verified correct.  
+ * Benchmark suite.  For every combination of n, m, buffer size, thread
+ * count and erasure count asked for, it times gib_generate, gib_recover
+ * (with the dense n+m layout) and gib_recover_sparse, and checks that the
+ * recovered buffers are correct.  Results are written as JSON, one result
+ * object per line:
  *
- * This is an example of an application that does not particularly care about
- * data layout for regeneration.  For an application that is mindful of this,
- * see the other example.
+ *   benchmark [-n list] [-m list] [-s min:max] [-t list] [-e list]
+ *             [-T secs] [-M mib] [-o out.json] [-b baseline.json] [-r tol]
+ *
+ * Lists are comma-separated.  Buffer sizes go from min to max by factors of
+ * four and may end in K, M or G; the default is 4K:256M.  Thread counts
+ * default to 1 and the number of processors, and erasure counts to 1 and
+ * min(n, m).  Configurations needing more than -M MiB in all are skipped.
+ *
+ * Each measurement warms up once, then runs until at least -T seconds (0.1
+ * by default) and MIN_SAMPLES runs have passed.  Reported for each are the
+ * median and 99th percentile of the per-call times, the throughput over the
+ * n data buffers at the median, TSC cycles per data byte, and that
+ * throughput as a fraction of memcpy's over the same number of bytes.
+ *
+ * With -b, each result is compared with the one of the same configuration
+ * and implementation in a file written earlier by this program.  Results
+ * more than -r (0.05 by default) slower are flagged, and the exit status
+ * is 2 if any were.
  */
 
 #include <gibraltar.h>
-#include <iostream>
+#include <algorithm>
+#include <map>
+#include <vector>
+#include <cstdio>
 #include <cstdlib>
-#include <sys/time.h>
 #include <cstring>
-#include <cstdio>
+#include <climits>
+#include <ctime>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
 using namespace std;
 
 #ifndef min_test
@@ -26,108 +50,417 @@ using namespace std;
 #define max_test 16
 #endif
 
-double etime() {
-  /* Return time since epoch (in seconds) */
-  struct timeval t;
-  gettimeofday(&t, NULL);
-  return t.tv_sec + 1.e-6*t.tv_usec;
-}
-
-#define time_iters(var, cmd, iters) {					\
-    var = -1*etime();							\
-    for (int iterations = 0; iterations < iters; iterations++) cmd;	\
-    var = (var + etime()) / iters; }
-	
-int main() {
-  int iters = 5;	
-  printf("%% Speed test with correctness checks\n");
-  printf("%% datasize is n*bufsize, or the total size of all data buffers\n");
-  printf("%%      n        m datasize chk_tput rec_tput\n");
-	
-  for (int m = min_test; m <= max_test; m++) {
-    for (int n = min_test; n <= max_test; n++) {		
-      double chk_time, dns_time;
-      printf("%8i %8i ", n, m);
-      gib_context gc;
-      int rc = gib_init(n, m, &gc);
-      if (rc) {
-	printf("Error:  %i\n", rc);
-	exit(EXIT_FAILURE);
+#define MIN_SAMPLES 5
+#define MAX_SAMPLES 100000
+
+struct result {
+  const char *op;
+  const char *backend;
+  int n, m, size, threads, erasures, samples;
+  double median, p99;        /* Seconds */
+  double gbps, cpb, memcpy_frac;
+};
+
+double now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + 1.e-9*t.tv_nsec;
+}
+
+/* TSC ticks per second, or 0 where there is no TSC */
+double tsc_hz() {
+#if HAVE_TSC
+  double start = now();
+  unsigned long long t0 = __rdtsc();
+  while (now() - start < 0.05)
+    ;
+  return (__rdtsc() - t0) / (now() - start);
+#else
+  return 0;
+#endif
+}
+
+/* Runs fn until min_time has passed, returning the sorted call times. */
+template <class F>
+vector<double> measure(F fn, double min_time) {
+  vector<double> samples;
+  double start, t, total = 0;
+  fn();
+  while (samples.size() < MAX_SAMPLES &&
+	 (samples.size() < MIN_SAMPLES || total < min_time)) {
+    start = now();
+    fn();
+    t = now() - start;
+    samples.push_back(t);
+    total += t;
+  }
+  sort(samples.begin(), samples.end());
+  return samples;
+}
+
+double percentile(const vector<double> &s, double p) {
+  size_t i = (size_t)(p * (s.size() - 1) + 0.5);
+  return s[i];
+}
+
+/* memcpy throughput over bytes, measured once per length */
+double memcpy_gbps(size_t bytes, double min_time) {
+  static map<size_t, double> seen;
+  if (seen.count(bytes))
+    return seen[bytes];
+  char *a = (char *)malloc(bytes), *b = (char *)malloc(bytes);
+  if (a == NULL || b == NULL) {
+    fprintf(stderr, "Out of memory timing memcpy\n");
+    exit(1);
+  }
+  memset(a, 1, bytes);
+  memset(b, 2, bytes);
+  vector<double> s = measure([&] { memcpy(b, a, bytes); }, min_time);
+  free(a);
+  free(b);
+  return seen[bytes] = bytes / percentile(s, 0.5) / 1e9;
+}
+
+vector<int> parse_list(const char *arg) {
+  vector<int> v;
+  for (const char *p = arg; *p != '\0'; ) {
+    v.push_back(atoi(p));
+    p = strchr(p, ',');
+    if (p == NULL)
+      break;
+    p++;
+  }
+  return v;
+}
+
+long parse_size(const char *arg) {
+  char *end;
+  long v = strtol(arg, &end, 10);
+  switch (*end) {
+  case 'G': case 'g': v <<= 10; /* Fall through */
+  case 'M': case 'm': v <<= 10; /* Fall through */
+  case 'K': case 'k': v <<= 10;
+  }
+  return v;
+}
+
+/* Looks up "key": in a line written by print_result. */
+double json_num(const char *line, const char *key) {
+  char pat[64];
+  sprintf(pat, "\"%s\": ", key);
+  const char *p = strstr(line, pat);
+  return (p == NULL) ? -1 : strtod(p + strlen(pat), NULL);
+}
+
+int json_str(const char *line, const char *key, char *out, int len) {
+  char pat[64];
+  sprintf(pat, "\"%s\": \"", key);
+  const char *p = strstr(line, pat);
+  if (p == NULL)
+    return 0;
+  p += strlen(pat);
+  int i;
+  for (i = 0; i < len - 1 && p[i] != '"' && p[i] != '\0'; i++)
+    out[i] = p[i];
+  out[i] = '\0';
+  return 1;
+}
+
+struct key {
+  char op[32], backend[32];
+  int n, m, size, threads, erasures;
+  bool operator<(const key &o) const {
+    int c = strcmp(op, o.op);
+    if (c != 0) return c < 0;
+    c = strcmp(backend, o.backend);
+    if (c != 0) return c < 0;
+    if (n != o.n) return n < o.n;
+    if (m != o.m) return m < o.m;
+    if (size != o.size) return size < o.size;
+    if (threads != o.threads) return threads < o.threads;
+    return erasures < o.erasures;
+  }
+};
+
+key key_of(const char *op, const char *backend, int n, int m, int size,
+	   int threads, int erasures) {
+  key k;
+  memset(&k, 0, sizeof(k));
+  snprintf(k.op, sizeof(k.op), "%s", op);
+  snprintf(k.backend, sizeof(k.backend), "%s", backend);
+  k.n = n; k.m = m; k.size = size; k.threads = threads;
+  k.erasures = erasures;
+  return k;
+}
+
+map<key, double> load_baseline(const char *path) {
+  map<key, double> base;
+  char line[1024], op[32], backend[32];
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) {
+    perror(path);
+    exit(1);
+  }
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (!json_str(line, "op", op, sizeof(op)) ||
+	!json_str(line, "backend", backend, sizeof(backend)))
+      continue;
+    base[key_of(op, backend, (int)json_num(line, "n"),
+		(int)json_num(line, "m"), (int)json_num(line, "size"),
+		(int)json_num(line, "threads"),
+		(int)json_num(line, "erasures"))] = json_num(line, "gbps");
+  }
+  fclose(fp);
+  return base;
+}
+
+FILE *out;
+map<key, double> baseline;
+int have_baseline = 0, nregressions = 0, nresults = 0;
+double tolerance = 0.05;
+
+void print_result(const struct result &r) {
+  fprintf(out, "%s    {\"op\": \"%s\", \"backend\": \"%s\", \"n\": %i, "
+	  "\"m\": %i, \"size\": %i, \"threads\": %i, \"erasures\": %i, "
+	  "\"samples\": %i, \"median_ns\": %.1f, \"p99_ns\": %.1f, "
+	  "\"gbps\": %.4f, \"cycles_per_byte\": %.4f, "
+	  "\"memcpy_fraction\": %.4f",
+	  (nresults++ > 0) ? ",\n" : "", r.op, r.backend, r.n, r.m, r.size,
+	  r.threads, r.erasures, r.samples, r.median*1e9, r.p99*1e9, r.gbps,
+	  r.cpb, r.memcpy_frac);
+  fprintf(stderr, "%-14s n=%-3i m=%-3i size=%-10i threads=%-3i "
+	  "erasures=%-3i %9.3f GB/s", r.op, r.n, r.m, r.size, r.threads,
+	  r.erasures, r.gbps);
+  if (have_baseline) {
+    map<key, double>::iterator b =
+      baseline.find(key_of(r.op, r.backend, r.n, r.m, r.size, r.threads,
+			   r.erasures));
+    if (b != baseline.end() && b->second > 0) {
+      double change = r.gbps / b->second - 1;
+      int regressed = change < -tolerance;
+      fprintf(out, ", \"baseline_gbps\": %.4f, \"change\": %.4f, "
+	      "\"regression\": %s", b->second, change,
+	      regressed ? "true" : "false");
+      fprintf(stderr, " (%+.1f%%)%s", change*100,
+	      regressed ? "  REGRESSION" : "");
+      nregressions += regressed;
+    }
+  }
+  fprintf(out, "}");
+  fprintf(stderr, "\n");
+}
+
+void summarize(struct result *r, const vector<double> &s, double hz,
+	       double min_time) {
+  size_t bytes = (size_t)r->n * r->size;
+  r->samples = s.size();
+  r->median = percentile(s, 0.5);
+  r->p99 = percentile(s, 0.99);
+  r->gbps = bytes / r->median / 1e9;
+  r->cpb = r->median * hz / bytes;
+  r->memcpy_frac = r->gbps / memcpy_gbps(bytes, min_time);
+  print_result(*r);
+}
+
+/* Fails e random data buffers, recovers them both ways, and checks both. */
+void bench_recover(gib_context gc, struct result r, unsigned char *data,
+		   unsigned char *backup, double hz, double min_time) {
+  int n = r.n, m = r.m, size = r.size, e = r.erasures;
+  char failed[256];
+  int buf_ids[256];
+  memset(failed, 0, sizeof(failed));
+  for (int i = 0; i < e; i++) {
+    int probe;
+    do {
+      probe = rand() % n;
+    } while (failed[probe]);
+    failed[probe] = 1;
+  }
+  /* Survivors first, then the failed ones */
+  int index = 0, f_index = n;
+  for (int i = 0; i < n+m; i++) {
+    if (failed[i])
+      buf_ids[f_index++] = i;
+    else if (index < n)
+      buf_ids[index++] = i;
+  }
+
+  void *dense;
+  int ld;
+  if (gib_alloc(&dense, size, &ld, gc) != GIB_SUC) {
+    fprintf(stderr, "gib_alloc failed\n");
+    exit(1);
+  }
+  unsigned char *d = (unsigned char *)dense;
+  for (int i = 0; i < n; i++)
+    memcpy(d + (size_t)i*size, backup + (size_t)buf_ids[i]*size, size);
+  memset(d + (size_t)n*size, 0, (size_t)e*size);
+  r.op = "recover";
+  summarize(&r, measure([&] {
+	gib_recover(dense, size, buf_ids, e, gc); }, min_time), hz, min_time);
+  for (int i = 0; i < n+e; i++)
+    if (memcmp(d + (size_t)i*size, backup + (size_t)buf_ids[i]*size,
+	       size)) {
+      printf("Dense test failed on buffer %i/%i.\n", i, buf_ids[i]);
+      exit(1);
+    }
+  gib_free(dense, gc);
+
+  for (int i = 0; i < n+m; i++)
+    if (failed[i])
+      memset(data + (size_t)i*size, 0, size);
+  r.op = "recover_sparse";
+  summarize(&r, measure([&] {
+	gib_recover_sparse(data, size, failed, gc); }, min_time), hz,
+    min_time);
+  if (memcmp(data, backup, (size_t)(n+m)*size)) {
+    printf("Sparse test failed.\n");
+    exit(1);
+  }
+}
+
+void usage() {
+  fprintf(stderr, "Usage:  benchmark [-n list] [-m list] [-s min:max] "
+	  "[-t list] [-e list]\n"
+	  "                  [-T secs] [-M mib] [-o out.json] "
+	  "[-b baseline.json] [-r tol]\n");
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  int ncpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  vector<int> ns, ms, threads, erasures;
+  long min_size = 4 << 10, max_size = 256 << 20, mem_mib = 1024;
+  double min_time = 0.1;
+  const char *out_path = NULL;
+  int opt;
+
+  for (int v = 4; v <= 16; v *= 2)
+    if (v >= min_test && v <= max_test)
+      ns.push_back(v);
+  for (int v = 2; v <= 4; v *= 2)
+    if (v >= min_test && v <= max_test)
+      ms.push_back(v);
+  threads.push_back(1);
+  if (ncpus > 1)
+    threads.push_back(ncpus);
+  while ((opt = getopt(argc, argv, "n:m:s:t:e:T:M:o:b:r:")) != -1) {
+    switch (opt) {
+    case 'n': ns = parse_list(optarg); break;
+    case 'm': ms = parse_list(optarg); break;
+    case 's': {
+      const char *colon = strchr(optarg, ':');
+      if (colon == NULL)
+	usage();
+      min_size = parse_size(optarg);
+      max_size = parse_size(colon + 1);
+      break;
+    }
+    case 't': threads = parse_list(optarg); break;
+    case 'e': erasures = parse_list(optarg); break;
+    case 'T': min_time = atof(optarg); break;
+    case 'M': mem_mib = atol(optarg); break;
+    case 'o': out_path = optarg; break;
+    case 'b': baseline = load_baseline(optarg); have_baseline = 1; break;
+    case 'r': tolerance = atof(optarg); break;
+    default: usage();
+    }
+  }
+  if (optind != argc || min_size <= 0 || max_size < min_size ||
+      max_size > INT_MAX)
+    usage();
+
+  out = stdout;
+  if (out_path != NULL && (out = fopen(out_path, "w")) == NULL) {
+    perror(out_path);
+    exit(1);
+  }
+  double hz = tsc_hz();
+  fprintf(out, "{\n  \"benchmark\": \"gibraltar\",\n  \"version\": 1,\n"
+	  "  \"host\": {\"cpus\": %i, \"tsc_ghz\": %.4f},\n"
+	  "  \"results\": [\n", ncpus, hz / 1e9);
+
+  for (size_t mi = 0; mi < ms.size(); mi++) {
+    for (size_t ni = 0; ni < ns.size(); ni++) {
+      int n = ns[ni], m = ms[mi];
+      if (n < 2 || m < 1 || n + m > 256) {
+	fprintf(stderr, "Skipping n=%i m=%i\n", n, m);
+	continue;
       }
-			
-      /* Allocate/define the appropriate number of buffers */
-      int size = 1024*1024;
-      void *data;
-      gib_alloc(&data, size, &size, gc);
-			
-      for (int i = 0; i < size * n; i++)
-	((char *)data)[i] = (unsigned char)rand()%256;
-	
-      time_iters(chk_time, gib_generate(data, size, gc), iters);
-
-      unsigned char *backup_data = (unsigned char *)malloc(size * (n+m));
-      memcpy(backup_data, data, size * (n+m));
-			
-      char failed[256];		
-      for (int i = 0; i < n+m; i++)
-	failed[i] = 0;
-      for (int i = 0; i < ((m < n) ? m : n); i++) {
-	int probe;
-	do {
-	  probe = rand() % n;
-	} while (failed[probe] == 1);
-	failed[probe] = 1;
-
-	/* Destroy the buffer */
-	memset((char *)data + size*probe, 0, size);
+      vector<int> es = erasures;
+      if (es.empty()) {
+	es.push_back(1);
+	if (min(n, m) > 1)
+	  es.push_back(min(n, m));
       }
-      
-      int buf_ids[256];
-      int index = 0;
-      int f_index = n;
-      for (int i = 0; i < n; i++) {
-	while (failed[index]) {
-	  buf_ids[f_index++] = index;
-	  index++;
+      for (long size = min_size; size <= max_size; size *= 4) {
+	/* The stripe, its backup, the dense copy and memcpy_gbps's two
+	 * buffers of n*size bytes
+	 */
+	if ((long long)(n+m)*size > INT_MAX ||
+	    (3LL*(n+m) + 2LL*n)*size > (long long)mem_mib << 20) {
+	  fprintf(stderr, "Skipping n=%i m=%i size=%li:  needs more than "
+		  "%li MiB\n", n, m, size, mem_mib);
+	  continue;
 	}
-	buf_ids[i] = index;
-	index++;
-      }
-      while (f_index != n+m) {
-	buf_ids[f_index] = f_index;
-	f_index++;
-      }
-      
-      void *dense_data;
-      gib_alloc((void **)&dense_data, size, &size, gc);
-      for (int i = 0; i < m+n; i++) {
-	memcpy((unsigned char *)dense_data+i*size, 
-	       (unsigned char *)data+buf_ids[i]*size, size);
-      }
+	for (size_t ti = 0; ti < threads.size(); ti++) {
+	  struct gib_options o;
+	  gib_context gc;
+	  memset(&o, 0, sizeof(o));
+	  o.nthreads = threads[ti];
+	  int rc = gib_init_opts(n, m, &o, &gc);
+	  if (rc) {
+	    printf("Error:  %i\n", rc);
+	    exit(EXIT_FAILURE);
+	  }
+
+	  void *buffers;
+	  int ld;
+	  if (gib_alloc(&buffers, size, &ld, gc) != GIB_SUC) {
+	    fprintf(stderr, "gib_alloc failed\n");
+	    exit(1);
+	  }
+	  unsigned char *data = (unsigned char *)buffers;
+	  for (long i = 0; i < n*size; i++)
+	    data[i] = (unsigned char)rand()%256;
 
-      int nfailed = (m < n) ? m : n;
-      memset((unsigned char *)dense_data+n*size, 0, size*nfailed);
-      time_iters(dns_time, gib_recover(dense_data, size, buf_ids, nfailed, gc), 
-		 iters);
-
-      for (int i = 0; i < m+n; i++) {
-	if (memcmp((unsigned char *)dense_data+i*size, 
-		   backup_data+buf_ids[i]*size, size)) {
-	  printf("Dense test failed on buffer %i/%i.\n", i, 
-		 buf_ids[i]);
-	  exit(1);
+	  struct result r;
+	  r.backend = gib_backend_name(gc);
+	  r.n = n;
+	  r.m = m;
+	  r.size = size;
+	  r.threads = threads[ti];
+	  r.erasures = 0;
+	  r.op = "generate";
+	  summarize(&r, measure([&] { gib_generate(data, size, gc); },
+				min_time), hz, min_time);
+
+	  unsigned char *backup = (unsigned char *)malloc((size_t)(n+m)*size);
+	  if (backup == NULL) {
+	    fprintf(stderr, "Out of memory\n");
+	    exit(1);
+	  }
+	  memcpy(backup, data, (size_t)(n+m)*size);
+	  for (size_t ei = 0; ei < es.size(); ei++) {
+	    if (es[ei] < 1 || es[ei] > min(n, m))
+	      continue;
+	    r.erasures = es[ei];
+	    bench_recover(gc, r, data, backup, hz, min_time);
+	  }
+	  free(backup);
+	  gib_free(buffers, gc);
+	  gib_destroy(gc);
 	}
       }
-						
-      double size_mb = size * n / 1024.0 / 1024.0;
-      printf("%8i %8.3lf %8.3lf\n", size*n, size_mb/chk_time, 
-	     size_mb/dns_time);
-			
-      gib_free(data, gc);
-      gib_free(dense_data, gc);
-      free(backup_data);		
-      gib_destroy(gc);
     }
   }
+  fprintf(out, "\n  ]\n}\n");
+  if (out != stdout)
+    fclose(out);
+  if (have_baseline && nregressions > 0) {
+    fprintf(stderr, "%i results regressed by more than %.1f%%\n",
+	    nregressions, tolerance*100);
+    return 2;
+  }
   return 0;
 }
@@ -0,0 +1,195 @@
+/* gib-encode:  streams a file into n+m shard files.
+ *
+ *   gib-encode [-n n] [-m m] [-b buf_kib] input prefix
+ *
+ * The input is cut into stripes of n buffers of buf_kib KiB each.  Buffer i
+ * of every stripe is appended to <prefix>.<i>, and the parity of the stripe
+ * to <prefix>.<n>..<prefix>.<n+m-1>.  The last stripe is padded with zeros;
+ * <prefix>.meta records the real length so gib-repair can trim it.
+ *
+ * Three stripes, allocated with gib_alloc, are kept in flight:  while
+ * stripe k is being read, stripe k-1 is being encoded on the library's
+ * workers and stripe k-2 is being written.  Memory use is 3(n+m) buffers
+ * no matter how large the input is.
+ */
+
+#include <gibraltar.h>
+#include "gib_stripe_io.h"
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+using namespace std;
+
+#define NSLOTS 3
+
+struct slot {
+  void *buffers;
+  int pending;           /* I/O requests in flight */
+  struct sio_req reqs[256];
+  gib_job job;
+};
+
+double etime() {
+  /* Return time since epoch (in seconds) */
+  struct timeval t;
+  gettimeofday(&t, NULL);
+  return t.tv_sec + 1.e-6*t.tv_usec;
+}
+
+/* Collects finished encodes.  A job stays on the completion queue until it
+ * is polled, and only then may it be freed.
+ */
+void reap(gib_context gc, struct slot *slots) {
+  gib_job done[NSLOTS];
+  int ndone = gib_poll(gc, done, NSLOTS);
+  for (int i = 0; i < ndone; i++) {
+    if (gib_job_wait(done[i]) != GIB_SUC) {
+      fprintf(stderr, "Encoding failed\n");
+      exit(1);
+    }
+    for (int s = 0; s < NSLOTS; s++)
+      if (slots[s].job == done[i])
+	slots[s].job = NULL;
+    gib_job_free(done[i]);
+  }
+}
+
+void usage() {
+  fprintf(stderr, "Usage:  gib-encode [-n n] [-m m] [-b buf_kib] input "
+	  "prefix\n");
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  int n = 10, m = 4, buf_kib = 1024, opt;
+  while ((opt = getopt(argc, argv, "n:m:b:")) != -1) {
+    switch (opt) {
+    case 'n': n = atoi(optarg); break;
+    case 'm': m = atoi(optarg); break;
+    case 'b': buf_kib = atoi(optarg); break;
+    default: usage();
+    }
+  }
+  if (argc - optind != 2 || n < 2 || m < 1 || n + m > 256 || buf_kib <= 0)
+    usage();
+  const char *input = argv[optind], *prefix = argv[optind+1];
+  int buf_size = buf_kib*1024;
+  long long stripe_bytes = (long long)n*buf_size;
+
+  int in_fd = open(input, O_RDONLY);
+  struct stat st;
+  if (in_fd < 0 || fstat(in_fd, &st) != 0) {
+    perror(input);
+    exit(1);
+  }
+  long long nstripes = (st.st_size + stripe_bytes - 1)/stripe_bytes;
+
+  int out_fd[256];
+  for (int i = 0; i < n+m; i++) {
+    char name[4096];
+    shard_name(name, sizeof(name), prefix, i);
+    out_fd[i] = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd[i] < 0) {
+      perror(name);
+      exit(1);
+    }
+  }
+
+  gib_context gc;
+  if (gib_init(n, m, &gc) != GIB_SUC) {
+    fprintf(stderr, "gib_init failed\n");
+    exit(1);
+  }
+  struct slot slots[NSLOTS];
+  for (int s = 0; s < NSLOTS; s++) {
+    int ld;
+    if (gib_alloc(&slots[s].buffers, buf_size, &ld, gc) != GIB_SUC) {
+      fprintf(stderr, "gib_alloc failed\n");
+      exit(1);
+    }
+    slots[s].pending = 0;
+    slots[s].job = NULL;
+  }
+  struct sio io;
+  sio_init(&io, NSLOTS*(n+m));
+
+  double start = etime();
+  for (long long k = 0; k < nstripes + 2; k++) {
+    /* Stage 1:  read stripe k.  The data buffers are contiguous, so one
+     * read fills all of them.  The slot was last used by stripe k-3, whose
+     * writes have to finish first.
+     */
+    if (k < nstripes) {
+      struct slot *s = &slots[k % NSLOTS];
+      sio_wait(&io, &s->pending);
+      struct sio_req *r = &s->reqs[0];
+      r->fd = in_fd;
+      r->write = 0;
+      r->buf = (char *)s->buffers;
+      r->len = stripe_bytes;
+      r->off = k*stripe_bytes;
+      r->pending = &s->pending;
+      sio_submit(&io, r);
+      sio_flush(&io);
+    }
+    /* Stage 2:  encode stripe k-1 once it has been read. */
+    if (k >= 1 && k - 1 < nstripes) {
+      struct slot *s = &slots[(k-1) % NSLOTS];
+      sio_wait(&io, &s->pending);
+      if (s->reqs[0].done < (size_t)stripe_bytes)
+	memset((char *)s->buffers + s->reqs[0].done, 0,
+	       stripe_bytes - s->reqs[0].done);
+      if (gib_submit_generate(s->buffers, buf_size, gc, NULL, NULL,
+			      &s->job) != GIB_SUC) {
+	fprintf(stderr, "gib_submit_generate failed\n");
+	exit(1);
+      }
+    }
+    /* Stage 3:  write every buffer of stripe k-2 to its shard. */
+    if (k >= 2) {
+      struct slot *s = &slots[(k-2) % NSLOTS];
+      while (s->job != NULL) {
+	gib_job_wait(s->job); /* Not polled yet, so not freed yet */
+	reap(gc, slots);
+      }
+      for (int i = 0; i < n+m; i++) {
+	struct sio_req *r = &s->reqs[i];
+	r->fd = out_fd[i];
+	r->write = 1;
+	r->buf = (char *)s->buffers + (size_t)i*buf_size;
+	r->len = buf_size;
+	r->off = (k-2)*buf_size;
+	r->pending = &s->pending;
+	sio_submit(&io, r);
+      }
+      sio_flush(&io);
+    }
+  }
+  for (int s = 0; s < NSLOTS; s++)
+    sio_wait(&io, &slots[s].pending);
+  double elapsed = etime() - start;
+
+  for (int i = 0; i < n+m; i++)
+    if (close(out_fd[i]) != 0) {
+      perror("close");
+      exit(1);
+    }
+  close(in_fd);
+  struct shard_meta meta;
+  meta.n = n;
+  meta.m = m;
+  meta.buf_size = buf_size;
+  meta.size = st.st_size;
+  if (meta_write(prefix, &meta) != 0)
+    exit(1);
+
+  printf("%lli stripes, %lli bytes in %.3f s (%.1f MB/s)\n", nstripes,
+	 (long long)st.st_size, elapsed, st.st_size/elapsed/1e6);
+  sio_exit(&io);
+  for (int s = 0; s < NSLOTS; s++)
+    gib_free(slots[s].buffers, gc);
+  gib_destroy(gc);
+  return 0;
+}
@@ -0,0 +1,369 @@
+/* gib-repair:  rebuilds lost shard files written by gib-encode, or reads
+ * from one without rebuilding it.
+ *
+ *   gib-repair [-j threads] [-l i,j,...] prefix
+ *   gib-repair -r shard [-o offset] [-c count] prefix > out
+ *
+ * A shard is lost if its file is missing or has the wrong length, or if it
+ * is named with -l.  The first form rebuilds every lost shard.  The second
+ * writes count bytes of the given shard, starting at offset, to standard
+ * output; if the shard is lost, only the bytes asked for are decoded.
+ *
+ * The survivors are the first n shards that are not lost, so data shards
+ * are preferred.  During a rebuild, the survivors of each stripe are read
+ * into a stripe slot, decoded by a job on the library's workers, and the
+ * rebuilt buffers written out, with up to "threads" stripes being decoded
+ * at once while others are read and written.
+ */
+
+#include <gibraltar.h>
+#include "gib_stripe_io.h"
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+using namespace std;
+
+struct plan {
+  int n, m;
+  int nlost;
+  int lost[256];     /* Lost shards */
+  int surv[256];     /* The n survivors that are read */
+  int pos[256];      /* Position of each shard's buffer within a stripe */
+  int buf_ids[256];  /* Survivors, then lost shards, for gib_recover */
+};
+
+struct slot {
+  void *buffers;
+  int pending;       /* I/O requests in flight */
+  struct sio_req reqs[256];
+  int decoded, rc;   /* Set by decode_done */
+};
+
+struct shard_meta meta;
+struct plan plan;
+gib_context gc;
+pthread_mutex_t decode_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t decode_cond = PTHREAD_COND_INITIALIZER;
+
+double etime() {
+  /* Return time since epoch (in seconds) */
+  struct timeval t;
+  gettimeofday(&t, NULL);
+  return t.tv_sec + 1.e-6*t.tv_usec;
+}
+
+void usage() {
+  fprintf(stderr,
+	  "Usage:  gib-repair [-j threads] [-l i,j,...] prefix\n"
+	  "        gib-repair -r shard [-o offset] [-c count] prefix\n");
+  exit(1);
+}
+
+/* Lays a stripe out so that one gib_recover rebuilds every lost shard in
+ * place:  the survivors come first, in buf_ids order, then the lost shards.
+ */
+void make_plan(int *is_lost) {
+  int n = plan.n, m = plan.m, next = 0, i;
+  plan.nlost = 0;
+  for (i = 0; i < n+m; i++)
+    if (is_lost[i])
+      plan.lost[plan.nlost++] = i;
+  for (i = 0; i < n+m && next < n; i++)
+    if (!is_lost[i]) {
+      plan.surv[next] = i;
+      plan.buf_ids[next] = i;
+      plan.pos[i] = next++;
+    }
+  if (next < n) {
+    fprintf(stderr, "Only %i shards survive; %i are needed.\n", next, n);
+    exit(1);
+  }
+  for (i = 0; i < plan.nlost; i++) {
+    plan.buf_ids[n+i] = plan.lost[i];
+    plan.pos[plan.lost[i]] = next++;
+  }
+}
+
+/* Rebuilds every lost buffer of a stripe laid out by make_plan, for
+ * buffers of len bytes placed stride bytes apart.
+ */
+int decode_columns(unsigned char *base, size_t stride, int len) {
+  void *bufs[256];
+  for (int i = 0; i < plan.n + plan.nlost; i++)
+    bufs[i] = base + i*stride;
+  return gib_recover_iov(bufs, len, plan.buf_ids, plan.nlost, gc);
+}
+
+/* Runs on a library worker when a stripe's job finishes. */
+void decode_done(gib_job job, void *arg) {
+  struct slot *s = (struct slot *)arg;
+  int rc = gib_job_wait(job); /* Already finished */
+  gib_job_free(job);
+  pthread_mutex_lock(&decode_lock);
+  s->rc = rc;
+  s->decoded = 1;
+  pthread_cond_broadcast(&decode_cond);
+  pthread_mutex_unlock(&decode_lock);
+}
+
+void read_survivors(struct sio *io, struct slot *s, int *fd, off_t off,
+		    int len, size_t stride) {
+  for (int i = 0; i < plan.n; i++) {
+    struct sio_req *r = &s->reqs[i];
+    r->fd = fd[plan.surv[i]];
+    r->write = 0;
+    r->buf = (char *)s->buffers + i*stride;
+    r->len = len;
+    r->off = off;
+    r->pending = &s->pending;
+    sio_submit(io, r);
+  }
+  sio_flush(io);
+}
+
+void check_read(struct slot *s, int len) {
+  for (int i = 0; i < plan.n; i++)
+    if (s->reqs[i].done != (size_t)len) {
+      fprintf(stderr, "Shard %i is shorter than expected.\n", plan.surv[i]);
+      exit(1);
+    }
+}
+
+void rebuild(int *fd, long long nstripes, int nthreads, const char *prefix) {
+  int buf_size = meta.buf_size;
+  int lag = nthreads;            /* Stripes being decoded at once */
+  int nslots = lag + 2;
+  struct slot *slots = new struct slot[nslots];
+  int out_fd[256];
+  char name[4096], tmp[4096 + 16];
+
+  for (int i = 0; i < plan.nlost; i++) {
+    shard_name(name, sizeof(name), prefix, plan.lost[i]);
+    snprintf(tmp, sizeof(tmp), "%s.rebuild", name);
+    out_fd[i] = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd[i] < 0) {
+      perror(tmp);
+      exit(1);
+    }
+  }
+  for (int s = 0; s < nslots; s++) {
+    int ld;
+    if (gib_alloc(&slots[s].buffers, buf_size, &ld, gc) != GIB_SUC) {
+      fprintf(stderr, "gib_alloc failed\n");
+      exit(1);
+    }
+    slots[s].pending = 0;
+  }
+  struct sio io;
+  sio_init(&io, nslots*(plan.n + plan.m));
+
+  double start = etime();
+  for (long long k = 0; k < nstripes + 1 + lag; k++) {
+    /* Stage 1:  read the survivors of stripe k, once the writes of the
+     * stripe that last used the slot are done.
+     */
+    if (k < nstripes) {
+      struct slot *s = &slots[k % nslots];
+      sio_wait(&io, &s->pending);
+      s->decoded = 0;
+      read_survivors(&io, s, fd, k*buf_size, buf_size, buf_size);
+    }
+    /* Stage 2:  hand stripe k-1 to a worker. */
+    if (k >= 1 && k - 1 < nstripes) {
+      struct slot *s = &slots[(k-1) % nslots];
+      sio_wait(&io, &s->pending);
+      check_read(s, buf_size);
+      if (gib_submit_recover(s->buffers, buf_size, plan.buf_ids, plan.nlost,
+			     gc, decode_done, s, NULL) != GIB_SUC) {
+	fprintf(stderr, "Submitting stripe %lli failed\n", k-1);
+	exit(1);
+      }
+    }
+    /* Stage 3:  write the rebuilt buffers of stripe k-1-lag. */
+    long long w = k - 1 - lag;
+    if (w >= 0 && w < nstripes) {
+      struct slot *s = &slots[w % nslots];
+      pthread_mutex_lock(&decode_lock);
+      while (!s->decoded)
+	pthread_cond_wait(&decode_cond, &decode_lock);
+      pthread_mutex_unlock(&decode_lock);
+      if (s->rc != GIB_SUC) {
+	fprintf(stderr, "Decoding stripe %lli failed\n", w);
+	exit(1);
+      }
+      for (int i = 0; i < plan.nlost; i++) {
+	struct sio_req *r = &s->reqs[i];
+	r->fd = out_fd[i];
+	r->write = 1;
+	r->buf = (char *)s->buffers + (size_t)plan.pos[plan.lost[i]]*buf_size;
+	r->len = buf_size;
+	r->off = w*buf_size;
+	r->pending = &s->pending;
+	sio_submit(&io, r);
+      }
+      sio_flush(&io);
+    }
+  }
+  for (int s = 0; s < nslots; s++)
+    sio_wait(&io, &slots[s].pending);
+  double elapsed = etime() - start;
+
+  /* Only put the rebuilt shards in place once all of them are complete. */
+  for (int i = 0; i < plan.nlost; i++) {
+    if (fsync(out_fd[i]) != 0 || close(out_fd[i]) != 0) {
+      perror("close");
+      exit(1);
+    }
+    shard_name(name, sizeof(name), prefix, plan.lost[i]);
+    snprintf(tmp, sizeof(tmp), "%s.rebuild", name);
+    if (rename(tmp, name) != 0) {
+      perror(name);
+      exit(1);
+    }
+  }
+  long long bytes = nstripes*buf_size*plan.nlost;
+  fprintf(stderr, "Rebuilt %i shards, %lli bytes in %.3f s (%.1f MB/s)\n",
+	  plan.nlost, bytes, elapsed, bytes/elapsed/1e6);
+  sio_exit(&io);
+  for (int s = 0; s < nslots; s++)
+    gib_free(slots[s].buffers, gc);
+  delete[] slots;
+}
+
+/* Writes bytes [offset, offset+count) of a shard to standard output,
+ * decoding one stripe's worth of columns at a time when it is lost.
+ */
+void degraded_read(int *fd, int *is_lost, int shard, long long offset,
+		   long long count) {
+  int buf_size = meta.buf_size;
+  struct slot s;
+  struct sio io;
+  int ld;
+
+  if (gib_alloc(&s.buffers, buf_size, &ld, gc) != GIB_SUC) {
+    fprintf(stderr, "gib_alloc failed\n");
+    exit(1);
+  }
+  s.pending = 0;
+  sio_init(&io, plan.n + plan.m);
+  while (count > 0) {
+    long long k = offset/buf_size;
+    int a = offset - k*buf_size;
+    int len = (count < buf_size - a) ? count : buf_size - a;
+    unsigned char *out;
+    if (!is_lost[shard]) {
+      struct sio_req *r = &s.reqs[0];
+      r->fd = fd[shard];
+      r->write = 0;
+      r->buf = (char *)s.buffers;
+      r->len = len;
+      r->off = offset;
+      r->pending = &s.pending;
+      sio_submit(&io, r);
+      sio_flush(&io);
+      sio_wait(&io, &s.pending);
+      if (r->done != (size_t)len) {
+	fprintf(stderr, "Shard %i is shorter than expected.\n", shard);
+	exit(1);
+      }
+      out = (unsigned char *)s.buffers;
+    } else {
+      /* Only the columns asked for are read and decoded, packed len bytes
+       * apart.
+       */
+      read_survivors(&io, &s, fd, offset, len, len);
+      sio_wait(&io, &s.pending);
+      check_read(&s, len);
+      if (decode_columns((unsigned char *)s.buffers, len, len) != GIB_SUC) {
+	fprintf(stderr, "Decoding failed\n");
+	exit(1);
+      }
+      out = (unsigned char *)s.buffers + (size_t)plan.pos[shard]*len;
+    }
+    if (fwrite(out, 1, len, stdout) != (size_t)len) {
+      perror("fwrite");
+      exit(1);
+    }
+    offset += len;
+    count -= len;
+  }
+  sio_exit(&io);
+  gib_free(s.buffers, gc);
+}
+
+int main(int argc, char **argv) {
+  int nthreads = 1, shard = -1, opt;
+  long long offset = 0, count = -1;
+  const char *lost_list = NULL;
+  while ((opt = getopt(argc, argv, "j:l:r:o:c:")) != -1) {
+    switch (opt) {
+    case 'j': nthreads = atoi(optarg); break;
+    case 'l': lost_list = optarg; break;
+    case 'r': shard = atoi(optarg); break;
+    case 'o': offset = atoll(optarg); break;
+    case 'c': count = atoll(optarg); break;
+    default: usage();
+    }
+  }
+  if (argc - optind != 1 || nthreads < 1)
+    usage();
+  const char *prefix = argv[optind];
+  if (meta_read(prefix, &meta) != 0)
+    exit(1);
+  int n = meta.n, m = meta.m;
+  plan.n = n;
+  plan.m = m;
+  long long stripe_bytes = (long long)n*meta.buf_size;
+  long long nstripes = (meta.size + stripe_bytes - 1)/stripe_bytes;
+  long long shard_size = nstripes*meta.buf_size;
+  if (shard >= n+m)
+    usage();
+
+  int is_lost[256], fd[256];
+  for (int i = 0; i < n+m; i++) {
+    char name[4096];
+    struct stat st;
+    shard_name(name, sizeof(name), prefix, i);
+    fd[i] = open(name, O_RDONLY);
+    is_lost[i] = fd[i] < 0 || fstat(fd[i], &st) != 0 ||
+      st.st_size != shard_size;
+  }
+  for (const char *p = lost_list; p != NULL && *p != '\0'; ) {
+    char *end;
+    long i = strtol(p, &end, 10);
+    if (end == p || i < 0 || i >= n+m)
+      usage();
+    is_lost[i] = 1;
+    p = (*end == ',') ? end + 1 : end;
+  }
+  make_plan(is_lost);
+
+  struct gib_options opts;
+  memset(&opts, 0, sizeof(opts));
+  opts.nthreads = nthreads;
+  if (gib_init_opts(n, m, &opts, &gc) != GIB_SUC) {
+    fprintf(stderr, "gib_init failed\n");
+    exit(1);
+  }
+
+  if (shard >= 0) {
+    if (offset < 0 || offset > shard_size)
+      usage();
+    if (count < 0 || count > shard_size - offset)
+      count = shard_size - offset;
+    degraded_read(fd, is_lost, shard, offset, count);
+  } else if (plan.nlost == 0) {
+    fprintf(stderr, "No shards are lost.\n");
+  } else {
+    rebuild(fd, nstripes, nthreads, prefix);
+  }
+
+  for (int i = 0; i < n+m; i++)
+    if (fd[i] >= 0)
+      close(fd[i]);
+  gib_destroy(gc);
+  return 0;
+}
@@ -0,0 +1,194 @@
+/* File I/O shared by the shard tools.  Reads and writes are described by
+ * sio_req structures and counted against a caller's pending counter, so a
+ * tool can wait for everything belonging to one stripe.  When built with
+ * "make uring=1", requests go through io_uring and run while the caller
+ * does other work.  Otherwise, each request is carried out with
+ * pread/pwrite as it is submitted.
+ *
+ * The shard set written by gib-encode is a file per buffer, named
+ * <prefix>.<i> for 0 <= i < n+m, and <prefix>.meta describing the layout.
+ */
+#ifndef GIB_STRIPE_IO_H_
+#define GIB_STRIPE_IO_H_
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#ifdef GIB_HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+struct sio_req {
+  int fd;
+  int write;
+  char *buf;
+  size_t len;
+  off_t off;
+  size_t done;   /* Bytes transferred; less than len only at end of file */
+  int *pending;  /* Decremented when the request finishes */
+};
+
+struct sio {
+#ifdef GIB_HAVE_LIBURING
+  struct io_uring ring;
+#endif
+};
+
+static inline void sio_fail(const char *what, int err) {
+  fprintf(stderr, "%s: %s\n", what, strerror(err));
+  exit(1);
+}
+
+/* depth is the most requests the caller will have in flight at once. */
+static inline void sio_init(struct sio *io, int depth) {
+#ifdef GIB_HAVE_LIBURING
+  int rc = io_uring_queue_init(depth, &io->ring, 0);
+  if (rc < 0)
+    sio_fail("io_uring_queue_init", -rc);
+#endif
+}
+
+static inline void sio_exit(struct sio *io) {
+#ifdef GIB_HAVE_LIBURING
+  io_uring_queue_exit(&io->ring);
+#endif
+}
+
+#ifdef GIB_HAVE_LIBURING
+static inline void sio_queue(struct sio *io, struct sio_req *r) {
+  struct io_uring_sqe *sqe = io_uring_get_sqe(&io->ring);
+  if (sqe == NULL) {
+    io_uring_submit(&io->ring);
+    sqe = io_uring_get_sqe(&io->ring);
+  }
+  if (r->write)
+    io_uring_prep_write(sqe, r->fd, r->buf + r->done, r->len - r->done,
+			r->off + r->done);
+  else
+    io_uring_prep_read(sqe, r->fd, r->buf + r->done, r->len - r->done,
+		       r->off + r->done);
+  io_uring_sqe_set_data(sqe, r);
+}
+#endif
+
+/* Starts a request.  Call sio_flush once a group of them has been started. */
+static inline void sio_submit(struct sio *io, struct sio_req *r) {
+  r->done = 0;
+  (*r->pending)++;
+#ifdef GIB_HAVE_LIBURING
+  sio_queue(io, r);
+#else
+  while (r->done < r->len) {
+    ssize_t rc;
+    if (r->write)
+      rc = pwrite(r->fd, r->buf + r->done, r->len - r->done,
+		  r->off + r->done);
+    else
+      rc = pread(r->fd, r->buf + r->done, r->len - r->done,
+		 r->off + r->done);
+    if (rc < 0 && errno == EINTR)
+      continue;
+    if (rc < 0)
+      sio_fail(r->write ? "pwrite" : "pread", errno);
+    if (rc == 0) {
+      if (r->write)
+	sio_fail("pwrite", EIO);
+      break; /* End of file */
+    }
+    r->done += rc;
+  }
+  (*r->pending)--;
+#endif
+}
+
+static inline void sio_flush(struct sio *io) {
+#ifdef GIB_HAVE_LIBURING
+  io_uring_submit(&io->ring);
+#endif
+}
+
+/* Handles completions until *pending drops to zero. */
+static inline void sio_wait(struct sio *io, int *pending) {
+#ifdef GIB_HAVE_LIBURING
+  while (*pending > 0) {
+    struct io_uring_cqe *cqe;
+    int rc = io_uring_wait_cqe(&io->ring, &cqe);
+    if (rc == -EINTR)
+      continue;
+    if (rc < 0)
+      sio_fail("io_uring_wait_cqe", -rc);
+    struct sio_req *r = (struct sio_req *)io_uring_cqe_get_data(cqe);
+    int res = cqe->res;
+    io_uring_cqe_seen(&io->ring, cqe);
+    if (res == -EINTR || res == -EAGAIN) {
+      sio_queue(io, r);
+      io_uring_submit(&io->ring);
+      continue;
+    }
+    if (res < 0)
+      sio_fail(r->write ? "write" : "read", -res);
+    if (res == 0 && r->write)
+      sio_fail("write", EIO);
+    r->done += res;
+    if (res > 0 && r->done < r->len) {
+      /* Short transfer; go again for the rest. */
+      sio_queue(io, r);
+      io_uring_submit(&io->ring);
+      continue;
+    }
+    (*r->pending)--;
+  }
+#endif
+}
+
+struct shard_meta {
+  int n, m, buf_size;
+  long long size;  /* Length of the original file */
+};
+
+static inline void shard_name(char *name, size_t len, const char *prefix, int i) {
+  if (i < 0)
+    snprintf(name, len, "%s.meta", prefix);
+  else
+    snprintf(name, len, "%s.%i", prefix, i);
+}
+
+static inline int meta_write(const char *prefix, const struct shard_meta *meta) {
+  char name[4096];
+  shard_name(name, sizeof(name), prefix, -1);
+  FILE *fp = fopen(name, "w");
+  if (fp == NULL) {
+    perror(name);
+    return -1;
+  }
+  fprintf(fp, "gib-shards 1\nn %i\nm %i\nbuf_size %i\nsize %lld\n",
+	  meta->n, meta->m, meta->buf_size, meta->size);
+  if (fclose(fp) != 0) {
+    perror(name);
+    return -1;
+  }
+  return 0;
+}
+
+static inline int meta_read(const char *prefix, struct shard_meta *meta) {
+  char name[4096];
+  int version;
+  shard_name(name, sizeof(name), prefix, -1);
+  FILE *fp = fopen(name, "r");
+  if (fp == NULL) {
+    perror(name);
+    return -1;
+  }
+  int ok = fscanf(fp, "gib-shards %i n %i m %i buf_size %i size %lld",
+		  &version, &meta->n, &meta->m, &meta->buf_size,
+		  &meta->size) == 5 && version == 1;
+  fclose(fp);
+  if (!ok)
+    fprintf(stderr, "%s is not a shard description.\n", name);
+  return ok ? 0 : -1;
+}
+
+#endif /*GIB_STRIPE_IO_H_*/
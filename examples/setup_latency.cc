@@ -0,0 +1,289 @@
+/* Setup-latency benchmark for small recoveries.  For small buffers the
+ * fixed cost of gib_recover, building and inverting the survivors' matrix,
+ * can outweigh the pass over the data.  For every erasure pattern of one
+ * to m of the n+m buffers, as sweeping_test walks them, this times:
+ *
+ *   build         the survivors' rows of the coding matrix
+ *   invert        gib_galois_gaussian_elim on them
+ *   rows          the recovery rows taken from the inverse
+ *   setup_cold    all of the above, as gib_recover does on a cache miss
+ *   setup_warm    the same rows found in the decode-matrix cache
+ *   data          the coding pass alone, for each buffer size
+ *   recover_cold  gib_recover with no decode-matrix cache, for each size
+ *   recover_warm  gib_recover with the pattern already cached
+ *
+ *   setup_latency [-n n] [-m m] [-s min:max] [-r reps] [-o out.json]
+ *
+ * Sizes go from min to max (512:64K by default) by factors of two, and
+ * each pattern is timed reps (3) times.  The timings are collected into
+ * histograms with power-of-two nanosecond buckets, written as JSON along
+ * with their median, 99th percentile and maximum; a table of those goes
+ * to stderr.  Every pattern's recovery is checked.  The phases are the
+ * CPU implementation's, so it is always used.
+ */
+
+#include <gibraltar.h>
+#include "../inc/gib_galois.h"
+#include "../inc/gib_cpu_funcs.h"
+#include <algorithm>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+using namespace std;
+
+/* Bucket i counts times in [2^(i+MIN_BUCKET_LOG), 2^(i+1+MIN_BUCKET_LOG))
+ * ns; the first and last also take anything below and above.
+ */
+#define MIN_BUCKET_LOG 4
+#define NBUCKETS 24
+
+struct phase {
+  const char *name;
+  int size;                 /* 0 for phases that do not touch the data */
+  vector<double> samples;   /* Nanoseconds */
+};
+
+double now_ns() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec*1e9 + t.tv_nsec;
+}
+
+#define time_ns(ph, cmd) {						\
+    double start_ = now_ns();						\
+    cmd;								\
+    (ph).samples.push_back(now_ns() - start_); }
+
+long parse_size(const char *arg) {
+  char *end;
+  long v = strtol(arg, &end, 10);
+  switch (*end) {
+  case 'M': case 'm': v <<= 10; /* Fall through */
+  case 'K': case 'k': v <<= 10;
+  }
+  return v;
+}
+
+int bucket_of(double ns) {
+  int b = 0;
+  while (b < NBUCKETS - 1 &&
+	 ns >= (double)(1LL << (b + 1 + MIN_BUCKET_LOG)))
+    b++;
+  return b;
+}
+
+void report(FILE *out, vector<phase> &phases) {
+  fprintf(stderr, "%-13s %8s %8s %10s %10s %10s\n", "phase", "size",
+	  "samples", "p50_ns", "p99_ns", "max_ns");
+  fprintf(out, "  \"bucket_ns\": [");
+  for (int b = 0; b < NBUCKETS; b++)
+    fprintf(out, "%s%lld", (b > 0) ? ", " : "", 1LL << (b + MIN_BUCKET_LOG));
+  fprintf(out, "],\n  \"phases\": [\n");
+  for (size_t p = 0; p < phases.size(); p++) {
+    vector<double> &s = phases[p].samples;
+    long long hist[NBUCKETS] = {0};
+    sort(s.begin(), s.end());
+    for (size_t i = 0; i < s.size(); i++)
+      hist[bucket_of(s[i])]++;
+    double p50 = s[(s.size() - 1) / 2];
+    double p99 = s[(size_t)(0.99 * (s.size() - 1) + 0.5)];
+    fprintf(out, "    {\"phase\": \"%s\", \"size\": %i, \"samples\": %zu, "
+	    "\"p50_ns\": %.1f, \"p99_ns\": %.1f, \"max_ns\": %.1f, "
+	    "\"histogram\": [", phases[p].name, phases[p].size, s.size(), p50,
+	    p99, s.back());
+    for (int b = 0; b < NBUCKETS; b++)
+      fprintf(out, "%s%lld", (b > 0) ? ", " : "", hist[b]);
+    fprintf(out, "]}%s\n", (p + 1 < phases.size()) ? "," : "");
+    fprintf(stderr, "%-13s %8i %8zu %10.1f %10.1f %10.1f\n",
+	    phases[p].name, phases[p].size, s.size(), p50, p99, s.back());
+  }
+  fprintf(out, "  ]\n}\n");
+}
+
+void usage() {
+  fprintf(stderr, "Usage:  setup_latency [-n n] [-m m] [-s min:max] "
+	  "[-r reps] [-o out.json]\n");
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  int n = 8, m = 4, reps = 3, opt;
+  long min_size = 512, max_size = 64 << 10;
+  const char *out_path = NULL;
+  while ((opt = getopt(argc, argv, "n:m:s:r:o:")) != -1) {
+    switch (opt) {
+    case 'n': n = atoi(optarg); break;
+    case 'm': m = atoi(optarg); break;
+    case 's': {
+      const char *colon = strchr(optarg, ':');
+      if (colon == NULL)
+	usage();
+      min_size = parse_size(optarg);
+      max_size = parse_size(colon + 1);
+      break;
+    }
+    case 'r': reps = atoi(optarg); break;
+    case 'o': out_path = optarg; break;
+    default: usage();
+    }
+  }
+  if (optind != argc || n < 2 || m < 1 || n + m > 256 || reps < 1 ||
+      min_size <= 0 || max_size < min_size || max_size > (16 << 20))
+    usage();
+
+  /* One context rebuilds the rows on every call, and the other keeps every
+   * pattern.
+   */
+  struct gib_options o;
+  gib_context cold, warm;
+  memset(&o, 0, sizeof(o));
+  o.backend = GIB_BACKEND_CPU;
+  o.decode_cache_size = -1;
+  if (gib_init_opts(n, m, &o, &cold) != GIB_SUC) {
+    fprintf(stderr, "gib_init_opts failed\n");
+    exit(1);
+  }
+  long npatterns = 0;
+  for (int e = 1; e <= m; e++) {
+    long c = 1;
+    for (int i = 0; i < e; i++)
+      c = c * (n + m - i) / (i + 1);
+    npatterns += c;
+  }
+  o.decode_cache_size = (npatterns < (1 << 20)) ? npatterns : (1 << 20);
+  if (gib_init_opts(n, m, &o, &warm) != GIB_SUC) {
+    fprintf(stderr, "gib_init_opts failed\n");
+    exit(1);
+  }
+
+  void *orig_v, *dense_v;
+  int ld;
+  if (gib_alloc(&orig_v, max_size, &ld, cold) != GIB_SUC ||
+      gib_alloc(&dense_v, max_size, &ld, cold) != GIB_SUC) {
+    fprintf(stderr, "gib_alloc failed\n");
+    exit(1);
+  }
+  unsigned char *orig = (unsigned char *)orig_v;
+  unsigned char *dense = (unsigned char *)dense_v;
+  for (long i = 0; i < n*max_size; i++)
+    orig[i] = (unsigned char)rand()%256;
+  gib_generate(orig, max_size, cold);
+
+  vector<phase> phases;
+  const char *setup_names[] = { "build", "invert", "rows", "setup_cold",
+				"setup_warm" };
+  for (int i = 0; i < 5; i++) {
+    phase p;
+    p.name = setup_names[i];
+    p.size = 0;
+    phases.push_back(p);
+  }
+  const char *size_names[] = { "data", "recover_cold", "recover_warm" };
+  for (int i = 0; i < 3; i++)
+    for (long size = min_size; size <= max_size; size *= 2) {
+      phase p;
+      p.name = size_names[i];
+      p.size = size;
+      phases.push_back(p);
+    }
+  phase &build = phases[0], &invert = phases[1], &rows_ph = phases[2];
+  phase &setup_cold = phases[3], &setup_warm = phases[4];
+
+  /* Every combination of e failed buffers, in lexicographic order */
+  for (int e = 1; e <= m; e++) {
+    int failed_idx[256];
+    for (int i = 0; i < e; i++)
+      failed_idx[i] = i;
+    for (;;) {
+      char failed[256];
+      int buf_ids[256], index = 0, f_index = n;
+      memset(failed, 0, sizeof(failed));
+      for (int i = 0; i < e; i++)
+	failed[failed_idx[i]] = 1;
+      for (int i = 0; i < n+m; i++) {
+	if (failed[i])
+	  buf_ids[f_index++] = i;
+	else if (index < n)
+	  buf_ids[index++] = i;
+      }
+
+      unsigned char modA[256*256], inv[256*256], rows[256*256];
+      for (int r = 0; r < reps; r++) {
+	time_ns(build, gib_cpu_survivor_matrix(cold, buf_ids, modA));
+	time_ns(invert, gib_galois_gaussian_elim(modA, inv, n, n));
+	time_ns(rows_ph, gib_cpu_rows_from_inverse(cold, buf_ids, e, inv,
+						   rows));
+	time_ns(setup_cold, gib_cpu_recovery_rows(cold, buf_ids, e, rows));
+	/* The first call caches the pattern. */
+	if (r == 0)
+	  gib_cpu_recovery_rows(warm, buf_ids, e, rows);
+	time_ns(setup_warm, gib_cpu_recovery_rows(warm, buf_ids, e, rows));
+      }
+
+      int p = 5;
+      for (int k = 0; k < 3; k++)
+	for (long size = min_size; size <= max_size; size *= 2, p++) {
+	  unsigned char *src[256], *dst[256];
+	  for (int i = 0; i < n; i++)
+	    src[i] = dense + i*size;
+	  for (int i = 0; i < e; i++)
+	    dst[i] = dense + (n+i)*size;
+	  /* The plan gib_recover would use at this size */
+	  struct gib_cpu_plan plan;
+	  gib_cpu_plan_for(cold, size, &plan);
+	  for (int r = 0; r < reps; r++) {
+	    if (k == 0)
+	      time_ns(phases[p], gib_cpu_code_plan(cold, &plan, rows, n, src,
+						   e, dst, size, NULL))
+	    else if (k == 1)
+	      time_ns(phases[p], gib_recover(dense, size, buf_ids, e, cold))
+	    else
+	      time_ns(phases[p], gib_recover(dense, size, buf_ids, e, warm))
+	  }
+	}
+
+      /* Check the pattern at the largest size. */
+      for (int i = 0; i < n; i++)
+	memcpy(dense + i*max_size, orig + buf_ids[i]*max_size, max_size);
+      memset(dense + n*max_size, 0, e*max_size);
+      gib_recover(dense, max_size, buf_ids, e, warm);
+      for (int i = 0; i < n+e; i++)
+	if (memcmp(dense + i*max_size, orig + buf_ids[i]*max_size,
+		   max_size)) {
+	  printf("Recovery failed on buffer %i/%i.\n", i, buf_ids[i]);
+	  exit(1);
+	}
+
+      /* Next combination */
+      int i = e - 1;
+      while (i >= 0 && failed_idx[i] == n + m - e + i)
+	i--;
+      if (i < 0)
+	break;
+      failed_idx[i]++;
+      for (int j = i + 1; j < e; j++)
+	failed_idx[j] = failed_idx[j-1] + 1;
+    }
+  }
+
+  FILE *out = stdout;
+  if (out_path != NULL && (out = fopen(out_path, "w")) == NULL) {
+    perror(out_path);
+    exit(1);
+  }
+  fprintf(out, "{\n  \"benchmark\": \"setup_latency\",\n  \"version\": 1,\n"
+	  "  \"n\": %i,\n  \"m\": %i,\n  \"patterns\": %li,\n"
+	  "  \"reps\": %i,\n", n, m, npatterns, reps);
+  report(out, phases);
+  if (out != stdout)
+    fclose(out);
+
+  gib_free(orig_v, cold);
+  gib_free(dense_v, cold);
+  gib_destroy(cold);
+  gib_destroy(warm);
+  return 0;
+}
@@ -0,0 +1,131 @@
+/* Checks that tuned plans are reused.  For each n+m given, a context is
+ * tuned with GIB_CACHE_DIR pointed at a fresh directory, which saves its
+ * plans there.  A second context must then load them:  the tuner saves by
+ * renaming a new file into place, so if the file's inode or modification
+ * time has changed, the second context timed everything again.  Both
+ * contexts' recoveries are also checked.
+ *
+ *   tune_test [n+m ...]
+ *
+ * By default, 6+3, 3+3, 12+4 and 8+4 are checked, between them covering
+ * default tiles that are and are not multiples of 4 KiB.
+ */
+
+#include <gibraltar.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/stat.h>
+#include <unistd.h>
+using namespace std;
+
+const int buf_size = 64*1024;
+
+/* Generates and recovers the first m buffers of a random stripe with gc. */
+int check_context(gib_context gc) {
+  int n = gc->n, m = gc->m, ld, buf_ids[256];
+  void *stripe_v, *orig_v;
+  if (gib_alloc(&stripe_v, buf_size, &ld, gc) != GIB_SUC ||
+      gib_alloc(&orig_v, buf_size, &ld, gc) != GIB_SUC) {
+    fprintf(stderr, "gib_alloc failed\n");
+    return 1;
+  }
+  unsigned char *stripe = (unsigned char *)stripe_v;
+  unsigned char *orig = (unsigned char *)orig_v;
+  for (int i = 0; i < n*ld; i++)
+    stripe[i] = (unsigned char)rand();
+  int rc = gib_generate(stripe, ld, gc);
+  memcpy(orig, stripe, (size_t)(n+m)*ld);
+
+  /* Buffers m..n+m-1 survive, in the first n slots; 0..m-1 are rebuilt
+   * after them.
+   */
+  for (int i = 0; i < n; i++)
+    buf_ids[i] = m + i;
+  for (int i = 0; i < m; i++)
+    buf_ids[n+i] = i;
+  for (int i = 0; i < n; i++)
+    memcpy(stripe + i*ld, orig + buf_ids[i]*ld, ld);
+  if (rc == GIB_SUC)
+    rc = gib_recover(stripe, ld, buf_ids, m, gc);
+  for (int i = 0; rc == GIB_SUC && i < m; i++)
+    if (memcmp(stripe + (n+i)*ld, orig + i*ld, ld))
+      rc = GIB_ERR;
+  gib_free(stripe_v, gc);
+  gib_free(orig_v, gc);
+  if (rc != GIB_SUC)
+    fprintf(stderr, "%i+%i:  recovery failed\n", n, m);
+  return rc != GIB_SUC;
+}
+
+int test_shape(const char *dir, int n, int m) {
+  struct gib_options o;
+  struct stat before, after;
+  char path[4096];
+  gib_context gc;
+  int nthreads = (getenv("GIB_NUM_THREADS") != NULL) ?
+    atoi(getenv("GIB_NUM_THREADS")) : 1;
+
+  memset(&o, 0, sizeof(o));
+  o.backend = GIB_BACKEND_CPU;
+  o.tune = 1;
+  if (nthreads < 1)
+    nthreads = 1;
+  snprintf(path, sizeof(path), "%s/gib_cpu_%i+%i_e%i_t%i.tune", dir, n, m,
+	   GIB_ENGINE_TABLE, nthreads);
+
+  if (gib_init_opts(n, m, &o, &gc) != GIB_SUC) {
+    fprintf(stderr, "%i+%i:  gib_init_opts failed\n", n, m);
+    return 1;
+  }
+  int bad = check_context(gc);
+  gib_destroy(gc);
+  if (stat(path, &before) != 0) {
+    fprintf(stderr, "%i+%i:  no plans were saved to %s\n", n, m, path);
+    return 1;
+  }
+
+  if (gib_init_opts(n, m, &o, &gc) != GIB_SUC) {
+    fprintf(stderr, "%i+%i:  gib_init_opts failed\n", n, m);
+    return 1;
+  }
+  bad |= check_context(gc);
+  gib_destroy(gc);
+  if (stat(path, &after) != 0 || after.st_ino != before.st_ino ||
+      after.st_mtime != before.st_mtime) {
+    fprintf(stderr, "%i+%i:  the saved plans were timed again\n", n, m);
+    bad = 1;
+  }
+  unlink(path);
+  printf("%i+%i:  %s\n", n, m, bad ? "FAILED" : "ok");
+  return bad;
+}
+
+int main(int argc, char **argv) {
+  const char *shapes[] = { "6+3", "3+3", "12+4", "8+4" };
+  char dir[] = "/tmp/gib_tune_testXXXXXX";
+  int bad = 0;
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    exit(1);
+  }
+  setenv("GIB_CACHE_DIR", dir, 1);
+  if (argc == 1)
+    for (int i = 0; i < 4; i++) {
+      int n, m;
+      sscanf(shapes[i], "%i+%i", &n, &m);
+      bad |= test_shape(dir, n, m);
+    }
+  for (int i = 1; i < argc; i++) {
+    int n, m;
+    if (sscanf(argv[i], "%i+%i", &n, &m) != 2 || n < 2 || m < 1 ||
+	n + m > 256) {
+      fprintf(stderr, "usage: %s [n+m ...]\n", argv[0]);
+      rmdir(dir);
+      exit(1);
+    }
+    bad |= test_shape(dir, n, m);
+  }
+  rmdir(dir);
+  return bad;
+}
@@ -0,0 +1,768 @@
+/* Checks the library's calls against plain gib_generate and gib_recover.
+ * For a few shapes and buffer sizes, including sizes that are not a
+ * multiple of 32 or 512 bytes, each check codes random data with one of
+ * the newer calls and compares the result with what gib_generate writes
+ * for the same data with the table engine (or the XOR engine, whose parity
+ * is its own), or with the data itself once it is recovered.  The CPU
+ * implementation is always used.
+ *
+ *   verify [check ...]
+ *
+ * With no arguments every check is run.  Each prints "ok" or what went
+ * wrong, and the exit status is 1 if any failed.
+ */
+
+#include <gibraltar.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/uio.h>
+using namespace std;
+
+struct shape {
+  int n, m;
+};
+const shape shapes[] = { {2, 1}, {4, 2}, {6, 3}, {10, 4} };
+const int nshapes = sizeof(shapes)/sizeof(shapes[0]);
+/* Bytes per buffer; the XOR engine only takes multiples of 512. */
+const int sizes[] = { 1, 31, 100, 511, 4096, 5000, 70001 };
+const int nsizes = sizeof(sizes)/sizeof(sizes[0]);
+const int xor_sizes[] = { 512, 1536, 8192, 35840 };
+const int nxor_sizes = sizeof(xor_sizes)/sizeof(xor_sizes[0]);
+
+gib_context context(int n, int m, int engine, int matrix) {
+  struct gib_options o;
+  gib_context gc;
+  memset(&o, 0, sizeof(o));
+  o.backend = GIB_BACKEND_CPU;
+  o.engine = engine;
+  o.matrix = matrix;
+  if (gib_init_opts(n, m, &o, &gc) != GIB_SUC) {
+    fprintf(stderr, "gib_init_opts failed for %i+%i\n", n, m);
+    exit(1);
+  }
+  return gc;
+}
+
+void fill(unsigned char *p, size_t len) {
+  for (size_t i = 0; i < len; i++)
+    p[i] = (unsigned char)rand();
+}
+
+/* Writes the parity of the stripe s with gib_generate, using a
+ * table-engine context and the given matrix.  The XOR engine writes parity
+ * of its own, so for it the parity is written by an XOR-engine context.
+ */
+void reference_parity(unsigned char *s, int n, int m, int engine, int matrix,
+		      int size) {
+  gib_context gc = context(n, m, (engine == GIB_ENGINE_XOR) ?
+			   GIB_ENGINE_XOR : GIB_ENGINE_TABLE, matrix);
+  gib_generate(s, size, gc);
+  gib_destroy(gc);
+}
+
+/* A stripe of n+m buffers of size bytes, with random data and the parity
+ * reference_parity writes.
+ */
+unsigned char *reference(int n, int m, int engine, int matrix, int size) {
+  unsigned char *s = (unsigned char *)malloc((size_t)(n+m)*size);
+  fill(s, (size_t)(n+m)*size);
+  reference_parity(s, n, m, engine, matrix, size);
+  return s;
+}
+
+/* Picks e lost buffers out of n+m, data or parity, and lays buf_ids out as
+ * gib_recover wants:  n survivors, then the lost ones.
+ */
+void pick_lost(int n, int m, int e, int *buf_ids) {
+  char lost[256];
+  memset(lost, 0, sizeof(lost));
+  for (int i = 0; i < e; i++) {
+    int probe;
+    do {
+      probe = rand() % (n+m);
+    } while (lost[probe]);
+    lost[probe] = 1;
+  }
+  int index = 0, l_index = n;
+  for (int i = 0; i < n+m; i++) {
+    if (lost[i])
+      buf_ids[l_index++] = i;
+    else if (index < n)
+      buf_ids[index++] = i;
+  }
+}
+
+int fail(const char *check, const char *what, int n, int m, int size) {
+  printf("%s:  %s differs for %i+%i, %i bytes\n", check, what, n, m, size);
+  return 1;
+}
+
+/* Cuts size bytes at p into segments of 1 to 700 bytes, with some empty
+ * ones, so that boundaries fall anywhere.
+ */
+int chain(unsigned char *p, int size, struct iovec *v) {
+  int cnt = 0;
+  for (int off = 0; off < size; ) {
+    int len = 1 + rand() % 700;
+    if (len > size - off)
+      len = size - off;
+    v[cnt].iov_base = p + off;
+    v[cnt++].iov_len = len;
+    if (rand() % 8 == 0) {
+      v[cnt].iov_base = p;
+      v[cnt++].iov_len = 0;
+    }
+    off += len;
+  }
+  return cnt;
+}
+
+/* gib_generate_iov and gib_recover_iov on buffers allocated one by one, for
+ * each engine.
+ */
+int check_iov_engine(int engine) {
+  int matrix = (engine == GIB_ENGINE_XOR) ? GIB_MATRIX_CAUCHY :
+    GIB_MATRIX_VANDERMONDE;
+  const int *sz = (engine == GIB_ENGINE_XOR) ? xor_sizes : sizes;
+  int nsz = (engine == GIB_ENGINE_XOR) ? nxor_sizes : nsizes;
+  int bad = 0;
+  for (int si = 0; si < nshapes; si++)
+    for (int zi = 0; zi < nsz; zi++) {
+      int n = shapes[si].n, m = shapes[si].m, size = sz[zi];
+      unsigned char *ref = reference(n, m, engine, matrix, size);
+      void *b[256], *rb[256];
+      int buf_ids[256], rc;
+      gib_context gc = context(n, m, engine, matrix);
+
+      for (int i = 0; i < n+m; i++) {
+	b[i] = malloc(size);
+	if (i < n)
+	  memcpy(b[i], ref + (size_t)i*size, size);
+	else
+	  memset(b[i], 0, size);
+      }
+      rc = gib_generate_iov(b, b + n, size, gc);
+      for (int i = 0; i < n+m; i++)
+	rc |= memcmp(b[i], ref + (size_t)i*size, size);
+      if (rc)
+	bad |= fail("iov", "generated parity", n, m, size);
+
+      pick_lost(n, m, m, buf_ids);
+      for (int i = 0; i < n+m; i++)
+	rb[i] = b[buf_ids[i]];
+      for (int i = n; i < n+m; i++)
+	memset(rb[i], 0, size);
+      rc = gib_recover_iov(rb, size, buf_ids, m, gc);
+      for (int i = 0; i < n+m; i++)
+	rc |= memcmp(b[i], ref + (size_t)i*size, size);
+      if (rc)
+	bad |= fail("iov", "recovered stripe", n, m, size);
+
+      for (int i = 0; i < n+m; i++)
+	free(b[i]);
+      gib_destroy(gc);
+      free(ref);
+    }
+  return bad;
+}
+
+int check_iov() {
+  return check_iov_engine(GIB_ENGINE_TABLE) |
+    check_iov_engine(GIB_ENGINE_XOR) | check_iov_engine(GIB_ENGINE_JIT);
+}
+
+/* gib_generate_iovec and gib_recover_iovec on chains cut at random, for
+ * each engine.  The XOR engine has to copy blocks split across segments.
+ */
+int check_iovec_engine(int engine) {
+  int matrix = (engine == GIB_ENGINE_XOR) ? GIB_MATRIX_CAUCHY :
+    GIB_MATRIX_VANDERMONDE;
+  const int *sz = (engine == GIB_ENGINE_XOR) ? xor_sizes : sizes;
+  int nsz = (engine == GIB_ENGINE_XOR) ? nxor_sizes : nsizes;
+  int bad = 0;
+  for (int si = 0; si < nshapes; si++)
+    for (int zi = 0; zi < nsz; zi++) {
+      int n = shapes[si].n, m = shapes[si].m, size = sz[zi];
+      unsigned char *ref = reference(n, m, engine, matrix, size);
+      unsigned char *s = (unsigned char *)malloc((size_t)(n+m)*size);
+      struct iovec *v[256];
+      int cnt[256], buf_ids[256];
+      gib_context gc = context(n, m, engine, matrix);
+
+      memcpy(s, ref, (size_t)n*size);
+      memset(s + (size_t)n*size, 0, (size_t)m*size);
+      for (int i = 0; i < n+m; i++) {
+	v[i] = (struct iovec *)malloc(2*(size + 1)*sizeof(struct iovec));
+	cnt[i] = chain(s + (size_t)i*size, size, v[i]);
+      }
+      if (gib_generate_iovec(v, cnt, size, gc) != GIB_SUC ||
+	  memcmp(s, ref, (size_t)(n+m)*size))
+	bad |= fail("iovec", "generated parity", n, m, size);
+
+      /* Chains for the survivors and then the lost buffers, which are
+       * cleared first
+       */
+      struct iovec *rv[256];
+      int rcnt[256];
+      pick_lost(n, m, m, buf_ids);
+      for (int i = 0; i < n+m; i++) {
+	rv[i] = v[buf_ids[i]];
+	rcnt[i] = cnt[buf_ids[i]];
+      }
+      for (int i = n; i < n+m; i++)
+	memset(s + (size_t)buf_ids[i]*size, 0, size);
+      if (gib_recover_iovec(rv, rcnt, size, buf_ids, m, gc) != GIB_SUC ||
+	  memcmp(s, ref, (size_t)(n+m)*size))
+	bad |= fail("iovec", "recovered stripe", n, m, size);
+
+      for (int i = 0; i < n+m; i++)
+	free(v[i]);
+      gib_destroy(gc);
+      free(s);
+      free(ref);
+    }
+  return bad;
+}
+
+int check_iovec() {
+  return check_iovec_engine(GIB_ENGINE_TABLE) |
+    check_iovec_engine(GIB_ENGINE_XOR) | check_iovec_engine(GIB_ENGINE_JIT);
+}
+
+/* gib_recover_sparse on up to m lost buffers, data and parity, left where
+ * they are in the stripe.  gib_recover_sparse_nc rebuilds only the first
+ * half of each, and the rest must be left alone.
+ */
+int check_sparse() {
+  int bad = 0;
+  for (int si = 0; si < nshapes; si++)
+    for (int zi = 0; zi < nsizes; zi++) {
+      int n = shapes[si].n, m = shapes[si].m, size = sizes[zi];
+      int work = (size + 1)/2, lost = 1 + rand() % m, buf_ids[256];
+      unsigned char *ref = reference(n, m, GIB_ENGINE_TABLE,
+				     GIB_MATRIX_VANDERMONDE, size);
+      unsigned char *s = (unsigned char *)malloc((size_t)(n+m)*size);
+      char failed[256];
+      gib_context gc = context(n, m, GIB_ENGINE_TABLE,
+			       GIB_MATRIX_VANDERMONDE);
+
+      pick_lost(n, m, lost, buf_ids);
+      memset(failed, 0, sizeof(failed));
+      for (int i = n; i < n+lost; i++)
+	failed[buf_ids[i]] = 1;
+
+      memcpy(s, ref, (size_t)(n+m)*size);
+      for (int i = 0; i < n+m; i++)
+	if (failed[i])
+	  memset(s + (size_t)i*size, 0, size);
+      if (gib_recover_sparse(s, size, failed, gc) != GIB_SUC ||
+	  memcmp(s, ref, (size_t)(n+m)*size))
+	bad |= fail("sparse", "recovered stripe", n, m, size);
+
+      memcpy(s, ref, (size_t)(n+m)*size);
+      for (int i = 0; i < n+m; i++)
+	if (failed[i])
+	  memset(s + (size_t)i*size, 0, size);
+      int rc = gib_recover_sparse_nc(s, size, work, failed, gc);
+      for (int i = 0; i < n+m; i++) {
+	unsigned char *b = s + (size_t)i*size, *r = ref + (size_t)i*size;
+	if (!failed[i])
+	  rc |= memcmp(b, r, size);
+	else {
+	  rc |= memcmp(b, r, work);
+	  for (int j = work; j < size; j++)
+	    rc |= b[j];
+	}
+      }
+      if (rc)
+	bad |= fail("sparse", "partly recovered stripe", n, m, size);
+
+      gib_destroy(gc);
+      free(s);
+      free(ref);
+    }
+  return bad;
+}
+
+/* Random small writes, each applied to the parity with gib_update or
+ * gib_update_delta and then to the data.  The parity must then be what
+ * gib_generate writes for the new data.
+ */
+int check_update_engine(int engine) {
+  int matrix = (engine == GIB_ENGINE_XOR) ? GIB_MATRIX_CAUCHY :
+    GIB_MATRIX_VANDERMONDE;
+  const int *sz = (engine == GIB_ENGINE_XOR) ? xor_sizes : sizes;
+  int nsz = (engine == GIB_ENGINE_XOR) ? nxor_sizes : nsizes;
+  int bad = 0;
+  for (int si = 0; si < nshapes; si++)
+    for (int zi = 0; zi < nsz; zi++) {
+      int n = shapes[si].n, m = shapes[si].m, size = sz[zi], rc = 0;
+      unsigned char *s = reference(n, m, engine, matrix, size);
+      unsigned char *ref = (unsigned char *)malloc((size_t)(n+m)*size);
+      unsigned char *old_data = (unsigned char *)malloc(size);
+      unsigned char *new_data = (unsigned char *)malloc(size);
+      gib_context gc = context(n, m, engine, matrix);
+
+      for (int w = 0; w < 4; w++) {
+	/* The XOR engine takes whole blocks of 512 bytes. */
+	int unit = (engine == GIB_ENGINE_XOR) ? 512 : 1;
+	int index = rand() % n, offset = unit*(rand() % (size/unit));
+	int len = unit*(1 + rand() % ((size - offset)/unit));
+	unsigned char *d = s + (size_t)index*size + offset;
+	memcpy(old_data, d, len);
+	fill(new_data, len);
+	if (w % 2 == 0)
+	  rc |= gib_update(s, size, index, offset, len, old_data, new_data,
+			   gc);
+	else {
+	  for (int i = 0; i < len; i++)
+	    old_data[i] ^= new_data[i];
+	  rc |= gib_update_delta(s, size, index, offset, len, old_data, gc);
+	}
+	memcpy(d, new_data, len);
+      }
+      memcpy(ref, s, (size_t)(n+m)*size);
+      reference_parity(ref, n, m, engine, matrix, size);
+      if (rc || memcmp(s, ref, (size_t)(n+m)*size))
+	bad |= fail("update", "updated parity", n, m, size);
+
+      gib_destroy(gc);
+      free(new_data);
+      free(old_data);
+      free(ref);
+      free(s);
+    }
+  return bad;
+}
+
+int check_update() {
+  return check_update_engine(GIB_ENGINE_TABLE) |
+    check_update_engine(GIB_ENGINE_XOR) | check_update_engine(GIB_ENGINE_JIT);
+}
+
+/* Called on the worker when a recovery finishes */
+void recovered(gib_job job, void *arg) {
+  *(int *)arg = gib_job_wait(job);
+  gib_job_free(job);
+}
+
+/* For each shape, a generate of every size is queued at once and fetched
+ * with gib_poll, and then a recovery of every size is submitted with a
+ * callback, which gib_destroy waits for.
+ */
+int check_async() {
+  int bad = 0;
+  for (int si = 0; si < nshapes; si++) {
+    int n = shapes[si].n, m = shapes[si].m;
+    unsigned char *ref[nsizes], *s[nsizes];
+    int buf_ids[nsizes][256], rc[nsizes], got = 0;
+    gib_job jobs[nsizes];
+    gib_context gc = context(n, m, GIB_ENGINE_TABLE, GIB_MATRIX_VANDERMONDE);
+
+    for (int zi = 0; zi < nsizes; zi++) {
+      int size = sizes[zi];
+      ref[zi] = reference(n, m, GIB_ENGINE_TABLE, GIB_MATRIX_VANDERMONDE,
+			  size);
+      s[zi] = (unsigned char *)malloc((size_t)(n+m)*size);
+      memcpy(s[zi], ref[zi], (size_t)n*size);
+      memset(s[zi] + (size_t)n*size, 0, (size_t)m*size);
+      if (gib_submit_generate(s[zi], size, gc, NULL, NULL, &jobs[zi]) !=
+	  GIB_SUC) {
+	bad |= fail("async", "submitted generate", n, m, size);
+	jobs[zi] = NULL;
+	got++;
+      }
+    }
+    while (got < nsizes) {
+      gib_job done[nsizes];
+      int r = gib_poll(gc, done, nsizes);
+      for (int i = 0; i < r; i++) {
+	int zi;
+	for (zi = 0; jobs[zi] != done[i]; zi++)
+	  ;
+	int size = sizes[zi];
+	if (gib_job_wait(done[i]) != GIB_SUC ||
+	    memcmp(s[zi], ref[zi], (size_t)(n+m)*size))
+	  bad |= fail("async", "generated parity", n, m, size);
+	gib_job_free(done[i]);
+	jobs[zi] = NULL;
+      }
+      got += r;
+    }
+
+    for (int zi = 0; zi < nsizes; zi++) {
+      int size = sizes[zi];
+      pick_lost(n, m, m, buf_ids[zi]);
+      for (int i = 0; i < n; i++)
+	memcpy(s[zi] + (size_t)i*size, ref[zi] + (size_t)buf_ids[zi][i]*size,
+	       size);
+      memset(s[zi] + (size_t)n*size, 0, (size_t)m*size);
+      rc[zi] = -1;
+      if (gib_submit_recover(s[zi], size, buf_ids[zi], m, gc, recovered,
+			     &rc[zi], NULL) != GIB_SUC)
+	bad |= fail("async", "submitted recovery", n, m, size);
+    }
+    gib_destroy(gc);
+    for (int zi = 0; zi < nsizes; zi++) {
+      int size = sizes[zi], r = rc[zi];
+      for (int i = 0; r == GIB_SUC && i < n+m; i++)
+	r = memcmp(s[zi] + (size_t)i*size,
+		   ref[zi] + (size_t)buf_ids[zi][i]*size, size);
+      if (r != GIB_SUC)
+	bad |= fail("async", "recovered stripe", n, m, size);
+      free(s[zi]);
+      free(ref[zi]);
+    }
+  }
+  return bad;
+}
+
+/* gib_generate_batch on one stripe of every size, three times over, for
+ * each engine
+ */
+int check_batch_engine(int engine) {
+  int matrix = (engine == GIB_ENGINE_XOR) ? GIB_MATRIX_CAUCHY :
+    GIB_MATRIX_VANDERMONDE;
+  const int *sz = (engine == GIB_ENGINE_XOR) ? xor_sizes : sizes;
+  int nsz = (engine == GIB_ENGINE_XOR) ? nxor_sizes : nsizes;
+  int bad = 0;
+  for (int si = 0; si < nshapes; si++) {
+    int n = shapes[si].n, m = shapes[si].m, count = 3*nsz;
+    unsigned char *ref[3*nsizes];
+    struct gib_stripe stripes[3*nsizes];
+    gib_context gc = context(n, m, engine, matrix);
+
+    for (int i = 0; i < count; i++) {
+      int size = sz[i % nsz];
+      ref[i] = reference(n, m, engine, matrix, size);
+      stripes[i].buffers = malloc((size_t)(n+m)*size);
+      stripes[i].buf_size = size;
+      memcpy(stripes[i].buffers, ref[i], (size_t)n*size);
+      memset((unsigned char *)stripes[i].buffers + (size_t)n*size, 0,
+	     (size_t)m*size);
+    }
+    int rc = gib_generate_batch(stripes, count, gc);
+    for (int i = 0; i < count; i++) {
+      int size = stripes[i].buf_size;
+      if (rc != GIB_SUC ||
+	  memcmp(stripes[i].buffers, ref[i], (size_t)(n+m)*size))
+	bad |= fail("batch", "generated parity", n, m, size);
+      free(stripes[i].buffers);
+      free(ref[i]);
+    }
+    gib_destroy(gc);
+  }
+  return bad;
+}
+
+int check_batch() {
+  return check_batch_engine(GIB_ENGINE_TABLE) |
+    check_batch_engine(GIB_ENGINE_XOR) | check_batch_engine(GIB_ENGINE_JIT);
+}
+
+/* gib_recover rebuilding data and parity buffers together, and
+ * gib_regenerate rebuilding some of the parity, for each engine
+ */
+int check_mixed_engine(int engine) {
+  int matrix = (engine == GIB_ENGINE_XOR) ? GIB_MATRIX_CAUCHY :
+    GIB_MATRIX_VANDERMONDE;
+  const int *sz = (engine == GIB_ENGINE_XOR) ? xor_sizes : sizes;
+  int nsz = (engine == GIB_ENGINE_XOR) ? nxor_sizes : nsizes;
+  int bad = 0;
+  for (int si = 0; si < nshapes; si++)
+    for (int zi = 0; zi < nsz; zi++) {
+      int n = shapes[si].n, m = shapes[si].m, size = sz[zi], rc;
+      int lost = 1 + rand() % m, buf_ids[256], parity_ids[256], count = 0;
+      unsigned char *ref = reference(n, m, engine, matrix, size);
+      unsigned char *s = (unsigned char *)malloc((size_t)(n+m)*size);
+      gib_context gc = context(n, m, engine, matrix);
+
+      pick_lost(n, m, lost, buf_ids);
+      for (int i = 0; i < n; i++)
+	memcpy(s + (size_t)i*size, ref + (size_t)buf_ids[i]*size, size);
+      memset(s + (size_t)n*size, 0, (size_t)m*size);
+      rc = gib_recover(s, size, buf_ids, lost, gc);
+      for (int i = 0; i < n+lost; i++)
+	rc |= memcmp(s + (size_t)i*size, ref + (size_t)buf_ids[i]*size, size);
+      if (rc)
+	bad |= fail("mixed", "recovered buffers", n, m, size);
+
+      memcpy(s, ref, (size_t)(n+m)*size);
+      for (int i = n; i < n+m; i++)
+	if (rand() % 2 || (i == n+m-1 && count == 0)) {
+	  parity_ids[count++] = i;
+	  memset(s + (size_t)i*size, 0, size);
+	}
+      if (gib_regenerate(s, size, parity_ids, count, gc) != GIB_SUC ||
+	  memcmp(s, ref, (size_t)(n+m)*size))
+	bad |= fail("mixed", "regenerated parity", n, m, size);
+
+      gib_destroy(gc);
+      free(s);
+      free(ref);
+    }
+  return bad;
+}
+
+int check_mixed() {
+  return check_mixed_engine(GIB_ENGINE_TABLE) |
+    check_mixed_engine(GIB_ENGINE_XOR) | check_mixed_engine(GIB_ENGINE_JIT);
+}
+
+/* CRC32C a bit at a time, to check the library's against */
+unsigned int crc32c(const unsigned char *p, int len) {
+  unsigned int crc = ~0u;
+  for (int i = 0; i < len; i++) {
+    crc ^= p[i];
+    for (int b = 0; b < 8; b++)
+      crc = (crc >> 1) ^ (0x82f63b78 & (0u - (crc & 1)));
+  }
+  return ~crc;
+}
+
+/* gib_generate_crc and gib_recover_crc, whose buffers must match the
+ * reference stripe and whose CRCs must match crc32c's, for each engine
+ */
+int check_crc_engine(int engine) {
+  int matrix = (engine == GIB_ENGINE_XOR) ? GIB_MATRIX_CAUCHY :
+    GIB_MATRIX_VANDERMONDE;
+  const int *sz = (engine == GIB_ENGINE_XOR) ? xor_sizes : sizes;
+  int nsz = (engine == GIB_ENGINE_XOR) ? nxor_sizes : nsizes;
+  int bad = 0;
+  for (int si = 0; si < nshapes; si++)
+    for (int zi = 0; zi < nsz; zi++) {
+      int n = shapes[si].n, m = shapes[si].m, size = sz[zi], rc;
+      int lost = 1 + rand() % m, buf_ids[256];
+      unsigned int crcs[256];
+      unsigned char *ref = reference(n, m, engine, matrix, size);
+      unsigned char *s = (unsigned char *)malloc((size_t)(n+m)*size);
+      gib_context gc = context(n, m, engine, matrix);
+
+      memcpy(s, ref, (size_t)n*size);
+      memset(s + (size_t)n*size, 0, (size_t)m*size);
+      rc = gib_generate_crc(s, size, crcs, gc);
+      rc |= memcmp(s, ref, (size_t)(n+m)*size);
+      for (int i = 0; i < n+m; i++)
+	rc |= (crcs[i] != crc32c(ref + (size_t)i*size, size));
+      if (rc)
+	bad |= fail("crc", "generated parity or CRCs", n, m, size);
+
+      pick_lost(n, m, lost, buf_ids);
+      for (int i = 0; i < n; i++)
+	memcpy(s + (size_t)i*size, ref + (size_t)buf_ids[i]*size, size);
+      memset(s + (size_t)n*size, 0, (size_t)m*size);
+      rc = gib_recover_crc(s, size, buf_ids, lost, crcs, gc);
+      for (int i = 0; i < n+lost; i++) {
+	unsigned char *r = ref + (size_t)buf_ids[i]*size;
+	rc |= memcmp(s + (size_t)i*size, r, size);
+	rc |= (crcs[i] != crc32c(r, size));
+      }
+      if (rc)
+	bad |= fail("crc", "recovered buffers or CRCs", n, m, size);
+
+      gib_destroy(gc);
+      free(s);
+      free(ref);
+    }
+  return bad;
+}
+
+int check_crc() {
+  /* The standard check value */
+  if (crc32c((const unsigned char *)"123456789", 9) != 0xe3069283) {
+    printf("crc:  the test's own CRC32C is wrong\n");
+    return 1;
+  }
+  return check_crc_engine(GIB_ENGINE_TABLE) |
+    check_crc_engine(GIB_ENGINE_XOR) | check_crc_engine(GIB_ENGINE_JIT);
+}
+
+/* The XOR engine's parity is its own, so gib_generate and gib_recover are
+ * checked by losing up to m buffers at a time and rebuilding them from the
+ * rest.  Lengths that are not whole blocks must be refused, which the
+ * library reports on stderr.
+ */
+int check_xor() {
+  int bad = 0;
+  for (int si = 0; si < nshapes; si++) {
+    int n = shapes[si].n, m = shapes[si].m;
+    gib_context gc = context(n, m, GIB_ENGINE_XOR, GIB_MATRIX_CAUCHY);
+    for (int zi = 0; zi < nxor_sizes; zi++) {
+      int size = xor_sizes[zi], buf_ids[256];
+      unsigned char *ref = (unsigned char *)malloc((size_t)(n+m)*size);
+      unsigned char *s = (unsigned char *)malloc((size_t)(n+m)*size);
+
+      fill(ref, (size_t)n*size);
+      memset(ref + (size_t)n*size, 0, (size_t)m*size);
+      if (gib_generate(ref, size, gc) != GIB_SUC)
+	bad |= fail("xor", "generated parity", n, m, size);
+      for (int t = 0; t < 8; t++) {
+	int lost = 1 + rand() % m, rc;
+	pick_lost(n, m, lost, buf_ids);
+	for (int i = 0; i < n; i++)
+	  memcpy(s + (size_t)i*size, ref + (size_t)buf_ids[i]*size, size);
+	memset(s + (size_t)n*size, 0, (size_t)m*size);
+	rc = gib_recover(s, size, buf_ids, lost, gc);
+	for (int i = n; i < n+lost; i++)
+	  rc |= memcmp(s + (size_t)i*size, ref + (size_t)buf_ids[i]*size,
+		       size);
+	if (rc)
+	  bad |= fail("xor", "recovered buffers", n, m, size);
+      }
+      free(s);
+      free(ref);
+    }
+    for (int zi = 0; zi < nsizes; zi++) {
+      int size = sizes[zi];
+      if (size % 512 == 0)
+	continue;
+      unsigned char *s = (unsigned char *)calloc(n+m, size);
+      if (gib_generate(s, size, gc) == GIB_SUC)
+	bad |= fail("xor", "refusal of a partial block", n, m, size);
+      free(s);
+    }
+    gib_destroy(gc);
+  }
+  return bad;
+}
+
+/* Recovery with a Cauchy matrix goes through its closed-form inverse.
+ * The table and JIT engines must write the same Cauchy parity, and each
+ * must rebuild up to m lost buffers of either kind.  A wider shape than
+ * the others is included.
+ */
+int check_cauchy() {
+  const shape wide[] = { {2, 1}, {4, 2}, {10, 4}, {24, 8} };
+  const int engines[] = { GIB_ENGINE_TABLE, GIB_ENGINE_JIT };
+  int bad = 0;
+  for (int si = 0; si < 4; si++)
+    for (int zi = 0; zi < nsizes; zi++)
+      for (int ei = 0; ei < 2; ei++) {
+	int n = wide[si].n, m = wide[si].m, size = sizes[zi], rc;
+	int buf_ids[256];
+	unsigned char *ref = reference(n, m, GIB_ENGINE_TABLE,
+				       GIB_MATRIX_CAUCHY, size);
+	unsigned char *s = (unsigned char *)malloc((size_t)(n+m)*size);
+	gib_context gc = context(n, m, engines[ei], GIB_MATRIX_CAUCHY);
+
+	memcpy(s, ref, (size_t)n*size);
+	memset(s + (size_t)n*size, 0, (size_t)m*size);
+	if (gib_generate(s, size, gc) != GIB_SUC ||
+	    memcmp(s, ref, (size_t)(n+m)*size))
+	  bad |= fail("cauchy", "generated parity", n, m, size);
+
+	for (int t = 0; t < 4; t++) {
+	  int lost = 1 + rand() % m;
+	  pick_lost(n, m, lost, buf_ids);
+	  for (int i = 0; i < n; i++)
+	    memcpy(s + (size_t)i*size, ref + (size_t)buf_ids[i]*size, size);
+	  memset(s + (size_t)n*size, 0, (size_t)m*size);
+	  rc = gib_recover(s, size, buf_ids, lost, gc);
+	  for (int i = n; i < n+lost; i++)
+	    rc |= memcmp(s + (size_t)i*size, ref + (size_t)buf_ids[i]*size,
+			 size);
+	  if (rc)
+	    bad |= fail("cauchy", "recovered buffers", n, m, size);
+	}
+	gib_destroy(gc);
+	free(s);
+	free(ref);
+      }
+  return bad;
+}
+
+/* The JIT engine must write the table engine's parity and rebuild the
+ * same buffers, with either matrix.  Each erasure pattern is recovered
+ * twice, the second time with the code generated the first.  Where no code
+ * can be generated, the engine falls back to the tables and this checks
+ * those.
+ */
+int check_jit() {
+  const int matrices[] = { GIB_MATRIX_VANDERMONDE, GIB_MATRIX_CAUCHY };
+  int bad = 0;
+  for (int mi = 0; mi < 2; mi++)
+    for (int si = 0; si < nshapes; si++)
+      for (int zi = 0; zi < nsizes; zi++) {
+	int n = shapes[si].n, m = shapes[si].m, size = sizes[zi];
+	int buf_ids[256];
+	unsigned char *ref = reference(n, m, GIB_ENGINE_TABLE, matrices[mi],
+				       size);
+	unsigned char *s = (unsigned char *)malloc((size_t)(n+m)*size);
+	gib_context gc = context(n, m, GIB_ENGINE_JIT, matrices[mi]);
+
+	memcpy(s, ref, (size_t)n*size);
+	memset(s + (size_t)n*size, 0, (size_t)m*size);
+	if (gib_generate(s, size, gc) != GIB_SUC ||
+	    memcmp(s, ref, (size_t)(n+m)*size))
+	  bad |= fail("jit", "generated parity", n, m, size);
+
+	for (int t = 0; t < 6; t++) {
+	  int lost = 1 + rand() % m, rc = 0;
+	  pick_lost(n, m, lost, buf_ids);
+	  for (int r = 0; r < 2; r++) {
+	    for (int i = 0; i < n; i++)
+	      memcpy(s + (size_t)i*size, ref + (size_t)buf_ids[i]*size, size);
+	    memset(s + (size_t)n*size, 0, (size_t)m*size);
+	    rc |= gib_recover(s, size, buf_ids, lost, gc);
+	    for (int i = n; i < n+lost; i++)
+	      rc |= memcmp(s + (size_t)i*size, ref + (size_t)buf_ids[i]*size,
+			   size);
+	  }
+	  if (rc)
+	    bad |= fail("jit", "recovered buffers", n, m, size);
+	}
+	gib_destroy(gc);
+	free(s);
+	free(ref);
+      }
+  return bad;
+}
+
+struct check {
+  const char *name;
+  int (*run)();
+};
+const struct check checks[] = {
+  { "sparse", check_sparse },
+  { "iov", check_iov },
+  { "iovec", check_iovec },
+  { "xor", check_xor },
+  { "update", check_update },
+  { "async", check_async },
+  { "batch", check_batch },
+  { "mixed", check_mixed },
+  { "crc", check_crc },
+  { "cauchy", check_cauchy },
+  { "jit", check_jit },
+};
+const int nchecks = sizeof(checks)/sizeof(checks[0]);
+
+int main(int argc, char **argv) {
+  int bad = 0;
+  srand(1);
+  for (int i = 1; i < argc; i++) {
+    int ci;
+    for (ci = 0; ci < nchecks; ci++)
+      if (strcmp(argv[i], checks[ci].name) == 0)
+	break;
+    if (ci == nchecks) {
+      fprintf(stderr, "Unknown check %s.  The checks are:", argv[i]);
+      for (ci = 0; ci < nchecks; ci++)
+	fprintf(stderr, " %s", checks[ci].name);
+      fprintf(stderr, "\n");
+      exit(1);
+    }
+  }
+  for (int ci = 0; ci < nchecks; ci++) {
+    int run = (argc == 1);
+    for (int i = 1; i < argc; i++)
+      run |= (strcmp(argv[i], checks[ci].name) == 0);
+    if (!run)
+      continue;
+    int failed = checks[ci].run();
+    printf("%s:  %s\n", checks[ci].name, failed ? "FAILED" : "ok");
+    bad |= failed;
+  }
+  return bad;
+}
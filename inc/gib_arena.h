@@ -0,0 +1,32 @@
+/* Internal allocator behind gib_alloc for the CPU routines.  Stripes come
+ * from 2 MiB arenas, backed by huge pages where the system allows, whose
+ * pages are touched once when the arena is mapped.  Freed stripes are kept
+ * for reuse rather than returned to the system.  Arenas and their free
+ * lists are kept per NUMA node.
+ */
+#ifndef GIB_ARENA_H_
+#define GIB_ARENA_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Every block handed out starts on a boundary of this many bytes. */
+#define GIB_ARENA_ALIGN 64
+
+/* Sets *p to a block of at least size bytes, with its pages on node if it
+ * has room (or wherever they were first touched, if node is -1).  If lock
+ * is set, the block is also locked into memory, or a warning is printed
+ * once if that is not allowed.
+ */
+int gib_arena_alloc ( void **p, size_t size, int lock, int node );
+/* Keeps p, which must be from gib_arena_alloc, for reuse. */
+void gib_arena_free ( void *p );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*GIB_ARENA_H_*/
@@ -0,0 +1,22 @@
+/* Internal interface to the asynchronous job machinery.
+ */
+#ifndef GIB_ASYNC_H_
+#define GIB_ASYNC_H_
+
+#include "gibraltar.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Waits for the context's outstanding jobs and frees its async state.
+ * gib_destroy calls this before the implementation's destroy.  Returns
+ * GIB_ERR, having done nothing, when called from one of the context's own
+ * jobs.
+ */
+int gib_async_destroy ( gib_context c );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*GIB_ASYNC_H_*/
@@ -12,6 +12,25 @@ struct gib_context_t {
 	unsigned char *F;
 	/* The stuff below is only used in the GPU case */
 	void *acc_context;
+	/* Later members go below, so that the offsets above stay the same for
+	 * code built against older versions of this header.
+	 */
+	const struct gib_ops *ops; /* The implementation behind the context */
+	/* Counters for gib_get_stats; NULL for contexts made internally */
+	struct gib_stats_set *stats;
+	int cauchy; /* F is from gib_galois_gen_cauchy */
+	/* The stuff below is only used by the CPU routines */
+	const struct gib_cpu_kernel *kernel;
+	int tile_size;
+	struct gib_pool *pool; /* NULL when single-threaded */
+	int nthreads, mt_threshold;
+	int alloc_flags; /* GIB_ALLOC_* */
+	struct gib_decode_cache *dcache; /* NULL when disabled */
+	struct gib_xor *bitmatrix; /* NULL unless the XOR engine is used */
+	struct gib_jit *jit; /* NULL unless the JIT engine is used */
+	struct gib_tune *tune; /* NULL unless tuned for this host */
+	/* Created by the first asynchronous submission */
+	struct gib_async *async;
 };
 
 typedef struct gib_context_t* gib_context;
@@ -3,24 +3,122 @@
  *
  * Defines the internal CPU interface for Gibraltar.
  */
+#ifndef GIB_CPU_FUNCS_H_
+#define GIB_CPU_FUNCS_H_
+
 #include "gibraltar.h"
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* A kernel computes dest[offset+b] = sum(coefs[i] * src[i][offset+b]) for
+ * 0 <= b < len and 0 <= i < nsrc, writing dest rather than accumulating into
+ * it.  dest may be one of the sources.
+ */
+typedef void (*gib_dot_prod_fn) ( int len, int offset, int nsrc,
+				  const unsigned char *coefs,
+				  unsigned char **src, unsigned char *dest );
+
+/* A coding kernel computes all ndst outputs dst[j] = sum(rows[j*nsrc+i] *
+ * src[i]) over [offset, offset+len) in one pass, for the nsrc and ndst it was
+ * built for.  The outputs must not overlap the sources.
+ */
+typedef void (*gib_code_fn) ( int len, int offset, const unsigned char *rows,
+			      unsigned char **src, unsigned char **dst );
+
+struct gib_cpu_kernel {
+  const char *name;
+  int (*supported) ( void );
+  gib_dot_prod_fn dot_prod;
+  /* Returns the coding kernel specialized for nsrc and ndst, or NULL if
+   * there is none and dot_prod must be used for each output.  May be NULL.
+   */
+  gib_code_fn (*code) ( int nsrc, int ndst );
+};
+
+/* Ordered from most to least preferred.  The last entry is the portable
+ * table-lookup loop, which is always supported.
+ */
+extern const struct gib_cpu_kernel gib_cpu_kernels[];
+const struct gib_cpu_kernel *gib_cpu_kernel_select ( void );
+/* The specialized kernels, in gib_cpu_code.cc */
+gib_code_fn gib_cpu_code_avx2 ( int nsrc, int ndst );
+gib_code_fn gib_cpu_code_avx512 ( int nsrc, int ndst );
+
+/* How one call is coded:  the kernel, the width of the tiles it works
+ * through, and the number of threads its columns are split across.
+ */
+struct gib_cpu_plan {
+  const struct gib_cpu_kernel *kernel;
+  int tile_size;
+  int nthreads; /* More than one only if the context has a pool */
+};
+
+/* The plan for calls of len bytes per buffer:  the tuned one if the
+ * context was tuned, and otherwise the context's kernel and tile size with
+ * its threads used past the threshold.
+ */
+void gib_cpu_plan_for ( gib_context c, int len, struct gib_cpu_plan *p );
+
+/* Codes dst[j] = rows[j*nsrc..] . src over [0, len) of each buffer as p
+ * says, with the context's engine.  See gib_cpu_code_range for crcs.
+ */
+int gib_cpu_code_plan ( gib_context c, const struct gib_cpu_plan *p,
+		const unsigned char *rows, int nsrc, unsigned char **src,
+		int ndst, unsigned char **dst, int len, unsigned int *crcs );
+
+/* Fills rows with the recover_last x n coefficients that rebuild
+ * buf_ids[n..n+recover_last) from buf_ids[0..n).
+ */
+int gib_cpu_recovery_rows ( gib_context c, int *buf_ids, int recover_last,
+		unsigned char *rows );
+
+/* The steps gib_cpu_recovery_rows takes for a Vandermonde F on a decode
+ * cache miss, apart so they can be timed:  the n x n rows of the coding
+ * matrix for the survivors buf_ids[0..n), which gib_galois_gaussian_elim
+ * inverts, and the rows that rebuild buf_ids[n..n+recover_last) from that
+ * inverse.
+ */
+void gib_cpu_survivor_matrix ( gib_context c, const int *buf_ids,
+		unsigned char *modA );
+void gib_cpu_rows_from_inverse ( gib_context c, const int *buf_ids,
+		int recover_last, const unsigned char *inv, unsigned char *rows );
+
+/* Turns a failed_bufs map into a buf_ids layout:  the first n surviving
+ * buffers in order, followed by the recover_last failed buffers.
+ */
+int gib_cpu_sparse_ids ( char *failed_bufs, int *buf_ids, int *recover_last,
+		gib_context c );
+
 int gib_cpu_init ( int n, int m, gib_context *c );
+int gib_cpu_init_opts ( int n, int m, const struct gib_options *opts,
+		gib_context *c );
 int gib_cpu_destroy ( gib_context c );
 int gib_cpu_alloc ( void **buffers, int buf_size, int *ld, gib_context c );
 int gib_cpu_free ( void *buffers );
 int gib_cpu_generate ( void *buffers, int buf_size, gib_context c );
 int gib_cpu_generate_nc ( void *buffers, int buf_size, int work_size, 
 		gib_context c);
+int gib_cpu_generate_crc ( void *buffers, int buf_size, unsigned int *crcs,
+		gib_context c );
+int gib_cpu_generate_batch ( struct gib_stripe *stripes, int count,
+		gib_context c );
+int gib_cpu_generate_iov ( void **data, void **parity, int buf_size,
+		gib_context c );
+int gib_cpu_recover_iov ( void **bufs, int buf_size, int *buf_ids,
+		int recover_last, gib_context c );
+int gib_cpu_update ( void *buffers, int buf_size, int index, int offset,
+		int len, void *old_data, void *new_data, gib_context c );
+int gib_cpu_regenerate ( void *buffers, int buf_size, int *parity_ids,
+		int count, gib_context c );
 int gib_cpu_recover_sparse ( void *buffers, int buf_size, char *failed_bufs, 
 		gib_context c );
 int gib_cpu_recover_sparse_nc ( void *buffers, int buf_size, int work_size, 
 		char *failed_bufs, gib_context c );
 int gib_cpu_recover ( void *buffers, int buf_size, int *buf_ids, int recover_last,
 		gib_context c );
+int gib_cpu_recover_crc ( void *buffers, int buf_size, int *buf_ids,
+		int recover_last, unsigned int *crcs, gib_context c );
 int gib_cpu_recover_nc ( void *buffers, int buf_size, int work_size, int *buf_ids, int recover_last,
 		gib_context c );
 
@@ -28,3 +126,4 @@ int gib_cpu_recover_nc ( void *buffers, int buf_size, int work_size, int *buf_id
 }
 #endif
 
+#endif /*GIB_CPU_FUNCS_H_*/
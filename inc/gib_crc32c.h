@@ -0,0 +1,29 @@
+/* Internal CRC32C (Castagnoli) routines used for the checksumming calls.
+ * CRCs are passed around finished, as zlib does:  the CRC of nothing is 0,
+ * and gib_crc32c(gib_crc32c(0, a), b) is the CRC of a followed by b.
+ */
+#ifndef GIB_CRC32C_H_
+#define GIB_CRC32C_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+unsigned int gib_crc32c ( unsigned int crc, const void *buf, size_t len );
+/* Extends crcs[i] over bytes [offset, offset+len) of bufs[i] for each of
+ * the count buffers.  Several buffers are worked on at once, which hides
+ * the latency of the CRC instruction.
+ */
+void gib_crc32c_multi ( unsigned int *crcs, unsigned char **bufs, int count,
+		size_t offset, size_t len );
+/* Returns the CRC of A followed by B, given the CRC of each and B's length */
+unsigned int gib_crc32c_combine ( unsigned int crc_a, unsigned int crc_b,
+		size_t len_b );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*GIB_CRC32C_H_*/
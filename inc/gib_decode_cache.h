@@ -0,0 +1,28 @@
+/* Internal interface to the decode-matrix cache.  Recovery rows depend only
+ * on the layout of buf_ids, so they are kept in a small LRU cache keyed by
+ * that layout instead of being rederived for every call.
+ */
+#ifndef GIB_DECODE_CACHE_H_
+#define GIB_DECODE_CACHE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct gib_decode_cache;
+
+int gib_dc_create ( struct gib_decode_cache **dc, int n, int capacity );
+void gib_dc_destroy ( struct gib_decode_cache *dc );
+/* Looks up the rows for the layout ids[0..nids).  Returns 1 and copies
+ * (nids - n)*n bytes into rows on a hit, or returns 0 on a miss.
+ */
+int gib_dc_get ( struct gib_decode_cache *dc, const int *ids, int nids,
+		 unsigned char *rows );
+void gib_dc_put ( struct gib_decode_cache *dc, const int *ids, int nids,
+		  const unsigned char *rows );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*GIB_DECODE_CACHE_H_*/
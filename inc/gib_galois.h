@@ -13,9 +13,15 @@ extern "C" {
 extern unsigned char gib_gf_log[256];
 extern unsigned char gib_gf_ilog[256];
 extern unsigned char gib_gf_table[256][256];
+extern unsigned char gib_gf_nib_table[256][32];
 int gib_galois_init();
 int gib_galois_gen_F(unsigned char *mat, int rows, int cols);
 int gib_galois_gen_A(unsigned char *mat, int rows, int cols);
+/* A rows x cols Cauchy coding matrix, scaled for few ones in bit-matrix form */
+int gib_galois_gen_cauchy(unsigned char *mat, int rows, int cols);
+int gib_galois_bit_weight(unsigned char e);
+int gib_galois_cauchy_inverse(const unsigned char *mat, int rows, int cols,
+		const int *par, const int *lost, int e, unsigned char *inv);
 int gib_galois_gaussian_elim(unsigned char *mat, unsigned char *inv, int rows, 
 		int cols);
 #ifdef __cplusplus
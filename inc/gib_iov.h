@@ -0,0 +1,28 @@
+/* Internal interface to the iovec calls.  The CPU routines code each
+ * stretch of the chains directly, with rows and a plan worked out once per
+ * call; other implementations get each stretch through their pointer-array
+ * calls.
+ */
+#ifndef GIB_IOV_H_
+#define GIB_IOV_H_
+
+#include "gibraltar.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int gib_cpu_generate_iovec ( struct iovec **shards, int *iovcnt,
+		int buf_size, gib_context c );
+int gib_cpu_recover_iovec ( struct iovec **shards, int *iovcnt,
+		int buf_size, int *buf_ids, int recover_last, gib_context c );
+/* Through the context's generate_iov and recover_iov */
+int gib_iov_generate_iovec ( struct iovec **shards, int *iovcnt,
+		int buf_size, gib_context c );
+int gib_iov_recover_iovec ( struct iovec **shards, int *iovcnt,
+		int buf_size, int *buf_ids, int recover_last, gib_context c );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*GIB_IOV_H_*/
@@ -0,0 +1,40 @@
+/* Internal interface to the x86-64 code generator.  For a given matrix it
+ * emits an AVX2 routine with the coefficients built in, which codes exactly
+ * what the table kernels would for that matrix.
+ */
+#ifndef GIB_JIT_H_
+#define GIB_JIT_H_
+
+#include "gib_context.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct gib_jit;
+struct gib_jit_code;
+
+/* Generates the encoding routine for c->F.  *j is left NULL, and the table
+ * kernels are used instead, when code cannot be generated on this machine.
+ */
+int gib_jit_create ( struct gib_jit **j, gib_context c );
+void gib_jit_destroy ( struct gib_jit *j );
+/* Returns the routine computing ndst outputs from nsrc sources with the
+ * ndst x nsrc matrix rows, generating and caching it if it is new, or NULL
+ * if it could not be generated.  Each routine returned must be given back
+ * with gib_jit_release.
+ */
+struct gib_jit_code *gib_jit_get ( struct gib_jit *j,
+		const unsigned char *rows, int nsrc, int ndst );
+void gib_jit_release ( struct gib_jit *j, struct gib_jit_code *k );
+/* Runs k over bytes [off, off+len) of every buffer, writing the outputs.
+ * The outputs must not overlap the sources.
+ */
+void gib_jit_run ( const struct gib_jit_code *k, int len, int off,
+		unsigned char **src, unsigned char **dst );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*GIB_JIT_H_*/
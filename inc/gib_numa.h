@@ -0,0 +1,40 @@
+/* Internal view of the machine's NUMA topology, read from
+ * /sys/devices/system/node.  Only nodes with processors count.  On
+ * machines with one such node, or with GIB_NUMA set to "0", there is
+ * nothing to place, and every call below says so cheaply.
+ */
+#ifndef GIB_NUMA_H_
+#define GIB_NUMA_H_
+
+#include <pthread.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Nodes numbered this high or higher are ignored. */
+#define GIB_NUMA_MAX_NODES 64
+
+/* The number of nodes with processors; memory is only placed when there
+ * are at least two.
+ */
+int gib_numa_nnodes ( void );
+/* The id of the i-th of them */
+int gib_numa_node ( int i );
+/* Has threads created with attr run only on the processors of node */
+void gib_numa_pin ( pthread_attr_t *attr, int node );
+/* The node holding the page at p, or -1 if it is not known or there is
+ * only one node.
+ */
+int gib_numa_node_of ( const void *p );
+/* Asks for the pages of [p, p+len) to be put on node when they are first
+ * touched.
+ */
+void gib_numa_prefer ( void *p, size_t len, int node );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*GIB_NUMA_H_*/
@@ -0,0 +1,76 @@
+/* The table of routines behind a context.  Every implementation built into
+ * the library fills one in, and the public calls go through the one the
+ * context was created with.
+ */
+#ifndef GIB_OPS_H_
+#define GIB_OPS_H_
+
+#include "gibraltar.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct gib_ops {
+  const char *name;
+  int backend; /* GIB_BACKEND_* */
+  /* Nonzero if it writes the same parity as the CPU routines, from the
+   * same F.  Only such implementations are chosen between automatically,
+   * so that the parity stored does not depend on which was fastest.
+   */
+  int automatic;
+  /* Whether a context for n and m can be created on this machine, checked
+   * without side effects that last.
+   */
+  int (*available) ( int n, int m );
+  int (*init_opts) ( int n, int m, const struct gib_options *opts,
+		     gib_context *c );
+  int (*destroy) ( gib_context c );
+  int (*alloc) ( void **buffers, int buf_size, int *ld, gib_context c );
+  int (*free) ( void *buffers, gib_context c );
+  int (*generate) ( void *buffers, int buf_size, gib_context c );
+  int (*generate_nc) ( void *buffers, int buf_size, int work_size,
+		       gib_context c );
+  int (*generate_crc) ( void *buffers, int buf_size, unsigned int *crcs,
+			gib_context c );
+  int (*generate_batch) ( struct gib_stripe *stripes, int count,
+			  gib_context c );
+  int (*recover) ( void *buffers, int buf_size, int *buf_ids,
+		   int recover_last, gib_context c );
+  int (*recover_nc) ( void *buffers, int buf_size, int work_size,
+		      int *buf_ids, int recover_last, gib_context c );
+  int (*recover_crc) ( void *buffers, int buf_size, int *buf_ids,
+		       int recover_last, unsigned int *crcs, gib_context c );
+  int (*regenerate) ( void *buffers, int buf_size, int *parity_ids,
+		      int count, gib_context c );
+  int (*recover_sparse) ( void *buffers, int buf_size, char *failed_bufs,
+			  gib_context c );
+  int (*recover_sparse_nc) ( void *buffers, int buf_size, int work_size,
+			     char *failed_bufs, gib_context c );
+  int (*generate_iov) ( void **data, void **parity, int buf_size,
+			gib_context c );
+  int (*recover_iov) ( void **bufs, int buf_size, int *buf_ids,
+		       int recover_last, gib_context c );
+  int (*generate_iovec) ( struct iovec **shards, int *iovcnt, int buf_size,
+			  gib_context c );
+  int (*recover_iovec) ( struct iovec **shards, int *iovcnt, int buf_size,
+			 int *buf_ids, int recover_last, gib_context c );
+  int (*update) ( void *buffers, int buf_size, int index, int offset,
+		  int len, void *old_data, void *new_data, gib_context c );
+  int (*update_delta) ( void *buffers, int buf_size, int index, int offset,
+			int len, void *delta, gib_context c );
+};
+
+extern const struct gib_ops gib_cpu_ops;
+#ifdef GIB_HAVE_CUDA
+extern const struct gib_ops gib_cuda_ops;
+#endif
+#ifdef GIB_HAVE_JERASURE
+extern const struct gib_ops gib_jerasure_ops;
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*GIB_OPS_H_*/
@@ -0,0 +1,36 @@
+/* Internal worker pool used to split a single coding call across threads.
+ * On NUMA machines its workers are pinned to nodes, and work may be routed
+ * to the node holding the memory it touches; node is -1 for no preference.
+ */
+#ifndef GIB_POOL_H_
+#define GIB_POOL_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct gib_pool;
+
+typedef void (*gib_task_fn) ( void *arg, int task );
+
+int gib_pool_create ( struct gib_pool **pool, int nworkers );
+void gib_pool_destroy ( struct gib_pool *pool );
+/* Runs fn(arg, task) for 0 <= task < ntasks and returns when all of them
+ * have finished.  The calling thread runs tasks too, so this may be called
+ * from inside a task without deadlocking.
+ */
+void gib_pool_run ( struct gib_pool *pool, int node, int ntasks,
+		    gib_task_fn fn, void *arg );
+/* Queues fn(arg, 0) to run on a worker and returns at once. */
+int gib_pool_submit ( struct gib_pool *pool, int node, gib_task_fn fn,
+		      void *arg );
+/* Takes turns among the nodes the pool has workers on, for placing new
+ * memory, or returns -1 if pool is NULL or not spread across nodes.
+ */
+int gib_pool_next_node ( struct gib_pool *pool );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*GIB_POOL_H_*/
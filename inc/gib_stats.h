@@ -0,0 +1,51 @@
+/* Internal interface to the per-context counters behind gib_get_stats.
+ */
+#ifndef GIB_STATS_H_
+#define GIB_STATS_H_
+
+#include "gibraltar.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The counters, in the order of struct gib_stats.  Passes coded by table
+ * kernel i count in GIB_STAT_VARIANT+i, and those coded by the JIT and XOR
+ * engines in the last two variants.
+ */
+enum {
+  GIB_STAT_GENERATE_CALLS,
+  GIB_STAT_RECOVER_CALLS,
+  GIB_STAT_UPDATE_CALLS,
+  GIB_STAT_BYTES_ENCODED,
+  GIB_STAT_BYTES_RECOVERED,
+  GIB_STAT_SETUP_NS,
+  GIB_STAT_KERNEL_NS,
+  GIB_STAT_DC_HITS,
+  GIB_STAT_DC_MISSES,
+  GIB_STAT_PASSES,
+  GIB_STAT_MT_PASSES,
+  GIB_STAT_MT_TASKS,
+  GIB_STAT_VARIANT,
+  GIB_STAT_COUNT = GIB_STAT_VARIANT + GIB_STATS_VARIANTS
+};
+#define GIB_STAT_VARIANT_JIT (GIB_STATS_VARIANTS - 2)
+#define GIB_STAT_VARIANT_XOR (GIB_STATS_VARIANTS - 1)
+
+struct gib_stats_set;
+
+int gib_stats_create ( struct gib_stats_set **s );
+void gib_stats_destroy ( struct gib_stats_set *s );
+/* Adds v to a counter of c in the calling thread's block.  Contexts made
+ * without the public gib_init_opts, such as those used for calibration,
+ * have no counters, and this does nothing for them.
+ */
+void gib_stats_add ( gib_context c, int stat, unsigned long v );
+/* The clock the timers read */
+unsigned long gib_stats_ns ( void );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*GIB_STATS_H_*/
@@ -0,0 +1,71 @@
+/* Internal interface to phase tracing.  GIB_TRACE_BEGIN and GIB_TRACE_END
+ * bracket a phase.  While tracing is off they cost a test of gib_trace_on,
+ * which is expected to be false; while it is on, they record an event in
+ * the calling thread's ring.  Built with "sdt=1", each is also a USDT
+ * probe, gibraltar:<phase>_begin or gibraltar:<phase>_end, which perf and
+ * bpftrace can attach to whether or not tracing is on.
+ */
+#ifndef GIB_TRACE_H_
+#define GIB_TRACE_H_
+
+#ifdef GIB_HAVE_SDT
+#include <sys/sdt.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The phases, with what their argument is:
+ *   generate, recover, update  public calls; the buffer size
+ *   rows      finding the recovery rows; the number recovered
+ *   build     the survivors' rows of the coding matrix; n
+ *   invert    inverting them; n
+ *   cauchy    the closed-form inverse of a Cauchy matrix; n
+ *   code      one coding pass; the bytes per buffer
+ *   task      one thread's share of a pass; the task number
+ *   tile      one tile of a pass; its offset
+ *   htod, dtoh  copies to and from the GPU; the bytes copied, or 0 for
+ *             the wait for results written straight to mapped memory
+ *   launch    a kernel launch on the GPU; the number of blocks
+ */
+#define GIB_TRACE_PHASES(X)						\
+  X(generate) X(recover) X(update) X(rows) X(build) X(invert) X(cauchy) \
+  X(code) X(task) X(tile) X(htod) X(dtoh) X(launch)
+
+enum {
+#define GIB_TRACE_ENUM(ph) GIB_TRACE_##ph,
+  GIB_TRACE_PHASES(GIB_TRACE_ENUM)
+#undef GIB_TRACE_ENUM
+  GIB_TRACE_NPHASES
+};
+
+extern int gib_trace_on;
+void gib_trace_event ( int phase, char type, long arg );
+/* Starts tracing if GIB_TRACE names a file, which the trace is written to
+ * when the process exits.  Only the first call does anything.
+ */
+void gib_trace_env ( void );
+
+#ifdef GIB_HAVE_SDT
+#define GIB_TRACE_PROBE(ph, end, arg) DTRACE_PROBE1(gibraltar, ph##_##end, arg)
+#else
+#define GIB_TRACE_PROBE(ph, end, arg)
+#endif
+
+#define GIB_TRACE_BEGIN(ph, arg) do {					\
+    GIB_TRACE_PROBE(ph, begin, (long)(arg));				\
+    if (__builtin_expect(gib_trace_on, 0))				\
+      gib_trace_event(GIB_TRACE_##ph, 'B', (long)(arg));		\
+  } while (0)
+#define GIB_TRACE_END(ph, arg) do {					\
+    GIB_TRACE_PROBE(ph, end, (long)(arg));				\
+    if (__builtin_expect(gib_trace_on, 0))				\
+      gib_trace_event(GIB_TRACE_##ph, 'E', (long)(arg));		\
+  } while (0)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*GIB_TRACE_H_*/
@@ -0,0 +1,36 @@
+/* Internal interface to the CPU tuner.  For each class of call sizes it
+ * times the kernels, tile sizes and thread counts a context could use and
+ * keeps the fastest as the plan for that class.  Plans are saved under
+ * GIB_CACHE_DIR so later processes on the same host can load them.
+ */
+#ifndef GIB_TUNE_H_
+#define GIB_TUNE_H_
+
+#include "gib_cpu_funcs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Calls are classed by bytes per buffer:  under 16K, under 256K, under 4M,
+ * and the rest.
+ */
+#define GIB_TUNE_CLASSES 4
+
+struct gib_tune {
+  struct gib_cpu_plan plans[GIB_TUNE_CLASSES];
+};
+
+int gib_tune_class ( int len );
+/* Loads the plans for c from the cache directory, or times them and saves
+ * them there if none were saved for this host.  c must otherwise be fully
+ * set up.
+ */
+int gib_tune_create ( struct gib_tune **t, gib_context c );
+void gib_tune_destroy ( struct gib_tune *t );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*GIB_TUNE_H_*/
@@ -0,0 +1,46 @@
+/* Internal interface to the XOR engine.  Each coefficient is expanded into
+ * the 8x8 GF(2) matrix that multiplies by it, so a coding matrix becomes a
+ * bit-matrix over packets, and coding is a schedule of packet XORs.
+ *
+ * Buffers are cut into blocks of GIB_XOR_BLOCK bytes, each holding eight
+ * packets:  bit b of packet p in a block is bit p of the field element at
+ * that position.  Data coded this way is only readable by the XOR engine,
+ * and every length given to it must be a multiple of GIB_XOR_BLOCK.
+ */
+#ifndef GIB_XOR_H_
+#define GIB_XOR_H_
+
+#include "gib_context.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define GIB_XOR_PACKET 64
+#define GIB_XOR_BLOCK (8*GIB_XOR_PACKET)
+
+struct gib_xor;
+struct gib_xor_sched;
+
+/* Builds the encoding schedule for c->F. */
+int gib_xor_create ( struct gib_xor **x, gib_context c );
+void gib_xor_destroy ( struct gib_xor *x );
+/* Returns the schedule computing ndst outputs from nsrc sources with the
+ * ndst x nsrc matrix rows, building and caching it if it is new, or NULL if
+ * memory runs out.  Each schedule returned must be given back with
+ * gib_xor_release.
+ */
+struct gib_xor_sched *gib_xor_get ( struct gib_xor *x,
+		const unsigned char *rows, int nsrc, int ndst );
+void gib_xor_release ( struct gib_xor *x, struct gib_xor_sched *s );
+/* Runs s over bytes [off, off+len) of every buffer.  With accumulate set,
+ * the outputs are XORed into dst instead of overwriting it.
+ */
+void gib_xor_run ( const struct gib_xor_sched *s, int len, int off,
+		unsigned char **src, unsigned char **dst, int accumulate );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*GIB_XOR_H_*/
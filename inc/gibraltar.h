@@ -5,6 +5,7 @@
  * the present moment (i.e., the _nc functions).
  */
 #include "gib_context.h"
+#include <sys/uio.h>
 
 #ifndef GIBRALTAR_H_
 #define GIBRALTAR_H_
@@ -13,9 +14,79 @@
 extern "C" {
 #endif /* __cplusplus */
 
+/* Optional settings for gib_init_opts.  Zero in any field selects the
+ * default, so a zeroed structure behaves the same as gib_init.
+ */
+struct gib_options {
+  /* Threads used by a single coding call, including the caller.  The
+   * default is taken from GIB_NUM_THREADS, or 1 if it is not set.
+   */
+  int nthreads;
+  /* Calls working on fewer bytes per buffer than this stay on the calling
+   * thread.
+   */
+  int mt_threshold;
+  /* Number of erasure patterns whose recovery rows are cached.  The default
+   * is 1024; a negative value disables the cache.
+   */
+  int decode_cache_size;
+  /* How the CPU routines code.  GIB_ENGINE_TABLE, the default, multiplies
+   * with table lookups.  GIB_ENGINE_XOR expands a Cauchy coding matrix into
+   * a bit-matrix and codes with XORs alone, which suits processors without
+   * fast byte shuffles.  It writes different parity, so a stripe must be
+   * recovered with the engine that encoded it, and every length (and update
+   * offset) must be a multiple of 512 bytes.  Its calls use up to 64 KiB
+   * of the calling thread's stack.  Only the CPU version has it.
+   * GIB_ENGINE_JIT generates x86-64 code for each matrix it codes with,
+   * once per context or erasure pattern, with the coefficients built in.
+   * Its parity is the same as the table engine's, and where code cannot be
+   * generated (other processors, or no AVX2) the table engine is used.
+   */
+  int engine;
+  /* The coding matrix:  GIB_MATRIX_VANDERMONDE, the default for the table
+   * engine, or GIB_MATRIX_CAUCHY, the default for the XOR engine.  Cauchy
+   * matrices build their recovery rows in closed form, which is much
+   * cheaper for wide stripes.  Parity depends on the matrix, so data must
+   * be recovered with the matrix it was encoded with.
+   */
+  int matrix;
+  /* The implementation:  GIB_BACKEND_CPU, GIB_BACKEND_CUDA or
+   * GIB_BACKEND_JERASURE, if built into the library.  By default it is
+   * taken from GIB_BACKEND ("cpu", "cuda", "jerasure" or "auto"), and
+   * otherwise chosen automatically:  each available implementation codes a
+   * short test stripe, and the fastest is used.  That is done once per
+   * process for each n, m and set of options.  Jerasure writes different
+   * parity from the others, so it is only used when asked for, and its
+   * stripes can only be recovered with it.
+   */
+  int backend;
+  /* Whether the CPU routines tune themselves for this host.  When
+   * positive, gib_init_opts times the available kernels, tile sizes and
+   * thread counts (up to nthreads) on a few buffer sizes, and later calls
+   * use the fastest for their size in place of the defaults and
+   * mt_threshold.  The result is kept under GIB_CACHE_DIR, if it is set,
+   * for later processes on the host to load.  Negative disables tuning,
+   * and zero takes it from GIB_TUNE (any value but "0" enables it).
+   */
+  int tune;
+  /* How gib_alloc lays out stripes for the CPU routines, as GIB_ALLOC_*
+   * flags.  GIB_ALLOC_MLOCK locks them into memory.  GIB_ALLOC_PAD pads
+   * the distance between buffers, returned in ld, to a multiple of 64
+   * bytes that is not a multiple of 4096, so that buffers do not compete
+   * for the same cache sets; code such stripes with ld as the buffer size,
+   * or with the _nc calls.  Negative selects neither, and zero takes them
+   * from GIB_ALLOC (such as "mlock,pad").
+   */
+  int alloc;
+};
+
 /* Functions */
 int gib_init ( int n, int m, gib_context *c );
+int gib_init_opts ( int n, int m, const struct gib_options *opts,
+		gib_context *c );
 int gib_destroy ( gib_context c );
+/* The name of the implementation behind c, such as "cpu" */
+const char *gib_backend_name ( gib_context c );
 int gib_alloc ( void **buffers, int buf_size, int *ld, gib_context c );
 int gib_free ( void *buffers, gib_context c );
 int gib_generate ( void *buffers, int buf_size, gib_context c );
@@ -25,6 +96,177 @@ int gib_recover ( void *buffers, int buf_size, int *buf_ids, int recover_last,
 		gib_context c );
 int gib_recover_nc ( void *buffers, int buf_size, int work_size, int *buf_ids, int recover_last,
 		gib_context c );
+/* Batched encoding of many stripes that share one context.  Each stripe is
+ * laid out as for gib_generate, and the stripes may differ in size.  The
+ * setup is done once for the whole batch, and the stripes are spread across
+ * the context's threads, or coded by one GPU launch.
+ */
+struct gib_stripe {
+  void *buffers;
+  int buf_size;
+};
+int gib_generate_batch ( struct gib_stripe *stripes, int count,
+		gib_context c );
+
+/* In gib_recover, buf_ids[n..n+recover_last) may name data and parity
+ * buffers alike; all of them are rebuilt in one pass over the n survivors.
+ * When all of the data survived, gib_regenerate rebuilds just the listed
+ * parity buffers (ids in [n, n+m)) of a stripe in the gib_generate layout.
+ */
+int gib_regenerate ( void *buffers, int buf_size, int *parity_ids, int count,
+		gib_context c );
+
+/* As gib_generate and gib_recover, also computing the CRC32C of every
+ * buffer while it is in cache.  gib_generate_crc stores n+m CRCs in crcs, in
+ * buffer order.  gib_recover_crc stores n+recover_last, so crcs[i] belongs to
+ * buffer i of the recover layout:  the survivors buf_ids[0..n), which can be
+ * checked against their stored CRCs, and then the rebuilt buffers.
+ */
+int gib_generate_crc ( void *buffers, int buf_size, unsigned int *crcs,
+		gib_context c );
+int gib_recover_crc ( void *buffers, int buf_size, int *buf_ids,
+		int recover_last, unsigned int *crcs, gib_context c );
+
+/* Sparse recovery works on the original n+m layout.  failed_bufs has n+m
+ * entries, nonzero for each buffer that is lost.  Lost buffers, data or
+ * parity, are rebuilt in place from the survivors, without moving any
+ * buffer.
+ */
+int gib_recover_sparse ( void *buffers, int buf_size, char *failed_bufs,
+		gib_context c );
+int gib_recover_sparse_nc ( void *buffers, int buf_size, int work_size,
+		char *failed_bufs, gib_context c );
+
+/* Scatter/gather variants, for buffers that are not in one allocation.
+ * gib_generate_iov reads the n buffers in data and writes the m buffers in
+ * parity.  gib_recover_iov works like gib_recover, where bufs[i] holds the
+ * buffer named by buf_ids[i].
+ */
+int gib_generate_iov ( void **data, void **parity, int buf_size,
+		gib_context c );
+int gib_recover_iov ( void **bufs, int buf_size, int *buf_ids,
+		int recover_last, gib_context c );
+/* As above, but each buffer is a chain of iovcnt[i] segments totalling at
+ * least buf_size bytes.  shards[0..n) are the data and shards[n..n+m) the
+ * parity for gib_generate_iovec; for gib_recover_iovec, shards[i] holds
+ * buf_ids[i].  Segment boundaries need not line up between buffers.
+ */
+int gib_generate_iovec ( struct iovec **shards, int *iovcnt, int buf_size,
+		gib_context c );
+int gib_recover_iovec ( struct iovec **shards, int *iovcnt, int buf_size,
+		int *buf_ids, int recover_last, gib_context c );
+
+/* Small writes.  When bytes [offset, offset+len) of data buffer index change,
+ * these update the m parity buffers in place using only that range, rather
+ * than rereading all n data buffers.  gib_update takes the old and new
+ * contents of the range, and gib_update_delta their XOR.  Neither writes
+ * the new data into buffers; that is left to the caller.
+ */
+int gib_update ( void *buffers, int buf_size, int index, int offset, int len,
+		void *old_data, void *new_data, gib_context c );
+int gib_update_delta ( void *buffers, int buf_size, int index, int offset,
+		int len, void *delta, gib_context c );
+
+/* The decode-matrix cache.  A saved cache can only be loaded into a context
+ * with the same n, m and coding matrix.
+ */
+int gib_decode_cache_stats ( gib_context c, unsigned long *hits,
+		unsigned long *misses );
+int gib_decode_cache_clear ( gib_context c );
+int gib_decode_cache_save ( gib_context c, const char *path );
+int gib_decode_cache_load ( gib_context c, const char *path );
+
+/* Counters kept by each context since it was created or last reset, for
+ * export to a metrics system.  Each thread counts in a block of its own,
+ * and gib_get_stats adds the blocks up, so keeping them costs coding calls
+ * a few adds and clock reads.  Calls and bytes are counted for every
+ * implementation; the rest come from the CPU routines, which the others
+ * also use for some calls.
+ */
+#define GIB_STATS_VARIANTS 8
+struct gib_stats {
+  unsigned long generate_calls;  /* gib_generate and its variants */
+  unsigned long recover_calls;   /* gib_recover, gib_recover_sparse,
+				    gib_regenerate and their variants */
+  unsigned long update_calls;    /* gib_update and gib_update_delta */
+  unsigned long bytes_encoded;   /* Data bytes read by generate calls */
+  unsigned long bytes_recovered; /* Bytes rebuilt by recover calls */
+  unsigned long setup_ns;        /* Time finding recovery rows */
+  unsigned long kernel_ns;       /* Time in coding passes */
+  unsigned long dcache_hits;     /* Recovery rows found in the cache */
+  unsigned long dcache_misses;
+  unsigned long passes;          /* Coding passes over the data */
+  unsigned long mt_passes;       /* Passes split across threads */
+  unsigned long mt_tasks;        /* Pieces those were split into */
+  /* variant_passes[i] passes were coded by variant_names[i], one of the
+   * table kernels ("avx2" and so on), "jit" or "xor".
+   */
+  int nvariants;
+  const char *variant_names[GIB_STATS_VARIANTS];
+  unsigned long variant_passes[GIB_STATS_VARIANTS];
+};
+int gib_get_stats ( gib_context c, struct gib_stats *stats );
+int gib_reset_stats ( gib_context c );
+
+/* Tracing.  While it is on, every thread records when it begins and ends
+ * each phase of a call:  the call itself, building and inverting the
+ * recovery matrix, each coding pass, each thread's share of it and each
+ * tile, and the copies and launches of the GPU version.  Recording costs a
+ * clock read and a store into a buffer of the thread's own, which keeps the
+ * last 65536 events.  gib_trace_dump writes the events kept since tracing
+ * last started as a Chrome trace (JSON), for chrome://tracing or Perfetto.
+ * Setting GIB_TRACE to a file name starts tracing when the first context
+ * is made and dumps the trace to it when the process exits.
+ */
+int gib_trace_start ( void );
+int gib_trace_stop ( void );
+int gib_trace_dump ( const char *path );
+
+/* Asynchronous jobs.  The submit calls queue a gib_generate or gib_recover
+ * to run on a worker owned by the library and return at once; the buffers
+ * must stay untouched until the job finishes.  If cb is given, it is called
+ * on the worker when the job finishes and owns the job from then on, so it
+ * must call gib_job_free.  Otherwise the finished job is put on the
+ * context's completion queue.  gib_poll fetches up to max finished jobs
+ * without blocking and returns how many it stored in jobs.  gib_job_wait
+ * blocks until a job finishes and returns the code of the call it ran.
+ * job may be NULL when cb is given.  A queued job may be freed once it
+ * has finished, whether or not gib_poll has returned it; gib_poll will not
+ * return it afterward.  gib_destroy waits for a context's jobs, including
+ * those their callbacks submit, so it must not be called from one of them
+ * (or from anything they run, such as a resumed coroutine).  There it
+ * returns GIB_ERR and leaves the context as it was.
+ */
+typedef struct gib_job_t *gib_job;
+typedef void (*gib_job_cb) ( gib_job job, void *arg );
+int gib_submit_generate ( void *buffers, int buf_size, gib_context c,
+		gib_job_cb cb, void *arg, gib_job *job );
+int gib_submit_recover ( void *buffers, int buf_size, int *buf_ids,
+		int recover_last, gib_context c, gib_job_cb cb, void *arg,
+		gib_job *job );
+int gib_poll ( gib_context c, gib_job *jobs, int max );
+int gib_job_done ( gib_job job );
+int gib_job_wait ( gib_job job );
+void *gib_job_arg ( gib_job job );
+int gib_job_free ( gib_job job );
+
+/* Coding engines */
+static const int GIB_ENGINE_TABLE = 0;
+static const int GIB_ENGINE_XOR = 1;
+static const int GIB_ENGINE_JIT = 2;
+
+/* Implementations */
+static const int GIB_BACKEND_CPU = 1;
+static const int GIB_BACKEND_CUDA = 2;
+static const int GIB_BACKEND_JERASURE = 3;
+
+/* Flags for the alloc option */
+static const int GIB_ALLOC_MLOCK = 1;
+static const int GIB_ALLOC_PAD = 2;
+
+/* Coding matrices */
+static const int GIB_MATRIX_VANDERMONDE = 1;
+static const int GIB_MATRIX_CAUCHY = 2;
 
 /* Return codes */
 static const int GIB_SUC = 0; /* Success */
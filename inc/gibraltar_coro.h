@@ -0,0 +1,86 @@
+/* C++20 awaitables over the asynchronous job interface.  Inside a coroutine,
+ *
+ *   int rc = co_await gib::generate(buffers, buf_size, c);
+ *
+ * suspends until the job finishes.  The coroutine is resumed on the library
+ * worker that ran the job, so a server that wants it back on its own
+ * executor should reschedule it there.
+ */
+#ifndef GIBRALTAR_CORO_H_
+#define GIBRALTAR_CORO_H_
+
+#include "gibraltar.h"
+
+#if __cplusplus >= 202002L
+#include <coroutine>
+#include <cstddef>
+
+namespace gib {
+
+class job_awaiter {
+public:
+  bool await_ready ( ) const noexcept { return false; }
+  bool await_suspend ( std::coroutine_handle<> h ) noexcept {
+    int rc;
+    handle_ = h;
+    rc = submit();
+    /* On success the job may already have resumed us, and this object may
+     * be gone with the coroutine frame, so it is only touched on failure.
+     */
+    if (rc == GIB_SUC)
+      return true;
+    rc_ = rc;
+    return false;
+  }
+  int await_resume ( ) const noexcept { return rc_; }
+
+protected:
+  job_awaiter ( gib_context c, void *buffers, int buf_size )
+    : c_(c), buffers_(buffers), buf_size_(buf_size) { }
+  virtual int submit ( ) noexcept = 0;
+  static void done ( gib_job job, void *arg ) {
+    job_awaiter *self = static_cast<job_awaiter *>(arg);
+    self->rc_ = gib_job_wait(job); /* Finished, so this does not block */
+    gib_job_free(job);
+    self->handle_.resume();
+  }
+
+  gib_context c_;
+  void *buffers_;
+  int buf_size_;
+  int rc_ = GIB_SUC;
+  std::coroutine_handle<> handle_;
+};
+
+class generate : public job_awaiter {
+public:
+  generate ( void *buffers, int buf_size, gib_context c )
+    : job_awaiter(c, buffers, buf_size) { }
+protected:
+  int submit ( ) noexcept override {
+    return gib_submit_generate(buffers_, buf_size_, c_, done, this, NULL);
+  }
+};
+
+/* buf_ids is copied when the job is submitted. */
+class recover : public job_awaiter {
+public:
+  recover ( void *buffers, int buf_size, int *buf_ids, int recover_last,
+	    gib_context c )
+    : job_awaiter(c, buffers, buf_size), buf_ids_(buf_ids),
+      recover_last_(recover_last) { }
+protected:
+  int submit ( ) noexcept override {
+    return gib_submit_recover(buffers_, buf_size_, buf_ids_, recover_last_,
+			      c_, done, this, NULL);
+  }
+private:
+  int *buf_ids_;
+  int recover_last_;
+};
+
+} /* namespace gib */
+
+#endif /* __cplusplus >= 202002L */
+
+#endif /*GIBRALTAR_CORO_H_*/
@@ -0,0 +1,205 @@
+/* Stripe allocator.  malloc hands back fresh pages for most stripes, so
+ * each new stripe page-faults its way through its first coding pass, and
+ * its buffers are only 16-byte aligned.  Here, blocks of up to 1 MiB are
+ * split from 2 MiB arenas, one power-of-two size per arena, and larger
+ * blocks get arenas of their own rounded up to 2 MiB.  Arenas are mapped
+ * on huge pages if any are reserved, and otherwise on 2 MiB boundaries and
+ * offered to transparent huge pages; either way, every page is touched as
+ * the arena is mapped.  Freed blocks are kept on lists for the next
+ * allocation of their size, and are never returned to the system.
+ *
+ * An arena for a NUMA node is bound to that node before it is touched, so
+ * its pages land there whichever thread maps it, and each node has lists
+ * of its own.  The binding is only a preference, and the kernel places
+ * pages elsewhere when the node is short of memory, so each block is filed
+ * under the node its pages actually landed on.
+ *
+ * Each block starts with a header, GIB_ARENA_ALIGN bytes long, so that the
+ * caller's part of it is aligned.
+ */
+
+#include "../inc/gibraltar.h"
+#include "../inc/gib_arena.h"
+#include "../inc/gib_numa.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#define GIB_ARENA_SIZE (2ul << 20)
+#define GIB_ARENA_PAGE 4096
+/* Blocks of 2^k bytes, header included, for GIB_ARENA_MIN_LOG <= k <=
+ * GIB_ARENA_MAX_LOG, are split from shared arenas.
+ */
+#define GIB_ARENA_MIN_LOG 12
+#define GIB_ARENA_MAX_LOG 20
+#define GIB_ARENA_NCLASSES (GIB_ARENA_MAX_LOG - GIB_ARENA_MIN_LOG + 1)
+
+struct gib_arena_hdr {
+  size_t size; /* Of the whole block */
+  int cls;     /* Its size class, or -1 if it has an arena of its own */
+  int locked;
+  int slot;    /* Of its node's lists */
+  struct gib_arena_hdr *next; /* While it is free */
+};
+
+/* Slot 0 is for memory on no particular node, and slot i+1 for node i. */
+#define GIB_ARENA_SLOTS (GIB_NUMA_MAX_NODES + 1)
+static struct gib_arena_hdr *gib_arena_lists[GIB_ARENA_SLOTS]
+					    [GIB_ARENA_NCLASSES];
+static struct gib_arena_hdr *gib_arena_large[GIB_ARENA_SLOTS];
+static pthread_mutex_t gib_arena_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Cleared once the system refuses huge pages, to stop asking */
+static int gib_arena_hugetlb = 1;
+static int gib_arena_lock_warned = 0;
+
+/* Maps len bytes, a multiple of GIB_ARENA_SIZE, on node, and touches every
+ * page.
+ */
+static char *gib_arena_map ( size_t len, int node ) {
+  char *base, *p = NULL;
+  size_t off;
+#ifdef MAP_HUGETLB
+  if (gib_arena_hugetlb) {
+    p = (char *)mmap(NULL, len, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p == MAP_FAILED) {
+      p = NULL;
+      gib_arena_hugetlb = 0;
+    }
+  }
+#endif
+  if (p == NULL) {
+    /* Over-map, then trim to a 2 MiB boundary at each end. */
+    base = (char *)mmap(NULL, len + GIB_ARENA_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+      return NULL;
+    p = (char *)(((uintptr_t)base + GIB_ARENA_SIZE - 1) &
+		 ~(uintptr_t)(GIB_ARENA_SIZE - 1));
+    off = p - base;
+    if (off > 0)
+      munmap(base, off);
+    munmap(p + len, GIB_ARENA_SIZE - off);
+#ifdef MADV_HUGEPAGE
+    madvise(p, len, MADV_HUGEPAGE);
+#endif
+  }
+  if (node >= 0)
+    gib_numa_prefer(p, len, node);
+  for (off = 0; off < len; off += GIB_ARENA_PAGE)
+    p[off] = 0;
+  return p;
+}
+
+/* The slot for a touched block that was meant for slot */
+static int gib_arena_landed ( const void *p, int slot ) {
+  int node;
+  if (slot == 0)
+    return 0;
+  node = gib_numa_node_of(p);
+  return (node >= 0 && node < GIB_NUMA_MAX_NODES) ? node + 1 : slot;
+}
+
+/* Refills the list of class cls for slot from a new arena.  If none of the
+ * arena landed on slot's node, *slot is changed to where its first block
+ * did.  Called with the lock held.
+ */
+static int gib_arena_split ( int cls, int *slot ) {
+  size_t size = 1ul << (cls + GIB_ARENA_MIN_LOG), off;
+  char *arena = gib_arena_map(GIB_ARENA_SIZE, *slot - 1);
+  struct gib_arena_hdr *h;
+  int first = -1;
+  if (arena == NULL)
+    return GIB_OOM;
+  for (off = 0; off < GIB_ARENA_SIZE; off += size) {
+    h = (struct gib_arena_hdr *)(arena + off);
+    h->size = size;
+    h->cls = cls;
+    h->locked = 0;
+    h->slot = gib_arena_landed(h, *slot);
+    h->next = gib_arena_lists[h->slot][cls];
+    gib_arena_lists[h->slot][cls] = h;
+    if (first < 0)
+      first = h->slot;
+  }
+  if (gib_arena_lists[*slot][cls] == NULL)
+    *slot = first;
+  return GIB_SUC;
+}
+
+/* Takes the smallest free large block that fits, as long as it is no more
+ * than twice the size needed, or maps a new one.  Called with the lock
+ * held.
+ */
+static struct gib_arena_hdr *gib_arena_get_large ( size_t size, int slot ) {
+  struct gib_arena_hdr **prev, **best = NULL, *h;
+  for (prev = &gib_arena_large[slot]; *prev != NULL; prev = &(*prev)->next)
+    if ((*prev)->size >= size && (*prev)->size <= 2*size &&
+	(best == NULL || (*prev)->size < (*best)->size))
+      best = prev;
+  if (best != NULL) {
+    h = *best;
+    *best = h->next;
+    return h;
+  }
+  if ((h = (struct gib_arena_hdr *)gib_arena_map(size, slot - 1)) == NULL)
+    return NULL;
+  h->size = size;
+  h->cls = -1;
+  h->locked = 0;
+  h->slot = gib_arena_landed(h, slot);
+  return h;
+}
+
+int gib_arena_alloc ( void **p, size_t size, int lock, int node ) {
+  struct gib_arena_hdr *h;
+  size_t need = size + GIB_ARENA_ALIGN;
+  int cls = 0;
+  int slot = (node >= 0 && node < GIB_NUMA_MAX_NODES) ? node + 1 : 0;
+  pthread_mutex_lock(&gib_arena_lock);
+  if (need <= (1ul << GIB_ARENA_MAX_LOG)) {
+    while ((1ul << (cls + GIB_ARENA_MIN_LOG)) < need)
+      cls++;
+    if (gib_arena_lists[slot][cls] == NULL &&
+	gib_arena_split(cls, &slot) != GIB_SUC) {
+      pthread_mutex_unlock(&gib_arena_lock);
+      return GIB_OOM;
+    }
+    h = gib_arena_lists[slot][cls];
+    gib_arena_lists[slot][cls] = h->next;
+  } else {
+    need = (need + GIB_ARENA_SIZE - 1) & ~(GIB_ARENA_SIZE - 1);
+    if ((h = gib_arena_get_large(need, slot)) == NULL) {
+      pthread_mutex_unlock(&gib_arena_lock);
+      return GIB_OOM;
+    }
+  }
+  if (lock && !h->locked) {
+    if (mlock(h, h->size) == 0)
+      h->locked = 1;
+    else if (!gib_arena_lock_warned) {
+      gib_arena_lock_warned = 1;
+      perror("Locking Gibraltar buffers into memory");
+    }
+  }
+  pthread_mutex_unlock(&gib_arena_lock);
+  *p = (char *)h + GIB_ARENA_ALIGN;
+  return GIB_SUC;
+}
+
+void gib_arena_free ( void *p ) {
+  struct gib_arena_hdr *h;
+  if (p == NULL)
+    return;
+  h = (struct gib_arena_hdr *)((char *)p - GIB_ARENA_ALIGN);
+  pthread_mutex_lock(&gib_arena_lock);
+  if (h->cls >= 0) {
+    h->next = gib_arena_lists[h->slot][h->cls];
+    gib_arena_lists[h->slot][h->cls] = h;
+  } else {
+    h->next = gib_arena_large[h->slot];
+    gib_arena_large[h->slot] = h;
+  }
+  pthread_mutex_unlock(&gib_arena_lock);
+}
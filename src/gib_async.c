@@ -0,0 +1,298 @@
+/* Asynchronous coding jobs.  A job runs the ordinary synchronous call on a
+ * library-owned worker, so it works with whichever implementation is built.
+ * Finished jobs either go to the job's callback or onto a per-context
+ * completion queue.  The queue is Dmitry Vyukov's intrusive MPSC queue:
+ * workers push with a single atomic exchange and never block.
+ *
+ * A queued job is owned by the queue until it is popped, and by its caller
+ * once it is freed; whichever of those happens second frees it, so a job
+ * that was waited for may be freed before gib_poll has returned it.
+ */
+
+#include "../inc/gibraltar.h"
+#include "../inc/gib_async.h"
+#include "../inc/gib_pool.h"
+#include "../inc/gib_numa.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+struct gib_cq_node {
+  _Atomic(struct gib_cq_node *) next;
+};
+
+struct gib_job_t {
+  struct gib_cq_node node; /* Must be first */
+  gib_context c;
+  int recover;
+  void *buffers;
+  int buf_size;
+  int recover_last;
+  int *buf_ids;
+  gib_job_cb cb;
+  void *arg;
+  int rc;
+  atomic_int done;
+  /* Set by the first of gib_poll returning a queued job and gib_job_free */
+  atomic_int claimed;
+};
+
+struct gib_async {
+  struct gib_pool *pool;
+  /* Completion queue */
+  _Atomic(struct gib_cq_node *) head;
+  struct gib_cq_node *tail;
+  struct gib_cq_node stub;
+  pthread_mutex_t poll_lock;    /* Serializes consumers only */
+  /* Waiting for jobs */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int waiters;
+  int outstanding;
+};
+
+/* Guards the lazy creation of every context's async state. */
+static pthread_mutex_t gib_async_init_lock = PTHREAD_MUTEX_INITIALIZER;
+/* The async state whose job the calling thread is running, if any */
+static __thread struct gib_async *gib_async_running;
+
+static void gib_cq_push ( struct gib_async *a, struct gib_cq_node *node ) {
+  struct gib_cq_node *prev;
+  atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+  prev = atomic_exchange_explicit(&a->head, node, memory_order_acq_rel);
+  atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+/* Returns NULL when the queue is empty, or when a push is half done. */
+static struct gib_cq_node *gib_cq_pop ( struct gib_async *a ) {
+  struct gib_cq_node *tail = a->tail, *next, *head;
+  next = atomic_load_explicit(&tail->next, memory_order_acquire);
+  if (tail == &a->stub) {
+    if (next == NULL)
+      return NULL;
+    a->tail = next;
+    tail = next;
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+  }
+  if (next != NULL) {
+    a->tail = next;
+    return tail;
+  }
+  head = atomic_load_explicit(&a->head, memory_order_acquire);
+  if (tail != head)
+    return NULL;
+  gib_cq_push(a, &a->stub);
+  next = atomic_load_explicit(&tail->next, memory_order_acquire);
+  if (next != NULL) {
+    a->tail = next;
+    return tail;
+  }
+  return NULL;
+}
+
+static struct gib_async *gib_async_get ( gib_context c ) {
+  struct gib_async *a;
+  pthread_mutex_lock(&gib_async_init_lock);
+  a = c->async;
+  if (a == NULL) {
+    /* The GPU driver keeps one set of device buffers per context, so its
+     * jobs run one at a time.  Elsewhere, jobs may run side by side.
+     */
+    int nworkers = (c->acc_context == NULL && c->nthreads > 1) ?
+      c->nthreads : 1;
+    a = (struct gib_async *)calloc(1, sizeof(struct gib_async));
+    if (a != NULL && gib_pool_create(&a->pool, nworkers)) {
+      free(a);
+      a = NULL;
+    }
+    if (a != NULL) {
+      atomic_init(&a->head, &a->stub);
+      a->tail = &a->stub;
+      atomic_init(&a->stub.next, NULL);
+      pthread_mutex_init(&a->poll_lock, NULL);
+      pthread_mutex_init(&a->lock, NULL);
+      pthread_cond_init(&a->cond, NULL);
+      c->async = a;
+    }
+  }
+  pthread_mutex_unlock(&gib_async_init_lock);
+  return a;
+}
+
+static void gib_job_run ( void *arg, int task ) {
+  gib_job job = (gib_job)arg;
+  struct gib_async *a = job->c->async;
+  gib_job_cb cb = job->cb;
+  void *cb_arg = job->arg;
+
+  gib_async_running = a;
+  if (job->recover)
+    job->rc = gib_recover(job->buffers, job->buf_size, job->buf_ids,
+			  job->recover_last, job->c);
+  else
+    job->rc = gib_generate(job->buffers, job->buf_size, job->c);
+  /* done is set first, as the push makes the job visible to gib_poll.
+   * The job is not touched after this.  A callback may free it, and a
+   * queued job may be polled and freed at once.
+   */
+  atomic_store(&job->done, 1);
+  if (cb != NULL)
+    cb(job, cb_arg);
+  else
+    gib_cq_push(a, &job->node);
+
+  /* Counted until the callback returns, so that gib_destroy also waits for
+   * any jobs it submits.
+   */
+  pthread_mutex_lock(&a->lock);
+  a->outstanding--;
+  if (a->waiters > 0)
+    pthread_cond_broadcast(&a->cond);
+  pthread_mutex_unlock(&a->lock);
+  gib_async_running = NULL;
+}
+
+static int gib_submit ( gib_job job, gib_job *handle ) {
+  gib_context c = job->c;
+  struct gib_async *a = gib_async_get(c);
+  int rc;
+  if (a == NULL) {
+    free(job);
+    return GIB_OOM;
+  }
+  atomic_init(&job->done, 0);
+  atomic_init(&job->claimed, 0);
+  atomic_init(&job->node.next, NULL);
+  if (handle != NULL)
+    *handle = job;
+  pthread_mutex_lock(&a->lock);
+  a->outstanding++;
+  pthread_mutex_unlock(&a->lock);
+  /* Run by a worker on the node holding the buffers, if there is one */
+  rc = gib_pool_submit(a->pool, gib_numa_node_of(job->buffers), gib_job_run,
+		       job);
+  if (rc != GIB_SUC) {
+    pthread_mutex_lock(&a->lock);
+    a->outstanding--;
+    pthread_mutex_unlock(&a->lock);
+    if (handle != NULL)
+      *handle = NULL;
+    free(job);
+  }
+  return rc;
+}
+
+int gib_submit_generate ( void *buffers, int buf_size, gib_context c,
+			  gib_job_cb cb, void *arg, gib_job *job ) {
+  gib_job j = (gib_job)calloc(1, sizeof(struct gib_job_t));
+  if (j == NULL)
+    return GIB_OOM;
+  j->c = c;
+  j->buffers = buffers;
+  j->buf_size = buf_size;
+  j->cb = cb;
+  j->arg = arg;
+  return gib_submit(j, job);
+}
+
+int gib_submit_recover ( void *buffers, int buf_size, int *buf_ids,
+			 int recover_last, gib_context c, gib_job_cb cb,
+			 void *arg, gib_job *job ) {
+  /* buf_ids is copied, so the caller may reuse it right away. */
+  int nids = c->n + recover_last;
+  gib_job j = (gib_job)calloc(1, sizeof(struct gib_job_t) + nids*sizeof(int));
+  if (j == NULL)
+    return GIB_OOM;
+  j->c = c;
+  j->recover = 1;
+  j->buffers = buffers;
+  j->buf_size = buf_size;
+  j->recover_last = recover_last;
+  j->buf_ids = (int *)(j + 1);
+  memcpy(j->buf_ids, buf_ids, nids*sizeof(int));
+  j->cb = cb;
+  j->arg = arg;
+  return gib_submit(j, job);
+}
+
+int gib_poll ( gib_context c, gib_job *jobs, int max ) {
+  struct gib_async *a = c->async;
+  struct gib_cq_node *node;
+  gib_job job;
+  int count = 0;
+  if (a == NULL)
+    return 0;
+  pthread_mutex_lock(&a->poll_lock);
+  while (count < max && (node = gib_cq_pop(a)) != NULL) {
+    job = (gib_job)node;
+    /* A job freed while it was queued is freed here instead. */
+    if (atomic_exchange(&job->claimed, 1))
+      free(job);
+    else
+      jobs[count++] = job;
+  }
+  pthread_mutex_unlock(&a->poll_lock);
+  return count;
+}
+
+int gib_job_done ( gib_job job ) {
+  return atomic_load(&job->done);
+}
+
+int gib_job_wait ( gib_job job ) {
+  struct gib_async *a = job->c->async;
+  if (!atomic_load(&job->done)) {
+    pthread_mutex_lock(&a->lock);
+    a->waiters++;
+    while (!atomic_load(&job->done))
+      pthread_cond_wait(&a->cond, &a->lock);
+    a->waiters--;
+    pthread_mutex_unlock(&a->lock);
+  }
+  return job->rc;
+}
+
+void *gib_job_arg ( gib_job job ) {
+  return job->arg;
+}
+
+int gib_job_free ( gib_job job ) {
+  /* A queued job still on the queue is left for gib_poll to free. */
+  if (job->cb == NULL && !atomic_exchange(&job->claimed, 1))
+    return GIB_SUC;
+  free(job);
+  return GIB_SUC;
+}
+
+int gib_async_destroy ( gib_context c ) {
+  struct gib_async *a = c->async;
+  struct gib_cq_node *node;
+  gib_job job;
+  if (a == NULL)
+    return GIB_SUC;
+  /* A worker cannot wait for its own job or join itself. */
+  if (gib_async_running == a)
+    return GIB_ERR;
+  /* Let every outstanding job finish before the workers go away. */
+  pthread_mutex_lock(&a->lock);
+  a->waiters++;
+  while (a->outstanding > 0)
+    pthread_cond_wait(&a->cond, &a->lock);
+  pthread_mutex_unlock(&a->lock);
+  gib_pool_destroy(a->pool);
+  /* Jobs left on the queue go back to their callers, or are freed if their
+   * callers already freed them.
+   */
+  while ((node = gib_cq_pop(a)) != NULL) {
+    job = (gib_job)node;
+    if (atomic_exchange(&job->claimed, 1))
+      free(job);
+  }
+  pthread_cond_destroy(&a->cond);
+  pthread_mutex_destroy(&a->lock);
+  pthread_mutex_destroy(&a->poll_lock);
+  free(a);
+  c->async = NULL;
+  return GIB_SUC;
+}
@@ -0,0 +1,241 @@
+/* Coding kernels specialized at compile time for each geometry.  Where the
+ * dot-product kernels make one pass over the sources for every output, these
+ * load each source vector once and fold it into all of the outputs, whose
+ * accumulators stay in registers.  With nsrc and ndst known to the compiler,
+ * every loop over them is unrolled.  The multiplies are the same split-nibble
+ * lookups, so the bytes written match the other kernels.
+ */
+
+#include "../inc/gib_galois.h"
+#include "../inc/gib_cpu_funcs.h"
+#include <utility>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+/* The vector helpers return vectors from functions without the target's
+ * options; they are always inlined into a function that has them, so the
+ * ABI note GCC gives for this does not apply.
+ */
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+/* The geometries that get their own kernel.  Sources match the range the
+ * examples test; any number of outputs up to the same limit is covered, since
+ * recovery often rebuilds just one or two buffers.
+ */
+#define GIB_CODE_MIN_SRC 2
+#define GIB_CODE_MAX_SRC 16
+#define GIB_CODE_MAX_DST 16
+#define GIB_CODE_NSRC (GIB_CODE_MAX_SRC - GIB_CODE_MIN_SRC + 1)
+
+namespace {
+
+struct gib_avx2 {
+  typedef __m256i vec;
+  enum { width = 32, group = 8 }; /* group: accumulators kept in registers */
+
+  __attribute__((target("avx2")))
+  static inline vec zero ( void ) {
+    return _mm256_setzero_si256();
+  }
+  __attribute__((target("avx2")))
+  static inline vec load ( const unsigned char *p ) {
+    return _mm256_loadu_si256((const __m256i *)p);
+  }
+  __attribute__((target("avx2")))
+  static inline void store ( unsigned char *p, vec x ) {
+    _mm256_storeu_si256((__m256i *)p, x);
+  }
+  __attribute__((target("avx2")))
+  static inline vec low ( vec x ) {
+    return _mm256_and_si256(x, _mm256_set1_epi8(0x0f));
+  }
+  __attribute__((target("avx2")))
+  static inline vec high ( vec x ) {
+    return _mm256_and_si256(_mm256_srli_epi64(x, 4), _mm256_set1_epi8(0x0f));
+  }
+  /* acc ^ c*x, with t the nibble tables for c */
+  __attribute__((target("avx2")))
+  static inline vec mul_add ( vec acc, const unsigned char *t, vec lo,
+			      vec hi ) {
+    __m256i tl = _mm256_broadcastsi128_si256(
+      _mm_loadu_si128((const __m128i *)t));
+    __m256i th = _mm256_broadcastsi128_si256(
+      _mm_loadu_si128((const __m128i *)(t + 16)));
+    return _mm256_xor_si256(acc, _mm256_xor_si256(
+      _mm256_shuffle_epi8(tl, lo), _mm256_shuffle_epi8(th, hi)));
+  }
+};
+
+struct gib_avx512 {
+  typedef __m512i vec;
+  enum { width = 64, group = 16 };
+
+  __attribute__((target("avx512f,avx512bw")))
+  static inline vec zero ( void ) {
+    return _mm512_setzero_si512();
+  }
+  __attribute__((target("avx512f,avx512bw")))
+  static inline vec load ( const unsigned char *p ) {
+    return _mm512_loadu_si512((const void *)p);
+  }
+  __attribute__((target("avx512f,avx512bw")))
+  static inline void store ( unsigned char *p, vec x ) {
+    _mm512_storeu_si512((void *)p, x);
+  }
+  __attribute__((target("avx512f,avx512bw")))
+  static inline vec low ( vec x ) {
+    return _mm512_and_si512(x, _mm512_set1_epi8(0x0f));
+  }
+  /* The unmasked forms of these two start from _mm512_undefined_epi32(),
+   * which draws uninitialized-use warnings once inlined here.
+   */
+  __attribute__((target("avx512f,avx512bw")))
+  static inline vec high ( vec x ) {
+    return _mm512_and_si512(_mm512_maskz_srli_epi64((__mmask8)-1, x, 4),
+			    _mm512_set1_epi8(0x0f));
+  }
+  __attribute__((target("avx512f,avx512bw")))
+  static inline vec mul_add ( vec acc, const unsigned char *t, vec lo,
+			      vec hi ) {
+    __m512i tl = _mm512_maskz_broadcast_i32x4((__mmask16)-1,
+      _mm_loadu_si128((const __m128i *)t));
+    __m512i th = _mm512_maskz_broadcast_i32x4((__mmask16)-1,
+      _mm_loadu_si128((const __m128i *)(t + 16)));
+    return _mm512_xor_si512(acc, _mm512_xor_si512(
+      _mm512_shuffle_epi8(tl, lo), _mm512_shuffle_epi8(th, hi)));
+  }
+};
+
+/* R outputs of U adjacent vector columns.  t holds the nibble tables of
+ * their coefficients, row by row.
+ */
+template <class V, int N, int R, int U>
+static inline void gib_code_column ( const unsigned char *const *t,
+				     unsigned char **src, unsigned char **dst,
+				     int b ) {
+  typename V::vec acc[U][R];
+#pragma GCC unroll 16
+  for (int r = 0; r < R; r++)
+#pragma GCC unroll 2
+    for (int u = 0; u < U; u++)
+      acc[u][r] = V::zero();
+#pragma GCC unroll 16
+  for (int i = 0; i < N; i++) {
+    typename V::vec lo[U], hi[U];
+#pragma GCC unroll 2
+    for (int u = 0; u < U; u++) {
+      typename V::vec x = V::load(src[i] + b + u*V::width);
+      lo[u] = V::low(x);
+      hi[u] = V::high(x);
+    }
+#pragma GCC unroll 16
+    for (int r = 0; r < R; r++)
+#pragma GCC unroll 2
+      for (int u = 0; u < U; u++)
+	acc[u][r] = V::mul_add(acc[u][r], t[r*N + i], lo[u], hi[u]);
+  }
+#pragma GCC unroll 16
+  for (int r = 0; r < R; r++)
+#pragma GCC unroll 2
+    for (int u = 0; u < U; u++)
+      V::store(dst[r] + b + u*V::width, acc[u][r]);
+}
+
+/* The outputs are taken V::group at a time, which is as many accumulators
+ * as fit in registers alongside the tables and the source vectors.  The
+ * later groups of a column reread its sources, but from the L1 cache.  When
+ * there are few outputs, two columns are done per pass instead, so that each
+ * table load serves twice as many bytes.
+ */
+template <class V, int N, int M>
+static inline void gib_code ( int len, int offset, const unsigned char *rows,
+			      unsigned char **src, unsigned char **dst ) {
+  const int G = (M < (int)V::group) ? M : (int)V::group;
+  const int U = (2*M <= (int)V::group) ? 2 : 1;
+  const int step = U*V::width;
+  const unsigned char *t[N*M];
+  int b, end = offset + len;
+#pragma GCC unroll 16
+  for (int k = 0; k < N*M; k++)
+    t[k] = gib_gf_nib_table[rows[k]];
+  for (b = offset; b + step <= end; b += step) {
+#pragma GCC unroll 2
+    for (int j = 0; j + G <= M; j += G)
+      gib_code_column<V, N, G, U>(t + j*N, src, dst + j, b);
+    if (M % G != 0)
+      gib_code_column<V, N, M % G, U>(t + (M - M % G)*N, src,
+				      dst + M - M % G, b);
+  }
+  for (; b < end; b++)
+    for (int j = 0; j < M; j++) {
+      unsigned char acc = 0;
+      for (int i = 0; i < N; i++)
+	acc ^= gib_gf_table[rows[j*N + i]][src[i][b]];
+      dst[j][b] = acc;
+    }
+}
+
+/* The helpers above take their instruction set from V, so each kernel is
+ * flattened into a function built for that instruction set.
+ */
+struct gib_avx2_code {
+  template <int N, int M>
+  __attribute__((target("avx2"), flatten))
+  static void code ( int len, int offset, const unsigned char *rows,
+		     unsigned char **src, unsigned char **dst ) {
+    gib_code<gib_avx2, N, M>(len, offset, rows, src, dst);
+  }
+};
+
+struct gib_avx512_code {
+  template <int N, int M>
+  __attribute__((target("avx512f,avx512bw"), flatten))
+  static void code ( int len, int offset, const unsigned char *rows,
+		     unsigned char **src, unsigned char **dst ) {
+    gib_code<gib_avx512, N, M>(len, offset, rows, src, dst);
+  }
+};
+
+/* Entry k is the kernel for nsrc = GIB_CODE_MIN_SRC + k/GIB_CODE_MAX_DST and
+ * ndst = 1 + k%GIB_CODE_MAX_DST.
+ */
+struct gib_code_table {
+  gib_code_fn fn[GIB_CODE_NSRC*GIB_CODE_MAX_DST];
+};
+
+template <class K, int... I>
+static constexpr gib_code_table gib_code_make (
+  std::integer_sequence<int, I...> ) {
+  return gib_code_table { {
+      &K::template code<GIB_CODE_MIN_SRC + I/GIB_CODE_MAX_DST,
+			1 + I%GIB_CODE_MAX_DST>... } };
+}
+
+typedef std::make_integer_sequence<int, GIB_CODE_NSRC*GIB_CODE_MAX_DST>
+  gib_code_all;
+
+static constexpr gib_code_table gib_avx2_table =
+  gib_code_make<gib_avx2_code>(gib_code_all());
+static constexpr gib_code_table gib_avx512_table =
+  gib_code_make<gib_avx512_code>(gib_code_all());
+
+static gib_code_fn gib_code_lookup ( const gib_code_table &table,
+				     int nsrc, int ndst ) {
+  if (nsrc < GIB_CODE_MIN_SRC || nsrc > GIB_CODE_MAX_SRC || ndst < 1 ||
+      ndst > GIB_CODE_MAX_DST)
+    return NULL;
+  return table.fn[(nsrc - GIB_CODE_MIN_SRC)*GIB_CODE_MAX_DST + ndst - 1];
+}
+
+} /* namespace */
+
+extern "C" gib_code_fn gib_cpu_code_avx2 ( int nsrc, int ndst ) {
+  return gib_code_lookup(gib_avx2_table, nsrc, ndst);
+}
+
+extern "C" gib_code_fn gib_cpu_code_avx512 ( int nsrc, int ndst ) {
+  return gib_code_lookup(gib_avx512_table, nsrc, ndst);
+}
+
+#endif
@@ -7,17 +7,271 @@
 #include "../inc/gibraltar.h"
 #include "../inc/gib_galois.h"
 #include "../inc/gib_cpu_funcs.h"
+#include "../inc/gib_pool.h"
+#include "../inc/gib_decode_cache.h"
+#include "../inc/gib_crc32c.h"
+#include "../inc/gib_xor.h"
+#include "../inc/gib_jit.h"
+#include "../inc/gib_tune.h"
+#include "../inc/gib_stats.h"
+#include "../inc/gib_trace.h"
+#include "../inc/gib_arena.h"
+#include "../inc/gib_numa.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+
+/* The coding loops work on a tile of every buffer at a time.  The tile is
+ * sized so the sources of one tile stay in cache while each output row is
+ * computed from them, which keeps the throughput flat once the buffers are
+ * larger than the cache.
+ */
+#define GIB_CPU_TILE_BUDGET (128*1024)
+#define GIB_CPU_TILE_MIN 1024
+#define GIB_CPU_TILE_MAX (64*1024)
+
+static int gib_cpu_tile_size ( int nsrc ) {
+  int tile = GIB_CPU_TILE_BUDGET / nsrc;
+  tile -= tile % GIB_CPU_TILE_MIN;
+  if (tile < GIB_CPU_TILE_MIN)
+    tile = GIB_CPU_TILE_MIN;
+  if (tile > GIB_CPU_TILE_MAX)
+    tile = GIB_CPU_TILE_MAX;
+  return tile;
+}
+
+/* Calls with at least this many bytes per buffer are split across the
+ * context's threads, in column ranges that are a multiple of
+ * GIB_CPU_MT_ALIGN bytes wide.
+ */
+#define GIB_CPU_MT_THRESHOLD (64*1024)
+#define GIB_CPU_MT_ALIGN 64
+
+/* Default number of erasure patterns kept in the decode-matrix cache */
+#define GIB_CPU_DECODE_CACHE_SIZE 1024
+
+/* Computes dst[j] = rows[j*nsrc..] . src over bytes [lo, hi) of each buffer.
+ * Each output is written once by the kernel, so no zeroing pass is needed
+ * and the outputs may not be read beforehand.  If crcs is given, crcs[i] is
+ * set to the CRC32C of the range of src[i], and crcs[nsrc+j] to that of
+ * dst[j].  They are taken tile by tile, while the sources are still in
+ * cache from the kernel and just after the outputs are written.
+ */
+static void gib_cpu_code_range ( const struct gib_cpu_plan *p,
+				 const unsigned char *rows,
+				 const struct gib_xor_sched *xs,
+				 const struct gib_jit_code *jc, int nsrc,
+				 unsigned char **src, int ndst,
+				 unsigned char **dst, int lo, int hi,
+				 unsigned int *crcs ) {
+  int off, j;
+  gib_code_fn code = NULL;
+  if (xs == NULL && jc == NULL && p->kernel->code != NULL)
+    code = p->kernel->code(nsrc, ndst);
+  if (crcs != NULL)
+    memset(crcs, 0, (nsrc+ndst)*sizeof(*crcs));
+  for (off = lo; off < hi; off += p->tile_size) {
+    int tile = (hi - off < p->tile_size) ? hi - off : p->tile_size;
+    GIB_TRACE_BEGIN(tile, off);
+    if (xs != NULL)
+      gib_xor_run(xs, tile, off, src, dst, 0);
+    else if (jc != NULL)
+      gib_jit_run(jc, tile, off, src, dst);
+    else if (code != NULL)
+      code(tile, off, rows, src, dst);
+    else
+      for (j = 0; j < ndst; j++)
+	p->kernel->dot_prod(tile, off, nsrc, rows + j*nsrc, src, dst[j]);
+    if (crcs != NULL) {
+      gib_crc32c_multi(crcs, src, nsrc, off, tile);
+      gib_crc32c_multi(crcs + nsrc, dst, ndst, off, tile);
+    }
+    GIB_TRACE_END(tile, off);
+  }
+}
+
+struct gib_cpu_job {
+  const struct gib_cpu_plan *p;
+  const unsigned char *rows;
+  const struct gib_xor_sched *xs; /* NULL unless the XOR engine is used */
+  const struct gib_jit_code *jc;  /* NULL unless the JIT engine is used */
+  int nsrc, ndst;
+  unsigned char **src, **dst;
+  int len, chunk;
+  unsigned int *crcs; /* nsrc+ndst per task, or NULL */
+};
+
+static void gib_cpu_code_task ( void *arg, int task ) {
+  struct gib_cpu_job *job = (struct gib_cpu_job *)arg;
+  int lo = task*job->chunk;
+  int hi = (lo + job->chunk < job->len) ? lo + job->chunk : job->len;
+  GIB_TRACE_BEGIN(task, task);
+  gib_cpu_code_range(job->p, job->rows, job->xs, job->jc, job->nsrc,
+		     job->src, job->ndst, job->dst, lo, hi,
+		     (job->crcs == NULL) ? NULL :
+		     job->crcs + task*(job->nsrc+job->ndst));
+  GIB_TRACE_END(task, task);
+}
+
+/* Looks up the XOR schedule for rows when the context uses the XOR engine,
+ * which can only code whole blocks.
+ */
+static int gib_cpu_xor_get ( gib_context c, const unsigned char *rows,
+			     int nsrc, int ndst, int len,
+			     struct gib_xor_sched **xs ) {
+  *xs = NULL;
+  if (c->bitmatrix == NULL)
+    return GIB_SUC;
+  if (len % GIB_XOR_BLOCK != 0) {
+    fprintf(stderr, "The XOR engine needs lengths that are a multiple of "
+	    "%i bytes.\n", GIB_XOR_BLOCK);
+    return GIB_ERR;
+  }
+  *xs = gib_xor_get(c->bitmatrix, rows, nsrc, ndst);
+  return (*xs == NULL) ? GIB_OOM : GIB_SUC;
+}
+
+/* Looks up the generated routine for rows when the context uses the JIT
+ * engine.  NULL means the kernels are to be used, which write the same
+ * bytes.
+ */
+static struct gib_jit_code *gib_cpu_jit_get ( gib_context c,
+					      const unsigned char *rows,
+					      int nsrc, int ndst ) {
+  if (c->jit == NULL)
+    return NULL;
+  return gib_jit_get(c->jit, rows, nsrc, ndst);
+}
+
+/* Splits gib_cpu_code_range across p->nthreads of the context's threads.
+ * Each task checksums its own columns, and the pieces are joined in order
+ * afterwards.  The tasks go to the workers on the node holding the
+ * sources, which are most of what is read.
+ */
+static int gib_cpu_code_mt ( gib_context c, const struct gib_cpu_plan *p,
+			     const unsigned char *rows,
+			     const struct gib_xor_sched *xs,
+			     const struct gib_jit_code *jc, int nsrc,
+			     unsigned char **src, int ndst,
+			     unsigned char **dst, int len,
+			     unsigned int *crcs ) {
+  struct gib_cpu_job job;
+  int ntasks, task, i, nbufs = nsrc + ndst;
+  int align = (xs != NULL) ? GIB_XOR_BLOCK : GIB_CPU_MT_ALIGN;
+  job.p = p;
+  job.rows = rows;
+  job.xs = xs;
+  job.jc = jc;
+  job.nsrc = nsrc;
+  job.ndst = ndst;
+  job.src = src;
+  job.dst = dst;
+  job.len = len;
+  job.chunk = (len + p->nthreads - 1) / p->nthreads;
+  job.chunk += align - 1;
+  job.chunk -= job.chunk % align;
+  job.crcs = NULL;
+  ntasks = (len + job.chunk - 1) / job.chunk;
+  if (crcs != NULL) {
+    job.crcs = (unsigned int *)malloc(ntasks*nbufs*sizeof(*job.crcs));
+    if (job.crcs == NULL)
+      return GIB_OOM;
+  }
+  gib_pool_run(c->pool, gib_numa_node_of(src[0]), ntasks, gib_cpu_code_task,
+	       &job);
+  gib_stats_add(c, GIB_STAT_MT_PASSES, 1);
+  gib_stats_add(c, GIB_STAT_MT_TASKS, ntasks);
+  if (crcs != NULL) {
+    memcpy(crcs, job.crcs, nbufs*sizeof(*crcs));
+    for (task = 1; task < ntasks; task++) {
+      int lo = task*job.chunk;
+      int width = (lo + job.chunk < len) ? job.chunk : len - lo;
+      for (i = 0; i < nbufs; i++)
+	crcs[i] = gib_crc32c_combine(crcs[i], job.crcs[task*nbufs+i], width);
+    }
+    free(job.crcs);
+  }
+  return GIB_SUC;
+}
+
+/* Counts one pass over the data under the engine that coded it */
+static void gib_cpu_count_pass ( gib_context c,
+				 const struct gib_cpu_kernel *kernel,
+				 const struct gib_xor_sched *xs,
+				 const struct gib_jit_code *jc ) {
+  int variant = kernel - gib_cpu_kernels;
+  if (xs != NULL)
+    variant = GIB_STAT_VARIANT_XOR;
+  else if (jc != NULL)
+    variant = GIB_STAT_VARIANT_JIT;
+  gib_stats_add(c, GIB_STAT_PASSES, 1);
+  gib_stats_add(c, GIB_STAT_VARIANT + variant, 1);
+}
+
+void gib_cpu_plan_for ( gib_context c, int len, struct gib_cpu_plan *p ) {
+  if (c->tune != NULL) {
+    *p = c->tune->plans[gib_tune_class(len)];
+    return;
+  }
+  p->kernel = c->kernel;
+  p->tile_size = c->tile_size;
+  p->nthreads = (c->pool == NULL || len < c->mt_threshold) ? 1 : c->nthreads;
+}
+
+int gib_cpu_code_plan ( gib_context c, const struct gib_cpu_plan *p,
+			const unsigned char *rows, int nsrc,
+			unsigned char **src, int ndst, unsigned char **dst,
+			int len, unsigned int *crcs ) {
+  struct gib_xor_sched *xs;
+  struct gib_jit_code *jc;
+  unsigned long start = 0;
+  int rc;
+  if ((rc = gib_cpu_xor_get(c, rows, nsrc, ndst, len, &xs)))
+    return rc;
+  jc = gib_cpu_jit_get(c, rows, nsrc, ndst);
+  /* Reading the clock is the only cost worth skipping when not counting. */
+  if (c->stats != NULL)
+    start = gib_stats_ns();
+  GIB_TRACE_BEGIN(code, len);
+  if (p->nthreads <= 1)
+    gib_cpu_code_range(p, rows, xs, jc, nsrc, src, ndst, dst, 0, len, crcs);
+  else
+    rc = gib_cpu_code_mt(c, p, rows, xs, jc, nsrc, src, ndst, dst, len,
+			 crcs);
+  GIB_TRACE_END(code, len);
+  if (c->stats != NULL) {
+    gib_stats_add(c, GIB_STAT_KERNEL_NS, gib_stats_ns() - start);
+    gib_cpu_count_pass(c, p->kernel, xs, jc);
+  }
+  if (xs != NULL)
+    gib_xor_release(c->bitmatrix, xs);
+  if (jc != NULL)
+    gib_jit_release(c->jit, jc);
+  return rc;
+}
+
+/* As gib_cpu_code_range over [0, len), with the plan for len */
+static int gib_cpu_code ( gib_context c, const unsigned char *rows, int nsrc,
+			  unsigned char **src, int ndst, unsigned char **dst,
+			  int len, unsigned int *crcs ) {
+  struct gib_cpu_plan p;
+  gib_cpu_plan_for(c, len, &p);
+  return gib_cpu_code_plan(c, &p, rows, nsrc, src, ndst, dst, len, crcs);
+}
 
 int gib_cpu_init ( int n, int m, gib_context *c ) {
+  return gib_cpu_init_opts(n, m, NULL, c);
+}
+
+int gib_cpu_init_opts ( int n, int m, const struct gib_options *opts,
+			gib_context *c ) {
   int rc;
   if (gib_galois_init()) {
     return GIB_ERR;
   }
   
-  *c = (gib_context) malloc(sizeof(struct gib_context_t));
-  if (c == NULL)
+  *c = (gib_context) calloc(1, sizeof(struct gib_context_t));
+  if (*c == NULL)
     return GIB_OOM;
   (*c)->n = n;
   (*c)->m = m;
@@ -26,46 +280,135 @@ int gib_cpu_init ( int n, int m, gib_context *c ) {
   if ((*c)->F == NULL)
     return GIB_OOM;
   
-  if ((rc = gib_galois_gen_F((*c)->F, m, n)))
+  /* The XOR engine defaults to a Cauchy matrix, as those can be chosen for
+   * few ones in bit-matrix form.
+   */
+  int engine = (opts != NULL) ? opts->engine : GIB_ENGINE_TABLE;
+  int matrix = (opts != NULL) ? opts->matrix : 0;
+  if (engine != GIB_ENGINE_TABLE && engine != GIB_ENGINE_XOR &&
+      engine != GIB_ENGINE_JIT) {
+    fprintf(stderr, "Unknown coding engine %i.\n", engine);
+    return GIB_ERR;
+  }
+  if (matrix == 0)
+    matrix = (engine == GIB_ENGINE_XOR) ? GIB_MATRIX_CAUCHY :
+      GIB_MATRIX_VANDERMONDE;
+  if (matrix == GIB_MATRIX_CAUCHY) {
+    if ((rc = gib_galois_gen_cauchy((*c)->F, m, n)))
+      return rc;
+    (*c)->cauchy = 1;
+  } else if (matrix == GIB_MATRIX_VANDERMONDE) {
+    if ((rc = gib_galois_gen_F((*c)->F, m, n)))
+      return rc;
+  } else {
+    fprintf(stderr, "Unknown coding matrix %i.\n", matrix);
+    return GIB_ERR;
+  }
+  if (engine == GIB_ENGINE_XOR &&
+      (rc = gib_xor_create(&(*c)->bitmatrix, *c)))
     return rc;
+  if (engine == GIB_ENGINE_JIT && (rc = gib_jit_create(&(*c)->jit, *c)))
+    return rc;
+  
+  (*c)->kernel = gib_cpu_kernel_select();
+  (*c)->tile_size = gib_cpu_tile_size(n);
   
+  /* Threads used for a single call, in the style of GIB_GPU_ID */
+  (*c)->nthreads = 1;
+  if (opts != NULL && opts->nthreads > 0)
+    (*c)->nthreads = opts->nthreads;
+  else if (getenv("GIB_NUM_THREADS") != NULL)
+    (*c)->nthreads = atoi(getenv("GIB_NUM_THREADS"));
+  if ((*c)->nthreads < 1)
+    (*c)->nthreads = 1;
+  (*c)->mt_threshold = GIB_CPU_MT_THRESHOLD;
+  if (opts != NULL && opts->mt_threshold > 0)
+    (*c)->mt_threshold = opts->mt_threshold;
+  if ((*c)->nthreads > 1) {
+    /* The calling thread is one of the nthreads. */
+    if ((rc = gib_pool_create(&(*c)->pool, (*c)->nthreads - 1)))
+      return rc;
+  }
+  
+  (*c)->alloc_flags = (opts != NULL) ? opts->alloc : 0;
+  if ((*c)->alloc_flags == 0 && getenv("GIB_ALLOC") != NULL) {
+    if (strstr(getenv("GIB_ALLOC"), "mlock") != NULL)
+      (*c)->alloc_flags |= GIB_ALLOC_MLOCK;
+    if (strstr(getenv("GIB_ALLOC"), "pad") != NULL)
+      (*c)->alloc_flags |= GIB_ALLOC_PAD;
+  }
+  if ((*c)->alloc_flags < 0)
+    (*c)->alloc_flags = 0;
+  
+  int cache_size = GIB_CPU_DECODE_CACHE_SIZE;
+  if (opts != NULL && opts->decode_cache_size != 0)
+    cache_size = opts->decode_cache_size;
+  if (cache_size > 0) {
+    if ((rc = gib_dc_create(&(*c)->dcache, n, cache_size)))
+      return rc;
+  }
+
+  /* Tuning is asked for in the style of GIB_NUM_THREADS, and comes last so
+   * that it times the context as it will be used.
+   */
+  int tune = (opts != NULL) ? opts->tune : 0;
+  if (tune == 0 && getenv("GIB_TUNE") != NULL)
+    tune = strcmp(getenv("GIB_TUNE"), "0") != 0;
+  if (tune > 0 && (rc = gib_tune_create(&(*c)->tune, *c)))
+    return rc;
   return 0;
 }
 
 int gib_cpu_destroy ( gib_context c ) {
+  if (c->pool != NULL)
+    gib_pool_destroy(c->pool);
+  if (c->dcache != NULL)
+    gib_dc_destroy(c->dcache);
+  if (c->bitmatrix != NULL)
+    gib_xor_destroy(c->bitmatrix);
+  if (c->jit != NULL)
+    gib_jit_destroy(c->jit);
+  if (c->tune != NULL)
+    gib_tune_destroy(c->tune);
   free(c->F);
   free(c);
   return 0;
 }
 
 int gib_cpu_alloc ( void **buffers, int buf_size, int *ld, gib_context c ) {
-  /* In order to improve the performance of this routine, the stride can be
-   * altered through the ld parameter.  The user can continue assuming the
-   * buf_size is the same if he/she wants, but the routines may run slower.
-   * 
-   * Athough this CPU implementation is not performance-based, it operates
-   * twice as fast if the stride is odd, so it is done.
+  /* Stripes are placed on the nodes of the context's workers in turn, and
+   * the calls coding them are routed to the workers of whichever node the
+   * pages landed on.
+   *
+   * In order to improve the performance of this routine, the stride can be
+   * altered through the ld parameter.  It is only changed when asked for,
+   * as callers that ignore ld pass buf_size to the coding calls as the
+   * stride.  A padded stride keeps every buffer aligned and off the 4 KiB
+   * multiples that would put the same offset of each buffer in the same
+   * cache set.
    */
-  if (buf_size % 2 == 0)
-    buf_size += 1;
-  
+  int stride = buf_size;
+  if (c->alloc_flags & GIB_ALLOC_PAD) {
+    stride = (buf_size + GIB_ARENA_ALIGN - 1) / GIB_ARENA_ALIGN *
+      GIB_ARENA_ALIGN;
+    if (stride % 4096 == 0)
+      stride += GIB_ARENA_ALIGN;
+  }
   if (ld != NULL)
-    (*ld) = buf_size;
+    (*ld) = stride;
   
-  *buffers = malloc((c->n+c->m)*buf_size);
-  if (*buffers == NULL) {
-    return GIB_OOM;
-  }
-  return 0;
+  return gib_arena_alloc(buffers, (size_t)(c->n+c->m)*stride,
+			 (c->alloc_flags & GIB_ALLOC_MLOCK) != 0,
+			 gib_pool_next_node(c->pool));
 }
 
 int gib_cpu_free ( void *buffers ) {
-  free(buffers);
+  gib_arena_free(buffers);
   return 0;
 }
 
 int gib_cpu_generate ( void *buffers, int buf_size, gib_context c ) {
-  return gib_generate_nc(buffers, buf_size, buf_size, c);
+  return gib_cpu_generate_nc(buffers, buf_size, buf_size, c);
 }
 
 int gib_cpu_generate_nc ( void *buffers, int buf_size, int work_size,  
@@ -74,27 +417,385 @@ int gib_cpu_generate_nc ( void *buffers, int buf_size, int work_size,
    * eventually.
    */
   unsigned char *c_buf = (unsigned char *)buffers;
-  int i, b, j, tmp;
+  unsigned char *src[256], *dst[256];
+  int i;
   int m = c->m;
   int n = c->n;
-  for (b = 0; b < work_size; b++) {
-    for (tmp = n; tmp < m + n; ++tmp) {
-      c_buf[tmp*buf_size+b] = 0;
+  for (i = 0; i < n; i++)
+    src[i] = c_buf + i*buf_size;
+  for (i = 0; i < m; i++)
+    dst[i] = c_buf + (n+i)*buf_size;
+  return gib_cpu_code(c, c->F, n, src, m, dst, work_size, NULL);
+}
+
+int gib_cpu_generate_crc ( void *buffers, int buf_size, unsigned int *crcs,
+			   gib_context c ) {
+  unsigned char *c_buf = (unsigned char *)buffers;
+  unsigned char *src[256], *dst[256];
+  int i;
+  for (i = 0; i < c->n; i++)
+    src[i] = c_buf + i*buf_size;
+  for (i = 0; i < c->m; i++)
+    dst[i] = c_buf + (c->n+i)*buf_size;
+  return gib_cpu_code(c, c->F, c->n, src, c->m, dst, buf_size, crcs);
+}
+
+/* A batch of small stripes is spread across the threads by stripe rather
+ * than by column, and every stripe is coded whole by one thread.  Tasks
+ * are groups of stripes, few enough that handing them out stays cheap and
+ * enough of them that the threads finish together.
+ */
+#define GIB_CPU_BATCH_TASKS_PER_THREAD 8
+
+struct gib_cpu_batch {
+  gib_context c;
+  const struct gib_xor_sched *xs;
+  const struct gib_jit_code *jc;
+  struct gib_stripe *stripes;
+  int count, per_task;
+};
+
+static void gib_cpu_generate_stripe ( gib_context c,
+				      const struct gib_xor_sched *xs,
+				      const struct gib_jit_code *jc,
+				      struct gib_stripe *s ) {
+  unsigned char *c_buf = (unsigned char *)s->buffers;
+  unsigned char *src[256], *dst[256];
+  struct gib_cpu_plan p;
+  int i;
+  for (i = 0; i < c->n; i++)
+    src[i] = c_buf + i*s->buf_size;
+  for (i = 0; i < c->m; i++)
+    dst[i] = c_buf + (c->n+i)*s->buf_size;
+  gib_cpu_plan_for(c, s->buf_size, &p);
+  GIB_TRACE_BEGIN(code, s->buf_size);
+  gib_cpu_code_range(&p, c->F, xs, jc, c->n, src, c->m, dst, 0, s->buf_size,
+		     NULL);
+  GIB_TRACE_END(code, s->buf_size);
+  gib_cpu_count_pass(c, p.kernel, xs, jc);
+}
+
+static void gib_cpu_batch_task ( void *arg, int task ) {
+  struct gib_cpu_batch *b = (struct gib_cpu_batch *)arg;
+  int i = task*b->per_task;
+  int end = (i + b->per_task < b->count) ? i + b->per_task : b->count;
+  GIB_TRACE_BEGIN(task, task);
+  for (; i < end; i++)
+    gib_cpu_generate_stripe(b->c, b->xs, b->jc, &b->stripes[i]);
+  GIB_TRACE_END(task, task);
+}
+
+int gib_cpu_generate_batch ( struct gib_stripe *stripes, int count,
+			     gib_context c ) {
+  struct gib_cpu_batch b;
+  struct gib_xor_sched *xs = NULL;
+  unsigned long start;
+  int i, ntasks, rc;
+  if (c->pool == NULL || count < c->nthreads) {
+    /* Too few stripes to go around; let each one split itself. */
+    for (i = 0; i < count; i++)
+      if ((rc = gib_cpu_generate_nc(stripes[i].buffers, stripes[i].buf_size,
+				    stripes[i].buf_size, c)))
+	return rc;
+    return GIB_SUC;
+  }
+  for (i = 0; i < count; i++)
+    if ((rc = gib_cpu_xor_get(c, c->F, c->n, c->m, stripes[i].buf_size,
+			      &xs)))
+      return rc;
+  /* The encoding schedule and routine live as long as the context. */
+  b.xs = xs;
+  b.jc = gib_cpu_jit_get(c, c->F, c->n, c->m);
+  ntasks = c->nthreads*GIB_CPU_BATCH_TASKS_PER_THREAD;
+  if (ntasks > count)
+    ntasks = count;
+  b.c = c;
+  b.stripes = stripes;
+  b.count = count;
+  b.per_task = (count + ntasks - 1) / ntasks;
+  ntasks = (count + b.per_task - 1) / b.per_task;
+  start = (c->stats != NULL) ? gib_stats_ns() : 0;
+  gib_pool_run(c->pool, gib_numa_node_of(stripes[0].buffers), ntasks,
+	       gib_cpu_batch_task, &b);
+  if (c->stats != NULL) {
+    gib_stats_add(c, GIB_STAT_KERNEL_NS, gib_stats_ns() - start);
+    gib_stats_add(c, GIB_STAT_MT_PASSES, 1);
+    gib_stats_add(c, GIB_STAT_MT_TASKS, ntasks);
+  }
+  return GIB_SUC;
+}
+
+/* The coding loops already work on arrays of buffer pointers, so the
+ * scatter/gather calls hand theirs straight over.
+ */
+int gib_cpu_generate_iov ( void **data, void **parity, int buf_size,
+			   gib_context c ) {
+  return gib_cpu_code(c, c->F, c->n, (unsigned char **)data, c->m,
+		      (unsigned char **)parity, buf_size, NULL);
+}
+
+int gib_cpu_recover_iov ( void **bufs, int buf_size, int *buf_ids,
+			  int recover_last, gib_context c ) {
+  unsigned char *rows = (unsigned char *)malloc(recover_last*c->n);
+  int rc;
+  if (rows == NULL)
+    return GIB_OOM;
+  if ((rc = gib_cpu_recovery_rows(c, buf_ids, recover_last, rows)) == 0)
+    rc = gib_cpu_code(c, rows, c->n, (unsigned char **)bufs, recover_last,
+		      (unsigned char **)bufs + c->n, buf_size, NULL);
+  free(rows);
+  return rc;
+}
+
+/* The XOR engine cannot scale a range in place, so the change to the data
+ * is coded straight into the parity with an accumulating schedule.
+ */
+static int gib_cpu_update_xor ( unsigned char *c_buf, int buf_size,
+				int index, int offset, int len,
+				unsigned char *old_data,
+				unsigned char *new_data, gib_context c ) {
+  unsigned char rows[256*2], *src[2], *dst[256];
+  struct gib_xor_sched *xs;
+  int j, off, rc, nsrc = (new_data == NULL) ? 1 : 2;
+  if (offset % GIB_XOR_BLOCK != 0) {
+    fprintf(stderr, "The XOR engine needs offsets that are a multiple of "
+	    "%i bytes.\n", GIB_XOR_BLOCK);
+    return GIB_ERR;
+  }
+  for (j = 0; j < c->m; j++) {
+    rows[j*nsrc] = rows[j*nsrc+nsrc-1] = c->F[j*c->n+index];
+    dst[j] = c_buf + (c->n+j)*buf_size;
+  }
+  if ((rc = gib_cpu_xor_get(c, rows, nsrc, c->m, len, &xs)))
+    return rc;
+  src[0] = old_data - offset;
+  if (new_data != NULL)
+    src[1] = new_data - offset;
+  for (off = offset; off < offset + len; off += c->tile_size) {
+    int tile = (offset + len - off < c->tile_size) ?
+      offset + len - off : c->tile_size;
+    gib_xor_run(xs, tile, off, src, dst, 1);
+  }
+  gib_xor_release(c->bitmatrix, xs);
+  return GIB_SUC;
+}
+
+/* Parity j changes by F[j][index] times the change in the data, so each
+ * parity range is rewritten as parity + F[j][index]*(old + new).  When
+ * new_data is NULL, old_data already holds the delta.
+ */
+int gib_cpu_update ( void *buffers, int buf_size, int index, int offset,
+		     int len, void *old_data, void *new_data, gib_context c ) {
+  unsigned char *c_buf = (unsigned char *)buffers;
+  unsigned char *src[3], coefs[3];
+  unsigned long start;
+  int j, off, rc, nsrc = (new_data == NULL) ? 2 : 3;
+  int n = c->n;
+  
+  if (index < 0 || index >= n || offset < 0 || offset + len > buf_size) {
+    fprintf(stderr, "Invalid range for a parity update.\n");
+    return GIB_ERR;
+  }
+  start = (c->stats != NULL) ? gib_stats_ns() : 0;
+  if (c->bitmatrix != NULL) {
+    rc = gib_cpu_update_xor(c_buf, buf_size, index, offset, len,
+			    (unsigned char *)old_data,
+			    (unsigned char *)new_data, c);
+    if (rc == GIB_SUC && c->stats != NULL) {
+      gib_stats_add(c, GIB_STAT_KERNEL_NS, gib_stats_ns() - start);
+      gib_stats_add(c, GIB_STAT_PASSES, 1);
+      gib_stats_add(c, GIB_STAT_VARIANT + GIB_STAT_VARIANT_XOR, 1);
     }
-    for (j = 0; j < m; ++j) {
-      for (i = 0; i < n; ++i) {
-	c_buf[(n+j)*buf_size+b] ^= 
-	  gib_gf_table[c->F[j*n+i]][c_buf[i*buf_size+b]];
-      }
+    return rc;
+  }
+  /* The kernel indexes every source from offset. */
+  src[1] = (unsigned char *)old_data - offset;
+  if (new_data != NULL)
+    src[2] = (unsigned char *)new_data - offset;
+  for (j = 0; j < c->m; j++) {
+    unsigned char *parity = c_buf + (n+j)*buf_size;
+    coefs[0] = 1;
+    coefs[1] = coefs[2] = c->F[j*n+index];
+    src[0] = parity;
+    for (off = offset; off < offset + len; off += c->tile_size) {
+      int tile = (offset + len - off < c->tile_size) ? 
+	offset + len - off : c->tile_size;
+      c->kernel->dot_prod(tile, off, nsrc, coefs, src, parity);
     }
   }
-  return 0;
+  if (c->stats != NULL) {
+    gib_stats_add(c, GIB_STAT_KERNEL_NS, gib_stats_ns() - start);
+    gib_cpu_count_pass(c, c->kernel, NULL, NULL);
+  }
+  return GIB_SUC;
 }
 
 int gib_cpu_recover ( void *buffers, int buf_size, int *buf_ids, 
 		      int recover_last, gib_context c ) {
-  return gib_recover_nc(buffers, buf_size, buf_size, buf_ids, recover_last, 
-			c);
+  return gib_cpu_recover_nc(buffers, buf_size, buf_size, buf_ids,
+			    recover_last, c);
+}
+
+/* With a Cauchy F, only the lost data columns of the surviving parity rows
+ * need inverting, and that has a closed form.  With e lost data buffers,
+ * building the rows takes O(e^2 n) rather than the O(n^3) of elimination.
+ */
+static int gib_cpu_cauchy_rows ( gib_context c, int *buf_ids,
+				 int recover_last, unsigned char *rows ) {
+  int n = c->n, m = c->m;
+  int pos[256], lost[256], par[256], lidx[256];
+  int i, j, l, q, t, e = 0, np = 0;
+  unsigned char *minv = NULL, *drow;
+  for (i = 0; i < n+m; i++)
+    pos[i] = -1;
+  for (i = 0; i < n; i++) {
+    pos[buf_ids[i]] = i;
+    if (buf_ids[i] >= n)
+      par[np++] = buf_ids[i] - n;
+  }
+  for (j = 0; j < n; j++)
+    if (pos[j] < 0) {
+      lidx[j] = e;
+      lost[e++] = j;
+    }
+  if (e != np) {
+    fprintf(stderr, "The surviving buffers cannot rebuild the rest.\n");
+    return GIB_ERR;
+  }
+  /* On the heap, as coding may run on threads with small stacks */
+  if (e > 0) {
+    if ((minv = (unsigned char *)malloc(e*e + e*n)) == NULL)
+      return GIB_OOM;
+    if (gib_galois_cauchy_inverse(c->F, m, n, par, lost, e, minv)) {
+      fprintf(stderr, "The surviving buffers cannot rebuild the rest.\n");
+      free(minv);
+      return GIB_ERR;
+    }
+  }
+  /* Surviving parity q gives sum over lost j of F[q][j] D_j = P_q + the
+   * sum over surviving s of F[q][s] D_s.  drow[l] solves for lost[l].
+   */
+  drow = minv + e*e;
+  for (l = 0; l < e; l++) {
+    memset(drow + l*n, 0, n);
+    for (q = 0; q < e; q++) {
+      unsigned char coef = minv[l*e+q];
+      const unsigned char *f = gib_gf_table[coef];
+      drow[l*n + pos[n+par[q]]] = coef;
+      for (j = 0; j < n; j++)
+	if (pos[j] >= 0)
+	  drow[l*n + pos[j]] ^= f[c->F[par[q]*n+j]];
+    }
+  }
+  for (i = 0; i < recover_last; i++) {
+    unsigned char *row = rows + i*n;
+    t = buf_ids[n+i];
+    memset(row, 0, n);
+    if (pos[t] >= 0) {
+      row[pos[t]] = 1;
+    } else if (t < n) {
+      memcpy(row, drow + lidx[t]*n, n);
+    } else {
+      /* Lost parity is F times the data, rebuilt or not. */
+      const unsigned char *f = c->F + (t-n)*n;
+      for (j = 0; j < n; j++)
+	if (pos[j] >= 0)
+	  row[pos[j]] ^= f[j];
+	else
+	  for (l = 0; l < n; l++)
+	    row[l] ^= gib_gf_table[f[j]][drow[lidx[j]*n+l]];
+    }
+  }
+  free(minv);
+  return GIB_SUC;
+}
+
+void gib_cpu_survivor_matrix ( gib_context c, const int *buf_ids,
+			       unsigned char *modA ) {
+  int i, j, n = c->n;
+  /* Modify the matrix to have the failed drives reflected.  A is the
+   * identity above F, so its rows come straight from the context.
+   */
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < n; j++) {
+      if (buf_ids[i] < n)
+	modA[i*n+j] = (buf_ids[i] == j) ? 1 : 0;
+      else
+	modA[i*n+j] = c->F[(buf_ids[i]-n)*n+j];
+    }
+  }
+}
+
+void gib_cpu_rows_from_inverse ( gib_context c, const int *buf_ids,
+				 int recover_last, const unsigned char *inv,
+				 unsigned char *rows ) {
+  int i, j, n = c->n;
+  /* Row t of A times inv rebuilds buffer t from the survivors.  For data
+   * that is row t of inv; for parity it is the row of F times inv, so data
+   * and parity are rebuilt in the same pass.
+   */
+  for (i = 0; i < recover_last; i++) {
+    int t = buf_ids[n+i];
+    if (t < n) {
+      for (j = 0; j < n; j++)
+	rows[i*n+j] = inv[t*n+j];
+    } else {
+      const unsigned char *f = c->F + (t-n)*n;
+      int k;
+      for (j = 0; j < n; j++) {
+	unsigned char acc = 0;
+	for (k = 0; k < n; k++)
+	  acc ^= gib_gf_table[f[k]][inv[k*n+j]];
+	rows[i*n+j] = acc;
+      }
+    }
+  }
+}
+
+int gib_cpu_recovery_rows ( gib_context c, int *buf_ids, int recover_last,
+			    unsigned char *rows ) {
+  int rc = GIB_SUC;
+  int n = c->n;
+  unsigned long start = (c->stats != NULL) ? gib_stats_ns() : 0;
+  unsigned char *modA, *inv;
+  
+  GIB_TRACE_BEGIN(rows, recover_last);
+  if (c->dcache != NULL && gib_dc_get(c->dcache, buf_ids, n+recover_last,
+				      rows)) {
+    gib_stats_add(c, GIB_STAT_DC_HITS, 1);
+    if (c->stats != NULL)
+      gib_stats_add(c, GIB_STAT_SETUP_NS, gib_stats_ns() - start);
+    GIB_TRACE_END(rows, recover_last);
+    return GIB_SUC;
+  }
+  if (c->dcache != NULL)
+    gib_stats_add(c, GIB_STAT_DC_MISSES, 1);
+  
+  if (c->cauchy) {
+    GIB_TRACE_BEGIN(cauchy, n);
+    rc = gib_cpu_cauchy_rows(c, buf_ids, recover_last, rows);
+    GIB_TRACE_END(cauchy, n);
+  } else if ((modA = (unsigned char *)malloc(2*n*n)) == NULL) {
+    rc = GIB_OOM;
+  } else {
+    /* On the heap, as coding may run on threads with small stacks */
+    inv = modA + n*n;
+    GIB_TRACE_BEGIN(build, n);
+    gib_cpu_survivor_matrix(c, buf_ids, modA);
+    GIB_TRACE_END(build, n);
+    GIB_TRACE_BEGIN(invert, n);
+    gib_galois_gaussian_elim(modA, inv, n, n);
+    gib_cpu_rows_from_inverse(c, buf_ids, recover_last, inv, rows);
+    GIB_TRACE_END(invert, n);
+    free(modA);
+  }
+  
+  if (rc == GIB_SUC && c->dcache != NULL)
+    gib_dc_put(c->dcache, buf_ids, n+recover_last, rows);
+  if (c->stats != NULL)
+    gib_stats_add(c, GIB_STAT_SETUP_NS, gib_stats_ns() - start);
+  GIB_TRACE_END(rows, recover_last);
+  return rc;
 }
 
 int gib_cpu_recover_nc ( void *buffers, int buf_size, int work_size, 
@@ -102,48 +803,120 @@ int gib_cpu_recover_nc ( void *buffers, int buf_size, int work_size,
   /* This is a noncontiguous implementation, which may be added to Gibraltar
    * eventually.
    */
-  int i, j;
+  int i, rc;
   
   unsigned char *c_buf = (unsigned char *)buffers;
   int n = c->n;
-  int m = c->m;
-  unsigned char A[128*128], inv[128*128], modA[128*128];
+  unsigned char *rows = (unsigned char *)malloc(recover_last*n);
+  unsigned char *src[256], *dst[256];
   
-  for (i = n; i < n+recover_last; i++) {
-    if (buf_ids[i] >= n) {
-      /* Recovering a parity buffer is not a valid operation. */
-      fprintf(stderr, "Attempting to recover a parity buffer, aborting.\n");
+  if (rows == NULL)
+    return GIB_OOM;
+  if ((rc = gib_cpu_recovery_rows(c, buf_ids, recover_last, rows)) == 0) {
+    for (i = 0; i < n; i++)
+      src[i] = c_buf + i*buf_size;
+    for (i = 0; i < recover_last; i++)
+      dst[i] = c_buf + (n+i)*buf_size;
+    rc = gib_cpu_code(c, rows, n, src, recover_last, dst, work_size, NULL);
+  }
+  free(rows);
+  return rc;
+}
+
+int gib_cpu_recover_crc ( void *buffers, int buf_size, int *buf_ids,
+			  int recover_last, unsigned int *crcs, gib_context c ) {
+  unsigned char *c_buf = (unsigned char *)buffers;
+  unsigned char *rows = (unsigned char *)malloc(recover_last*c->n);
+  unsigned char *src[256], *dst[256];
+  int i, rc, n = c->n;
+  if (rows == NULL)
+    return GIB_OOM;
+  if ((rc = gib_cpu_recovery_rows(c, buf_ids, recover_last, rows)) == 0) {
+    for (i = 0; i < n; i++)
+      src[i] = c_buf + i*buf_size;
+    for (i = 0; i < recover_last; i++)
+      dst[i] = c_buf + (n+i)*buf_size;
+    rc = gib_cpu_code(c, rows, n, src, recover_last, dst, buf_size, crcs);
+  }
+  free(rows);
+  return rc;
+}
+
+int gib_cpu_regenerate ( void *buffers, int buf_size, int *parity_ids,
+			 int count, gib_context c ) {
+  unsigned char *c_buf = (unsigned char *)buffers;
+  unsigned char *rows;
+  unsigned char *src[256], *dst[256];
+  int i, rc, n = c->n;
+  for (i = 0; i < count; i++)
+    if (parity_ids[i] < n || parity_ids[i] >= n + c->m) {
+      fprintf(stderr, "Buffer %i is not a parity buffer.\n", parity_ids[i]);
       return GIB_ERR;
     }
+  if ((rows = (unsigned char *)malloc(count*n)) == NULL)
+    return GIB_OOM;
+  for (i = 0; i < count; i++) {
+    memcpy(rows + i*n, c->F + (parity_ids[i]-n)*n, n);
+    dst[i] = c_buf + parity_ids[i]*buf_size;
   }
+  for (i = 0; i < n; i++)
+    src[i] = c_buf + i*buf_size;
+  rc = gib_cpu_code(c, rows, n, src, count, dst, buf_size, NULL);
+  free(rows);
+  return rc;
+}
+
+int gib_cpu_recover_sparse ( void *buffers, int buf_size, char *failed_bufs,
+			     gib_context c ) {
+  return gib_cpu_recover_sparse_nc(buffers, buf_size, buf_size, failed_bufs,
+				   c);
+}
+
+int gib_cpu_sparse_ids ( char *failed_bufs, int *buf_ids, int *recover_last,
+			 gib_context c ) {
+  int n = c->n;
+  int m = c->m;
+  int i, nsurvivors = 0;
   
-  gib_galois_gen_A(A, m+n, n);
-  
-  /* Modify the matrix to have the failed drives reflected */
-  for (i = 0; i < n; i++) {
-    for (j = 0; j < n; j++) {
-      modA[i*n+j] = A[buf_ids[i]*n+j];
-    }
+  for (i = 0; i < n+m && nsurvivors < n; i++)
+    if (!failed_bufs[i])
+      buf_ids[nsurvivors++] = i;
+  if (nsurvivors < n) {
+    fprintf(stderr, "Too many failed buffers to recover.\n");
+    return GIB_ERR;
   }
+  *recover_last = 0;
+  for (i = 0; i < n+m; i++)
+    if (failed_bufs[i])
+      buf_ids[n + (*recover_last)++] = i;
+  return GIB_SUC;
+}
+
+/* Rebuilds the failed buffers in place, reading the survivors where they
+ * are.
+ */
+int gib_cpu_recover_sparse_nc ( void *buffers, int buf_size, int work_size,
+				char *failed_bufs, gib_context c ) {
+  unsigned char *c_buf = (unsigned char *)buffers;
+  int n = c->n;
+  int buf_ids[256];
+  unsigned char *rows;
+  unsigned char *src[256], *dst[256];
+  int i, rc, recover_last;
   
-  gib_galois_gaussian_elim(modA, inv, n, n);
-  
-  /* Copy row buf_ids[i] into row i */
-  for (i = n; i < n+recover_last; i++)
-    for (j = 0; j < n; j++)
-      modA[i*n+j] = inv[buf_ids[i]*n+j];
-  
-  int b, tmp;
-  for (b = 0; b < work_size; b++) {
-    for (tmp = n; tmp < recover_last + n; ++tmp) {
-      c_buf[tmp*buf_size+b] = 0;
-    }
-    for (j = n; j < n+recover_last; ++j) {
-      for (i = 0; i < n; ++i) {
-	c_buf[j*buf_size+b] ^= 
-	  gib_gf_table[modA[j*n+i]][c_buf[i*buf_size+b]];
-      }
-    }
+  if ((rc = gib_cpu_sparse_ids(failed_bufs, buf_ids, &recover_last, c)))
+    return rc;
+  if (recover_last == 0)
+    return GIB_SUC;
+  if ((rows = (unsigned char *)malloc(recover_last*n)) == NULL)
+    return GIB_OOM;
+  if ((rc = gib_cpu_recovery_rows(c, buf_ids, recover_last, rows)) == 0) {
+    for (i = 0; i < n; i++)
+      src[i] = c_buf + buf_ids[i]*buf_size;
+    for (i = 0; i < recover_last; i++)
+      dst[i] = c_buf + buf_ids[n+i]*buf_size;
+    rc = gib_cpu_code(c, rows, n, src, recover_last, dst, work_size, NULL);
   }
-  return 0;
+  free(rows);
+  return rc;
 }
@@ -0,0 +1,183 @@
+/* Region multiply-accumulate kernels for the CPU implementation.  The vector
+ * versions use the split-nibble technique:  a product c*x is looked up as
+ * c*(x & 0xf) ^ c*(x & 0xf0), each half with a 16-entry byte shuffle from
+ * gib_gf_nib_table.  Every kernel produces the same bytes as the table lookup
+ * loop, so the choice only affects speed.
+ */
+
+#include "../inc/gib_galois.h"
+#include "../inc/gib_cpu_funcs.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define GIB_HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+static void gib_dot_prod_scalar ( int len, int offset, int nsrc,
+				  const unsigned char *coefs,
+				  unsigned char **src, unsigned char *dest ) {
+  int i, b;
+  for (b = offset; b < offset + len; b++) {
+    unsigned char acc = 0;
+    for (i = 0; i < nsrc; i++)
+      acc ^= gib_gf_table[coefs[i]][src[i][b]];
+    dest[b] = acc;
+  }
+}
+
+static int gib_scalar_supported ( void ) {
+  return 1;
+}
+
+#if GIB_HAVE_X86
+__attribute__((target("ssse3")))
+static void gib_dot_prod_ssse3 ( int len, int offset, int nsrc,
+				 const unsigned char *coefs,
+				 unsigned char **src, unsigned char *dest ) {
+  const __m128i mask = _mm_set1_epi8(0x0f);
+  int i, b, end = offset + len;
+  for (b = offset; b + 16 <= end; b += 16) {
+    __m128i acc = _mm_setzero_si128();
+    for (i = 0; i < nsrc; i++) {
+      __m128i x = _mm_loadu_si128((const __m128i *)(src[i] + b));
+      if (coefs[i] == 1) {
+	acc = _mm_xor_si128(acc, x);
+      } else if (coefs[i] != 0) {
+	const unsigned char *t = gib_gf_nib_table[coefs[i]];
+	__m128i lo = _mm_loadu_si128((const __m128i *)t);
+	__m128i hi = _mm_loadu_si128((const __m128i *)(t + 16));
+	lo = _mm_shuffle_epi8(lo, _mm_and_si128(x, mask));
+	hi = _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(x, 4), mask));
+	acc = _mm_xor_si128(acc, _mm_xor_si128(lo, hi));
+      }
+    }
+    _mm_storeu_si128((__m128i *)(dest + b), acc);
+  }
+  if (b < end)
+    gib_dot_prod_scalar(end - b, b, nsrc, coefs, src, dest);
+}
+
+__attribute__((target("avx2")))
+static void gib_dot_prod_avx2 ( int len, int offset, int nsrc,
+				const unsigned char *coefs,
+				unsigned char **src, unsigned char *dest ) {
+  const __m256i mask = _mm256_set1_epi8(0x0f);
+  int i, b, end = offset + len;
+  /* Two vectors per pass, so each table is loaded once per 64 bytes. */
+  for (b = offset; b + 64 <= end; b += 64) {
+    __m256i acc0 = _mm256_setzero_si256();
+    __m256i acc1 = _mm256_setzero_si256();
+    for (i = 0; i < nsrc; i++) {
+      __m256i x0 = _mm256_loadu_si256((const __m256i *)(src[i] + b));
+      __m256i x1 = _mm256_loadu_si256((const __m256i *)(src[i] + b + 32));
+      if (coefs[i] == 1) {
+	acc0 = _mm256_xor_si256(acc0, x0);
+	acc1 = _mm256_xor_si256(acc1, x1);
+      } else if (coefs[i] != 0) {
+	const unsigned char *t = gib_gf_nib_table[coefs[i]];
+	__m256i lo = _mm256_broadcastsi128_si256(
+	  _mm_loadu_si128((const __m128i *)t));
+	__m256i hi = _mm256_broadcastsi128_si256(
+	  _mm_loadu_si128((const __m128i *)(t + 16)));
+	acc0 = _mm256_xor_si256(acc0, _mm256_xor_si256(
+	  _mm256_shuffle_epi8(lo, _mm256_and_si256(x0, mask)),
+	  _mm256_shuffle_epi8(hi, _mm256_and_si256(
+	    _mm256_srli_epi64(x0, 4), mask))));
+	acc1 = _mm256_xor_si256(acc1, _mm256_xor_si256(
+	  _mm256_shuffle_epi8(lo, _mm256_and_si256(x1, mask)),
+	  _mm256_shuffle_epi8(hi, _mm256_and_si256(
+	    _mm256_srli_epi64(x1, 4), mask))));
+      }
+    }
+    _mm256_storeu_si256((__m256i *)(dest + b), acc0);
+    _mm256_storeu_si256((__m256i *)(dest + b + 32), acc1);
+  }
+  if (b < end)
+    gib_dot_prod_ssse3(end - b, b, nsrc, coefs, src, dest);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void gib_dot_prod_avx512 ( int len, int offset, int nsrc,
+				  const unsigned char *coefs,
+				  unsigned char **src, unsigned char *dest ) {
+  const __m512i mask = _mm512_set1_epi8(0x0f);
+  int i, b, end = offset + len;
+  for (b = offset; b + 128 <= end; b += 128) {
+    __m512i acc0 = _mm512_setzero_si512();
+    __m512i acc1 = _mm512_setzero_si512();
+    for (i = 0; i < nsrc; i++) {
+      __m512i x0 = _mm512_loadu_si512((const void *)(src[i] + b));
+      __m512i x1 = _mm512_loadu_si512((const void *)(src[i] + b + 64));
+      if (coefs[i] == 1) {
+	acc0 = _mm512_xor_si512(acc0, x0);
+	acc1 = _mm512_xor_si512(acc1, x1);
+      } else if (coefs[i] != 0) {
+	const unsigned char *t = gib_gf_nib_table[coefs[i]];
+	__m512i lo = _mm512_broadcast_i32x4(
+	  _mm_loadu_si128((const __m128i *)t));
+	__m512i hi = _mm512_broadcast_i32x4(
+	  _mm_loadu_si128((const __m128i *)(t + 16)));
+	acc0 = _mm512_xor_si512(acc0, _mm512_xor_si512(
+	  _mm512_shuffle_epi8(lo, _mm512_and_si512(x0, mask)),
+	  _mm512_shuffle_epi8(hi, _mm512_and_si512(
+	    _mm512_srli_epi64(x0, 4), mask))));
+	acc1 = _mm512_xor_si512(acc1, _mm512_xor_si512(
+	  _mm512_shuffle_epi8(lo, _mm512_and_si512(x1, mask)),
+	  _mm512_shuffle_epi8(hi, _mm512_and_si512(
+	    _mm512_srli_epi64(x1, 4), mask))));
+      }
+    }
+    _mm512_storeu_si512((void *)(dest + b), acc0);
+    _mm512_storeu_si512((void *)(dest + b + 64), acc1);
+  }
+  if (b < end)
+    gib_dot_prod_avx2(end - b, b, nsrc, coefs, src, dest);
+}
+
+static int gib_ssse3_supported ( void ) {
+  return __builtin_cpu_supports("ssse3");
+}
+
+static int gib_avx2_supported ( void ) {
+  return __builtin_cpu_supports("avx2");
+}
+
+static int gib_avx512_supported ( void ) {
+  return __builtin_cpu_supports("avx512f") &&
+    __builtin_cpu_supports("avx512bw");
+}
+#endif
+
+const struct gib_cpu_kernel gib_cpu_kernels[] = {
+#if GIB_HAVE_X86
+  { "avx512", gib_avx512_supported, gib_dot_prod_avx512,
+    gib_cpu_code_avx512 },
+  { "avx2", gib_avx2_supported, gib_dot_prod_avx2, gib_cpu_code_avx2 },
+  { "ssse3", gib_ssse3_supported, gib_dot_prod_ssse3, NULL },
+#endif
+  { "scalar", gib_scalar_supported, gib_dot_prod_scalar, NULL },
+  { NULL, NULL, NULL, NULL }
+};
+
+/* Picks the fastest kernel the processor supports.  GIB_CPU_KERNEL may name a
+ * kernel to use instead, which is mostly useful for comparing them.
+ */
+const struct gib_cpu_kernel *gib_cpu_kernel_select ( void ) {
+  const struct gib_cpu_kernel *k;
+  char *name = getenv("GIB_CPU_KERNEL");
+
+#if GIB_HAVE_X86
+  __builtin_cpu_init();
+#endif
+  if (name != NULL) {
+    for (k = gib_cpu_kernels; k->name != NULL; k++)
+      if (strcmp(k->name, name) == 0 && k->supported())
+	return k;
+  }
+  for (k = gib_cpu_kernels; k->name != NULL; k++)
+    if (k->supported())
+      return k;
+  return NULL; /* Not reached; the scalar kernel is always supported. */
+}
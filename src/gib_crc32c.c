@@ -0,0 +1,162 @@
+/* CRC32C (Castagnoli, reflected polynomial 0x82f63b78).  The SSE4.2 crc32
+ * instruction is used when the processor has it, and a slicing-by-8 table
+ * lookup otherwise.  Either way the results are the same.
+ */
+
+#include "../inc/gib_crc32c.h"
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#define GIB_HAVE_CRC32_INSN 1
+#include <immintrin.h>
+#endif
+
+#define GIB_CRC32C_POLY 0x82f63b78u
+
+static unsigned int gib_crc32c_table[8][256];
+static unsigned int gib_crc32c_x2n[32]; /* x^(2^k) mod the polynomial */
+#if GIB_HAVE_CRC32_INSN
+static int gib_crc32c_hw;
+#endif
+static pthread_once_t gib_crc32c_once = PTHREAD_ONCE_INIT;
+
+static unsigned int gib_crc32c_mulmod ( unsigned int a, unsigned int b );
+
+static void gib_crc32c_init ( void ) {
+  unsigned int i, j, crc;
+  for (i = 0; i < 256; i++) {
+    crc = i;
+    for (j = 0; j < 8; j++)
+      crc = (crc & 1) ? (crc >> 1) ^ GIB_CRC32C_POLY : crc >> 1;
+    gib_crc32c_table[0][i] = crc;
+  }
+  for (i = 0; i < 256; i++)
+    for (j = 1; j < 8; j++)
+      gib_crc32c_table[j][i] = (gib_crc32c_table[j-1][i] >> 8) ^
+	gib_crc32c_table[0][gib_crc32c_table[j-1][i] & 0xff];
+  gib_crc32c_x2n[0] = 1u << 30; /* x^1 */
+  for (i = 1; i < 32; i++)
+    gib_crc32c_x2n[i] = gib_crc32c_mulmod(gib_crc32c_x2n[i-1],
+					  gib_crc32c_x2n[i-1]);
+#if GIB_HAVE_CRC32_INSN
+  gib_crc32c_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+/* The raw routines work on the inverted running value. */
+static unsigned int gib_crc32c_sw ( unsigned int crc, const unsigned char *p,
+				    size_t len ) {
+  unsigned int (*t)[256] = gib_crc32c_table;
+  while (len >= 8) {
+    crc ^= p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+    crc = t[7][crc & 0xff] ^ t[6][(crc >> 8) & 0xff] ^
+      t[5][(crc >> 16) & 0xff] ^ t[4][crc >> 24] ^
+      t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+    p += 8;
+    len -= 8;
+  }
+  while (len-- > 0)
+    crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+  return crc;
+}
+
+#if GIB_HAVE_CRC32_INSN
+__attribute__((target("sse4.2")))
+static unsigned int gib_crc32c_sse42 ( unsigned int crc,
+				       const unsigned char *p, size_t len ) {
+  uint64_t c = crc, w;
+  while (len >= 8) {
+    memcpy(&w, p, 8);
+    c = _mm_crc32_u64(c, w);
+    p += 8;
+    len -= 8;
+  }
+  while (len-- > 0)
+    c = _mm_crc32_u8((unsigned int)c, *p++);
+  return (unsigned int)c;
+}
+
+/* Three independent streams keep the crc32 unit busy; one stream waits out
+ * the instruction's latency on every word.
+ */
+__attribute__((target("sse4.2")))
+static void gib_crc32c_multi_sse42 ( unsigned int *crcs, unsigned char **bufs,
+				     int count, size_t offset, size_t len ) {
+  int i;
+  for (i = 0; i + 3 <= count; i += 3) {
+    const unsigned char *p0 = bufs[i] + offset;
+    const unsigned char *p1 = bufs[i+1] + offset;
+    const unsigned char *p2 = bufs[i+2] + offset;
+    uint64_t c0 = ~crcs[i], c1 = ~crcs[i+1], c2 = ~crcs[i+2];
+    uint64_t w0, w1, w2;
+    size_t k;
+    for (k = 0; k + 8 <= len; k += 8) {
+      memcpy(&w0, p0 + k, 8);
+      memcpy(&w1, p1 + k, 8);
+      memcpy(&w2, p2 + k, 8);
+      c0 = _mm_crc32_u64(c0, w0);
+      c1 = _mm_crc32_u64(c1, w1);
+      c2 = _mm_crc32_u64(c2, w2);
+    }
+    crcs[i] = ~gib_crc32c_sse42((unsigned int)c0, p0 + k, len - k);
+    crcs[i+1] = ~gib_crc32c_sse42((unsigned int)c1, p1 + k, len - k);
+    crcs[i+2] = ~gib_crc32c_sse42((unsigned int)c2, p2 + k, len - k);
+  }
+  for (; i < count; i++)
+    crcs[i] = ~gib_crc32c_sse42(~crcs[i], bufs[i] + offset, len);
+}
+#endif
+
+unsigned int gib_crc32c ( unsigned int crc, const void *buf, size_t len ) {
+  pthread_once(&gib_crc32c_once, gib_crc32c_init);
+#if GIB_HAVE_CRC32_INSN
+  if (gib_crc32c_hw)
+    return ~gib_crc32c_sse42(~crc, (const unsigned char *)buf, len);
+#endif
+  return ~gib_crc32c_sw(~crc, (const unsigned char *)buf, len);
+}
+
+void gib_crc32c_multi ( unsigned int *crcs, unsigned char **bufs, int count,
+			size_t offset, size_t len ) {
+  int i;
+  pthread_once(&gib_crc32c_once, gib_crc32c_init);
+#if GIB_HAVE_CRC32_INSN
+  if (gib_crc32c_hw) {
+    gib_crc32c_multi_sse42(crcs, bufs, count, offset, len);
+    return;
+  }
+#endif
+  for (i = 0; i < count; i++)
+    crcs[i] = ~gib_crc32c_sw(~crcs[i], bufs[i] + offset, len);
+}
+
+/* Combining follows zlib:  appending len_b zero bytes to A multiplies its
+ * CRC by x^(8*len_b) modulo the polynomial, and that power is assembled from
+ * the table of x^(2^k).
+ */
+static unsigned int gib_crc32c_mulmod ( unsigned int a, unsigned int b ) {
+  unsigned int mask = 1u << 31, p = 0;
+  for (;;) {
+    if (a & mask) {
+      p ^= b;
+      if ((a & (mask - 1)) == 0)
+	break;
+    }
+    mask >>= 1;
+    b = (b & 1) ? (b >> 1) ^ GIB_CRC32C_POLY : b >> 1;
+  }
+  return p;
+}
+
+unsigned int gib_crc32c_combine ( unsigned int crc_a, unsigned int crc_b,
+				  size_t len_b ) {
+  unsigned int p = 1u << 31; /* x^0 */
+  int k = 3;                 /* len_b counts bytes, so start at x^8 */
+  pthread_once(&gib_crc32c_once, gib_crc32c_init);
+  for (; len_b != 0; len_b >>= 1, k++)
+    if (len_b & 1)
+      p = gib_crc32c_mulmod(gib_crc32c_x2n[k & 31], p);
+  return gib_crc32c_mulmod(p, crc_a) ^ crc_b;
+}
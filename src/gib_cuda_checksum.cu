@@ -9,7 +9,12 @@ typedef unsigned char byte;
 __device__ unsigned char gf_log_d[256];
 __device__ unsigned char gf_ilog_d[256];
 __constant__ byte F_d[M*N];
+/* Rows used by the recovery kernels, so F_d never has to be reloaded */
+__constant__ byte R_d[M*N];
 __constant__ byte inv_d[N*N];
+/* Buffer positions used by the sparse recovery kernel */
+__constant__ int src_ids_d[N];
+__constant__ int dst_ids_d[M];
 
 /* The "fetch" datatype is the unit for performing data copies between areas of
  * memory on the GPU.  While today's wisdom says that 32-bit types are optimal
@@ -79,7 +84,7 @@ __global__ void gib_recover_d(shmem_bytes *bufs, int buf_size,
 	 the 260+.
       */
       //if (F_d[j*N+i] != 0) {
-      int F_tmp = sh_log[F_d[j*N+i]]; /* No load conflicts */
+      int F_tmp = sh_log[R_d[j*N+i]]; /* No load conflicts */
       for (int b = 0; b < SOF; ++b) {
 	if (in.b[b] != 0) {
 	  int sum_log = F_tmp + sh_log[(in.b)[b]];
@@ -96,11 +101,54 @@ __global__ void gib_recover_d(shmem_bytes *bufs, int buf_size,
     bufs[rank+buf_size/SOF*(i+N)].f = out[i].f;
 }
 
-/* There is a bug affecting CUDA compilers from version 2.3 onward that causes
+/* The same as gib_recover_d, except that the N sources and the recover_last
+ * outputs are found at the positions in src_ids_d and dst_ids_d instead of
+ * being packed at the front of bufs.
+ */
+__global__ void gib_recover_sparse_d(shmem_bytes *bufs, int buf_size,
+				     int recover_last) {
+  int rank = threadIdx.x + __umul24(blockIdx.x, blockDim.x);
+  load_tables(threadIdx, blockDim);
+	
+  shmem_bytes out[M];
+  shmem_bytes in;
+	
+  for (int i = 0; i < M; i++) 
+    out[i].f = 0;
+
+  __syncthreads();
+  for (int i = 0; i < N; ++i) {
+    in.f = bufs[rank+buf_size/SOF*src_ids_d[i]].f;
+    for (int j = 0; j < recover_last; ++j) {
+      int F_tmp = sh_log[R_d[j*N+i]]; /* No load conflicts */
+      for (int b = 0; b < SOF; ++b) {
+	if (in.b[b] != 0) {
+	  int sum_log = F_tmp + sh_log[(in.b)[b]];
+	  if (sum_log >= 255) sum_log -= 255;
+	  (out[j].b)[b] ^= sh_ilog[sum_log];
+	}
+      }
+    }
+  }
+  for (int i = 0; i < recover_last; i++) 
+    bufs[rank+buf_size/SOF*dst_ids_d[i]].f = out[i].f;
+}
+
+/* One stripe of a batch, as laid out by gib_generate_batch */
+struct stripe_d {
+  shmem_bytes *bufs;
+  int buf_size;
+};
+
+/* Computes this thread's word of every parity buffer.  The caller has loaded
+   the tables and synchronized.
+
+   There is a bug affecting CUDA compilers from version 2.3 onward that causes
    this kernel to miscompile for M=2. For this case, there is some preprocessor
    trickiness that allows this kernel to generate M=3, but only store for M=2.
 */
-__global__ void gib_checksum_d(shmem_bytes *bufs, int buf_size) {
+__device__ __inline__ void checksum(shmem_bytes *bufs, int buf_size,
+				    int rank) {
   /* Requirement: 
      buf_size % SOF == 0.  This prevents expensive divide operations. */
 #if M == 2
@@ -108,9 +156,6 @@ __global__ void gib_checksum_d(shmem_bytes *bufs, int buf_size) {
 #define M 3
 #define RAID6_FIX    
 #endif
-  int rank = threadIdx.x + __umul24(blockIdx.x, blockDim.x);
-  load_tables(threadIdx, blockDim);
-	
   /* Load the data to shared memory */
   shmem_bytes out[M];
   shmem_bytes in;
@@ -118,7 +163,6 @@ __global__ void gib_checksum_d(shmem_bytes *bufs, int buf_size) {
   for (int i = 0; i < M; i++) 
     out[i].f = 0;
 
-  __syncthreads();
   for (int i = 0; i < N; ++i) {
     /* Fetch the in-disk */
     in.f = bufs[rank+buf_size/SOF*i].f;
@@ -138,7 +182,6 @@ __global__ void gib_checksum_d(shmem_bytes *bufs, int buf_size) {
       //}
     }
   }
-  /* This works as long as buf_size % blocksize == 0 */
 #ifdef RAID6_FIX
 #undef M
 #define M 2
@@ -147,3 +190,24 @@ __global__ void gib_checksum_d(shmem_bytes *bufs, int buf_size) {
   for (int i = 0; i < M; i++) 
     bufs[rank+buf_size/SOF*(i+N)].f = out[i].f;
 }
+
+__global__ void gib_checksum_d(shmem_bytes *bufs, int buf_size) {
+  int rank = threadIdx.x + __umul24(blockIdx.x, blockDim.x);
+  load_tables(threadIdx, blockDim);
+  __syncthreads();
+  /* This works as long as buf_size % blocksize == 0 */
+  checksum(bufs, buf_size, rank);
+}
+
+/* Row y of the grid codes stripe y of the batch.  The grid is as wide as
+ * the largest stripe needs, so threads past the end of a smaller stripe
+ * have nothing to do.
+ */
+__global__ void gib_checksum_batch_d(stripe_d *stripes) {
+  int rank = threadIdx.x + __umul24(blockIdx.x, blockDim.x);
+  stripe_d s = stripes[blockIdx.y];
+  load_tables(threadIdx, blockDim);
+  __syncthreads();
+  if (rank < s.buf_size/SOF)
+    checksum(s.bufs, s.buf_size, rank);
+}
@@ -2,7 +2,7 @@
  * Email:   mlcurry@sandia.gov
  *
  * This file defines the Gibraltar implementation functions which use the CUDA 
- * driver API.  
+ * driver API.  It is built in with "make cuda=1".
  */
 
 /* TODO:  
@@ -27,6 +27,10 @@ int gib_buf_size = 1024*1024;
 #include "../inc/gibraltar.h"
 #include "../inc/gib_galois.h"
 #include "../inc/gib_cpu_funcs.h"
+#include "../inc/gib_crc32c.h"
+#include "../inc/gib_ops.h"
+#include "../inc/gib_iov.h"
+#include "../inc/gib_trace.h"
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -46,9 +50,22 @@ struct gpu_context_t {
   CUfunction checksum;
   CUfunction recover_sparse;
   CUfunction recover;
+  CUfunction checksum_batch;
   CUdeviceptr buffers;
+  /* Stripe table for gib_generate_batch, grown as needed */
+  CUdeviceptr batch_d;
+  int batch_cap;
 };
 
+/* Mirrors struct stripe_d in gib_cuda_checksum.cu */
+struct gib_stripe_d {
+  void *bufs;
+  int buf_size;
+};
+
+/* Batches are launched with one grid row per stripe. */
+#define GIB_MAX_GRID_ROWS 65535
+
 typedef struct gpu_context_t * gpu_context;
 
 /* This macro checks for an error in the command given.  If it fails, the entire
@@ -110,8 +127,12 @@ void gib_cuda_compile(int n, int m, char *filename) { /* never returns */
   exit(-1);
 }
 
-/* Initializes the CPU and GPU runtimes. */
-int gib_init ( int n, int m, gib_context *c ) {
+/* The options only affect the noncontiguous calls, which run on the CPU.
+ * Those have to write the same parity as the GPU, which rules out the XOR
+ * engine.
+ */
+static int gib_cuda_init_opts ( int n, int m, const struct gib_options *opts,
+				gib_context *c ) {
   static CUcontext pCtx;
   static CUdevice dev;
   if (m < 2 || n < 2) {
@@ -120,7 +141,11 @@ int gib_init ( int n, int m, gib_context *c ) {
 	    "less than two.  Use XOR or replication instead.\n");
     exit(1);
   }
-  int rc_i = gib_cpu_init(n,m,c);
+  if (opts != NULL && opts->engine != GIB_ENGINE_TABLE) {
+    fprintf(stderr, "The GPU only codes with the table engine.\n");
+    return GIB_ERR;
+  }
+  int rc_i = gib_cpu_init_opts(n,m,opts,c);
   if (rc_i != GIB_SUC) {
     fprintf(stderr, "gib_cpu_init returned %i\n", rc_i);
     exit(EXIT_FAILURE);
@@ -155,6 +180,8 @@ int gib_init ( int n, int m, gib_context *c ) {
   gpu_context gpu_c = (gpu_context) malloc(sizeof(struct gpu_context_t));
   gpu_c->dev = dev;
   gpu_c->pCtx = pCtx;
+  gpu_c->batch_d = 0;
+  gpu_c->batch_cap = 0;
   (*c)->acc_context = (void *)gpu_c;
 	
   /* Determine whether the PTX has been generated or not by attempting to
@@ -213,11 +240,16 @@ int gib_init ( int n, int m, gib_context *c ) {
   ERROR_CHECK_FAIL(cuModuleGetFunction(&(gpu_c->recover),
 	       (gpu_c->module), 
 	       "_Z13gib_recover_dP11shmem_bytesii"));
+  ERROR_CHECK_FAIL(cuModuleGetFunction(&(gpu_c->recover_sparse),
+	       (gpu_c->module), 
+	       "_Z20gib_recover_sparse_dP11shmem_bytesii"));
+  ERROR_CHECK_FAIL(cuModuleGetFunction(&(gpu_c->checksum_batch),
+	       (gpu_c->module), 
+	       "_Z20gib_checksum_batch_dP8stripe_d"));
 	
-  /* Initialize the math libraries */
-  gib_galois_init();
-  unsigned char F[256*256];
-  gib_galois_gen_F(F, m, n);
+  /* The math libraries and F were set up by gib_cpu_init_opts, which also
+   * picked the kind of matrix.
+   */
 
   /* Initialize/Allocate GPU-side structures */
   CUdeviceptr log_d, ilog_d, F_d;
@@ -227,7 +259,7 @@ int gib_init ( int n, int m, gib_context *c ) {
 				     "gf_ilog_d"));
   ERROR_CHECK_FAIL(cuMemcpyHtoD(ilog_d, gib_gf_ilog, 256));
   ERROR_CHECK_FAIL(cuModuleGetGlobal(&F_d, NULL, gpu_c->module, "F_d"));
-  ERROR_CHECK_FAIL(cuMemcpyHtoD(F_d, F, m*n));
+  ERROR_CHECK_FAIL(cuMemcpyHtoD(F_d, (*c)->F, m*n));
 #if !GIB_USE_MMAP
   ERROR_CHECK_FAIL(cuMemAlloc(&(gpu_c->buffers), (n+m)*gib_buf_size));
 #endif
@@ -236,7 +268,7 @@ int gib_init ( int n, int m, gib_context *c ) {
   return GIB_SUC;
 }
 
-int gib_destroy ( gib_context c ) {
+static int gib_cuda_destroy ( gib_context c ) {
   /* TODO:  Make sure everything created in gib_init is destroyed here. */
   ERROR_CHECK_FAIL(cuCtxPushCurrent(((gpu_context)(c->acc_context))->pCtx));
   int rc_i = gib_cpu_destroy(c);
@@ -248,12 +280,15 @@ int gib_destroy ( gib_context c ) {
 #if !GIB_USE_MMAP
   ERROR_CHECK_FAIL(cuMemFree(gpu_c->buffers));
 #endif
+  if (gpu_c->batch_d != 0)
+    ERROR_CHECK_FAIL(cuMemFree(gpu_c->batch_d));
   ERROR_CHECK_FAIL(cuModuleUnload(gpu_c->module));
   ERROR_CHECK_FAIL(cuCtxDestroy(gpu_c->pCtx));
   return GIB_SUC;
 }
 
-int gib_alloc ( void **buffers, int buf_size, int *ld, gib_context c ) {
+static int gib_cuda_alloc ( void **buffers, int buf_size, int *ld,
+			    gib_context c ) {
   ERROR_CHECK_FAIL(cuCtxPushCurrent(((gpu_context)(c->acc_context))->pCtx));
 #if GIB_USE_MMAP
   ERROR_CHECK_FAIL(cuMemHostAlloc(buffers, (c->n+c->m)*buf_size, 
@@ -266,14 +301,17 @@ int gib_alloc ( void **buffers, int buf_size, int *ld, gib_context c ) {
   return GIB_SUC;
 }
 
-int gib_free ( void *buffers, gib_context c ) {
+static int gib_cuda_free ( void *buffers, gib_context c ) {
   ERROR_CHECK_FAIL(cuCtxPushCurrent(((gpu_context)(c->acc_context))->pCtx));
   ERROR_CHECK_FAIL(cuMemFreeHost(buffers));
   ERROR_CHECK_FAIL(cuCtxPopCurrent(&((gpu_context)(c->acc_context))->pCtx));
   return GIB_SUC;
 }
 
-int gib_generate ( void *buffers, int buf_size, gib_context c ) {
+static int gib_cuda_generate_nc ( void *buffers, int buf_size, int work_size,
+				  gib_context c );
+
+static int gib_cuda_generate ( void *buffers, int buf_size, gib_context c ) {
   ERROR_CHECK_FAIL(cuCtxPushCurrent(((gpu_context)(c->acc_context))->pCtx));
   /* Do it all at once if the buffers are small enough */
 #if !GIB_USE_MMAP
@@ -281,7 +319,7 @@ int gib_generate ( void *buffers, int buf_size, gib_context c ) {
    * Split it into several noncontiguous jobs. 
    */
   if (buf_size > gib_buf_size) {
-    int rc = gib_generate_nc(buffers, buf_size, buf_size, c);
+    int rc = gib_cuda_generate_nc(buffers, buf_size, buf_size, c);
     ERROR_CHECK_FAIL(cuCtxPopCurrent(&((gpu_context)(c->acc_context))->pCtx));
     return rc;
   }
@@ -291,17 +329,14 @@ int gib_generate ( void *buffers, int buf_size, gib_context c ) {
   int fetch_size = sizeof(int)*nthreads_per_block;
   int nblocks = (buf_size + fetch_size - 1)/fetch_size;
   gpu_context gpu_c = (gpu_context) c->acc_context;
-  
-  unsigned char F[256*256];
-  gib_galois_gen_F(F, c->m, c->n);
-  CUdeviceptr F_d;
-  ERROR_CHECK_FAIL(cuModuleGetGlobal(&F_d, NULL, gpu_c->module, "F_d"));
-  ERROR_CHECK_FAIL(cuMemcpyHtoD(F_d, F, (c->m)*(c->n)));
+  /* F_d was loaded by gib_init and recovery does not overwrite it. */
   
 #if !GIB_USE_MMAP
   /* Copy the buffers to memory */
+  GIB_TRACE_BEGIN(htod, (c->n)*buf_size);
   ERROR_CHECK_FAIL(cuMemcpyHtoD(gpu_c->buffers, buffers, 
 				(c->n)*buf_size));
+  GIB_TRACE_END(htod, (c->n)*buf_size);
 #endif
   /* Configure and launch */
   ERROR_CHECK_FAIL(cuFuncSetBlockShape(gpu_c->checksum, nthreads_per_block,
@@ -321,22 +356,103 @@ int gib_generate ( void *buffers, int buf_size, gib_context c ) {
 			       sizeof(buf_size)));
   offset += sizeof(buf_size);
   ERROR_CHECK_FAIL(cuParamSetSize(gpu_c->checksum, offset));
+  GIB_TRACE_BEGIN(launch, nblocks);
   ERROR_CHECK_FAIL(cuLaunchGrid(gpu_c->checksum, nblocks, 1));
+  GIB_TRACE_END(launch, nblocks);
 
   /* Get the results back */
 #if !GIB_USE_MMAP
   CUdeviceptr tmp_d = gpu_c->buffers + c->n*buf_size;
   void *tmp_h = (void *)((unsigned char *)(buffers) + c->n*buf_size);
+  GIB_TRACE_BEGIN(dtoh, (c->m)*buf_size);
   ERROR_CHECK_FAIL(cuMemcpyDtoH(tmp_h, tmp_d, (c->m)*buf_size));
+  GIB_TRACE_END(dtoh, (c->m)*buf_size);
 #else
+  GIB_TRACE_BEGIN(dtoh, 0);
   ERROR_CHECK_FAIL(cuCtxSynchronize());
+  GIB_TRACE_END(dtoh, 0);
 #endif
   ERROR_CHECK_FAIL(cuCtxPopCurrent(&((gpu_context)(c->acc_context))->pCtx));
   return GIB_SUC; 
 }
 
-int gib_recover ( void *buffers, int buf_size, int *buf_ids, int recover_last,
-		  gib_context c ) {
+/* The whole batch is coded by one launch:  grid row y handles stripe y, and
+ * the grid is as wide as the largest stripe needs.  The stripes must have
+ * been allocated with gib_alloc so the GPU can reach them.
+ */
+static int gib_cuda_generate_batch ( struct gib_stripe *stripes, int count,
+				     gib_context c ) {
+#if !GIB_USE_MMAP
+  /* Each stripe has to be staged through the device buffers anyway. */
+  for (int i = 0; i < count; i++) {
+    int rc = gib_cuda_generate(stripes[i].buffers, stripes[i].buf_size, c);
+    if (rc != GIB_SUC)
+      return rc;
+  }
+  return GIB_SUC;
+#else
+  if (count <= 0)
+    return GIB_SUC;
+  ERROR_CHECK_FAIL(cuCtxPushCurrent(((gpu_context)(c->acc_context))->pCtx));
+  gpu_context gpu_c = (gpu_context) c->acc_context;
+  struct gib_stripe_d *table;
+  int max_size = 0;
+
+  table = (struct gib_stripe_d *)malloc(count*sizeof(struct gib_stripe_d));
+  if (table == NULL) {
+    ERROR_CHECK_FAIL(cuCtxPopCurrent(&((gpu_context)(c->acc_context))->pCtx));
+    return GIB_OOM;
+  }
+  for (int i = 0; i < count; i++) {
+    CUdeviceptr cpu_buffers;
+    ERROR_CHECK_FAIL(cuMemHostGetDevicePointer(&cpu_buffers, 
+					       stripes[i].buffers, 0));
+    table[i].bufs = (void *)cpu_buffers;
+    table[i].buf_size = stripes[i].buf_size;
+    if (stripes[i].buf_size > max_size)
+      max_size = stripes[i].buf_size;
+  }
+  if (count > gpu_c->batch_cap) {
+    if (gpu_c->batch_d != 0)
+      ERROR_CHECK_FAIL(cuMemFree(gpu_c->batch_d));
+    ERROR_CHECK_FAIL(cuMemAlloc(&gpu_c->batch_d, 
+				count*sizeof(struct gib_stripe_d)));
+    gpu_c->batch_cap = count;
+  }
+  GIB_TRACE_BEGIN(htod, count*sizeof(struct gib_stripe_d));
+  ERROR_CHECK_FAIL(cuMemcpyHtoD(gpu_c->batch_d, table, 
+				count*sizeof(struct gib_stripe_d)));
+  GIB_TRACE_END(htod, count*sizeof(struct gib_stripe_d));
+  free(table);
+
+  int nthreads_per_block = 128;
+  int fetch_size = sizeof(int)*nthreads_per_block;
+  int nblocks = (max_size + fetch_size - 1)/fetch_size;
+  ERROR_CHECK_FAIL(cuFuncSetBlockShape(gpu_c->checksum_batch, 
+				       nthreads_per_block, 1, 1));
+  for (int first = 0; first < count; first += GIB_MAX_GRID_ROWS) {
+    int rows = count - first;
+    if (rows > GIB_MAX_GRID_ROWS)
+      rows = GIB_MAX_GRID_ROWS;
+    void *ptr = (void *)(gpu_c->batch_d + 
+			 first*sizeof(struct gib_stripe_d));
+    ERROR_CHECK_FAIL(cuParamSetv(gpu_c->checksum_batch, 0, &ptr, 
+				 sizeof(ptr)));
+    ERROR_CHECK_FAIL(cuParamSetSize(gpu_c->checksum_batch, sizeof(ptr)));
+    GIB_TRACE_BEGIN(launch, nblocks);
+    ERROR_CHECK_FAIL(cuLaunchGrid(gpu_c->checksum_batch, nblocks, rows));
+    GIB_TRACE_END(launch, nblocks);
+  }
+  GIB_TRACE_BEGIN(dtoh, 0);
+  ERROR_CHECK_FAIL(cuCtxSynchronize());
+  GIB_TRACE_END(dtoh, 0);
+  ERROR_CHECK_FAIL(cuCtxPopCurrent(&((gpu_context)(c->acc_context))->pCtx));
+  return GIB_SUC;
+#endif
+}
+
+static int gib_cuda_recover ( void *buffers, int buf_size, int *buf_ids,
+			      int recover_last, gib_context c ) {
   ERROR_CHECK_FAIL(cuCtxPushCurrent(((gpu_context)(c->acc_context))->pCtx));
 #if !GIB_USE_MMAP
   if (buf_size > gib_buf_size) {
@@ -346,41 +462,31 @@ int gib_recover ( void *buffers, int buf_size, int *buf_ids, int recover_last,
   }
 #endif
 
-  int i, j;
-  int n = c->n;
-  int m = c->m;
-  unsigned char A[128*128], inv[128*128], modA[128*128];
-  for (i = n; i < n+recover_last; i++)
-    if (buf_ids[i] >= n) {
-      fprintf(stderr, "Attempting to recover a parity buffer, not allowed\n");
-      return GIB_ERR;
-    }
-
-  gib_galois_gen_A(A, m+n, n);
-
-  /* Modify the matrix to have the failed drives reflected */
-  for (i = 0; i < n; i++) 
-    for (j = 0; j < n; j++) 
-      modA[i*n+j] = A[buf_ids[i]*n+j];
-
-  gib_galois_gaussian_elim(modA, inv, n, n);
-
-  /* Copy row buf_ids[i] into row i */
-  for (i = n; i < n+recover_last; i++)
-    for (j = 0; j < n; j++)
-      modA[i*n+j] = inv[buf_ids[i]*n+j];
+  unsigned char *rows = (unsigned char *)malloc(recover_last*(c->n));
+  int rc = (rows == NULL) ? GIB_OOM :
+    gib_cpu_recovery_rows(c, buf_ids, recover_last, rows);
+  if (rc != GIB_SUC) {
+    free(rows);
+    ERROR_CHECK_FAIL(cuCtxPopCurrent(&((gpu_context)(c->acc_context))->pCtx));
+    return rc;
+  }
 
   int nthreads_per_block = 128;
   int fetch_size = sizeof(int)*nthreads_per_block;
   int nblocks = (buf_size + fetch_size - 1)/fetch_size;
   gpu_context gpu_c = (gpu_context) c->acc_context;
 
-  CUdeviceptr F_d;
-  ERROR_CHECK_FAIL(cuModuleGetGlobal(&F_d, NULL, gpu_c->module, "F_d"));
-  ERROR_CHECK_FAIL(cuMemcpyHtoD(F_d, modA+n*n, (c->m)*(c->n)));
+  CUdeviceptr R_d;
+  ERROR_CHECK_FAIL(cuModuleGetGlobal(&R_d, NULL, gpu_c->module, "R_d"));
+  GIB_TRACE_BEGIN(htod, recover_last*(c->n));
+  ERROR_CHECK_FAIL(cuMemcpyHtoD(R_d, rows, recover_last*(c->n)));
+  GIB_TRACE_END(htod, recover_last*(c->n));
+  free(rows);
 
 #if !GIB_USE_MMAP
+  GIB_TRACE_BEGIN(htod, (c->n)*buf_size);
   ERROR_CHECK_FAIL(cuMemcpyHtoD(gpu_c->buffers, buffers, (c->n)*buf_size));
+  GIB_TRACE_END(htod, (c->n)*buf_size);
 #endif
   ERROR_CHECK_FAIL(cuFuncSetBlockShape(gpu_c->recover, nthreads_per_block, 
 				       1, 1));
@@ -402,15 +508,192 @@ int gib_recover ( void *buffers, int buf_size, int *buf_ids, int recover_last,
 			       sizeof(recover_last)));
   offset += sizeof(recover_last);
   ERROR_CHECK_FAIL(cuParamSetSize(gpu_c->recover, offset));
+  GIB_TRACE_BEGIN(launch, nblocks);
   ERROR_CHECK_FAIL(cuLaunchGrid(gpu_c->recover, nblocks, 1));
+  GIB_TRACE_END(launch, nblocks);
 #if !GIB_USE_MMAP
   CUdeviceptr tmp_d = gpu_c->buffers + c->n*buf_size;
   void *tmp_h = (void *)((unsigned char *)(buffers) + c->n*buf_size);
+  GIB_TRACE_BEGIN(dtoh, recover_last*buf_size);
   ERROR_CHECK_FAIL(cuMemcpyDtoH(tmp_h, tmp_d, recover_last*buf_size));
+  GIB_TRACE_END(dtoh, recover_last*buf_size);
 #else
+  GIB_TRACE_BEGIN(dtoh, 0);
   cuCtxSynchronize();
+  GIB_TRACE_END(dtoh, 0);
+#endif
+  ERROR_CHECK_FAIL(cuCtxPopCurrent(&((gpu_context)(c->acc_context))->pCtx));
+  return GIB_SUC;
+}
+
+/* Rebuilds buffers buf_ids[n..n+nrows) in place from buffers buf_ids[0..n)
+ * of the original n+m layout, using the given rows.  Called with the
+ * context current.
+ */
+static void gib_cuda_code_sparse ( void *buffers, int buf_size, int *buf_ids,
+				   int nrows, unsigned char *rows,
+				   gib_context c ) {
+  int n = c->n;
+  int nthreads_per_block = 128;
+  int fetch_size = sizeof(int)*nthreads_per_block;
+  int nblocks = (buf_size + fetch_size - 1)/fetch_size;
+  gpu_context gpu_c = (gpu_context) c->acc_context;
+
+  CUdeviceptr R_d, src_ids_d, dst_ids_d;
+  ERROR_CHECK_FAIL(cuModuleGetGlobal(&R_d, NULL, gpu_c->module, "R_d"));
+  GIB_TRACE_BEGIN(htod, nrows*n);
+  ERROR_CHECK_FAIL(cuMemcpyHtoD(R_d, rows, nrows*n));
+  GIB_TRACE_END(htod, nrows*n);
+  ERROR_CHECK_FAIL(cuModuleGetGlobal(&src_ids_d, NULL, gpu_c->module, 
+				     "src_ids_d"));
+  GIB_TRACE_BEGIN(htod, n*sizeof(int));
+  ERROR_CHECK_FAIL(cuMemcpyHtoD(src_ids_d, buf_ids, n*sizeof(int)));
+  GIB_TRACE_END(htod, n*sizeof(int));
+  ERROR_CHECK_FAIL(cuModuleGetGlobal(&dst_ids_d, NULL, gpu_c->module, 
+				     "dst_ids_d"));
+  GIB_TRACE_BEGIN(htod, nrows*sizeof(int));
+  ERROR_CHECK_FAIL(cuMemcpyHtoD(dst_ids_d, buf_ids+n, nrows*sizeof(int)));
+  GIB_TRACE_END(htod, nrows*sizeof(int));
+
+#if !GIB_USE_MMAP
+  GIB_TRACE_BEGIN(htod, (c->n+c->m)*buf_size);
+  ERROR_CHECK_FAIL(cuMemcpyHtoD(gpu_c->buffers, buffers, 
+				(c->n+c->m)*buf_size));
+  GIB_TRACE_END(htod, (c->n+c->m)*buf_size);
+#endif
+  ERROR_CHECK_FAIL(cuFuncSetBlockShape(gpu_c->recover_sparse, 
+				       nthreads_per_block, 1, 1));
+  int offset = 0;
+  void *ptr;
+#if GIB_USE_MMAP
+  CUdeviceptr cpu_buffers;
+  ERROR_CHECK_FAIL(cuMemHostGetDevicePointer(&cpu_buffers, buffers, 0));
+  ptr = (void *)cpu_buffers;
+#else
+  ptr = (void *)gpu_c->buffers;
 #endif
+  ERROR_CHECK_FAIL(cuParamSetv(gpu_c->recover_sparse, offset, &ptr, 
+			       sizeof(ptr)));
+  offset += sizeof(ptr);
+  ERROR_CHECK_FAIL(cuParamSetv(gpu_c->recover_sparse, offset, &buf_size, 
+			       sizeof(buf_size)));
+  offset += sizeof(buf_size);
+  ERROR_CHECK_FAIL(cuParamSetv(gpu_c->recover_sparse, offset, &nrows, 
+			       sizeof(nrows)));
+  offset += sizeof(nrows);
+  ERROR_CHECK_FAIL(cuParamSetSize(gpu_c->recover_sparse, offset));
+  GIB_TRACE_BEGIN(launch, nblocks);
+  ERROR_CHECK_FAIL(cuLaunchGrid(gpu_c->recover_sparse, nblocks, 1));
+  GIB_TRACE_END(launch, nblocks);
+#if !GIB_USE_MMAP
+  for (int i = 0; i < nrows; i++) {
+    CUdeviceptr tmp_d = gpu_c->buffers + buf_ids[n+i]*buf_size;
+    void *tmp_h = (void *)((unsigned char *)(buffers) + buf_ids[n+i]*buf_size);
+    GIB_TRACE_BEGIN(dtoh, buf_size);
+    ERROR_CHECK_FAIL(cuMemcpyDtoH(tmp_h, tmp_d, buf_size));
+    GIB_TRACE_END(dtoh, buf_size);
+  }
+#else
+  GIB_TRACE_BEGIN(dtoh, 0);
+  ERROR_CHECK_FAIL(cuCtxSynchronize());
+  GIB_TRACE_END(dtoh, 0);
+#endif
+}
+
+static int gib_cuda_recover_sparse ( void *buffers, int buf_size,
+				     char *failed_bufs, gib_context c ) {
+  ERROR_CHECK_FAIL(cuCtxPushCurrent(((gpu_context)(c->acc_context))->pCtx));
+#if !GIB_USE_MMAP
+  if (buf_size > gib_buf_size) {
+    int rc = gib_cpu_recover_sparse(buffers, buf_size, failed_bufs, c);
+    ERROR_CHECK_FAIL(cuCtxPopCurrent(&((gpu_context)(c->acc_context))->pCtx));
+    return rc;
+  }
+#endif
+
+  int buf_ids[256], recover_last;
+  int rc = gib_cpu_sparse_ids(failed_bufs, buf_ids, &recover_last, c);
+  if (rc == GIB_SUC && recover_last > 0) {
+    unsigned char *rows = (unsigned char *)malloc(recover_last*(c->n));
+    rc = (rows == NULL) ? GIB_OOM :
+      gib_cpu_recovery_rows(c, buf_ids, recover_last, rows);
+    if (rc == GIB_SUC)
+      gib_cuda_code_sparse(buffers, buf_size, buf_ids, recover_last, rows, c);
+    free(rows);
+  }
   ERROR_CHECK_FAIL(cuCtxPopCurrent(&((gpu_context)(c->acc_context))->pCtx));
+  return rc;
+}
+
+/* The data buffers are the sources as they stand, and the parity rows are
+ * taken straight from F.
+ */
+static int gib_cuda_regenerate ( void *buffers, int buf_size, int *parity_ids,
+				 int count, gib_context c ) {
+  int n = c->n;
+  int buf_ids[256];
+  unsigned char *rows;
+  if (count <= 0)
+    return GIB_SUC;
+  for (int i = 0; i < count; i++)
+    if (parity_ids[i] < n || parity_ids[i] >= n + c->m) {
+      fprintf(stderr, "Buffer %i is not a parity buffer.\n", parity_ids[i]);
+      return GIB_ERR;
+    }
+  if ((rows = (unsigned char *)malloc(count*n)) == NULL)
+    return GIB_OOM;
+  for (int i = 0; i < count; i++) {
+    memcpy(rows + i*n, c->F + (parity_ids[i]-n)*n, n);
+    buf_ids[n+i] = parity_ids[i];
+  }
+  for (int i = 0; i < n; i++)
+    buf_ids[i] = i;
+
+  ERROR_CHECK_FAIL(cuCtxPushCurrent(((gpu_context)(c->acc_context))->pCtx));
+#if !GIB_USE_MMAP
+  if (buf_size > gib_buf_size) {
+    int rc = gib_cpu_regenerate(buffers, buf_size, parity_ids, count, c);
+    free(rows);
+    ERROR_CHECK_FAIL(cuCtxPopCurrent(&((gpu_context)(c->acc_context))->pCtx));
+    return rc;
+  }
+#endif
+  gib_cuda_code_sparse(buffers, buf_size, buf_ids, count, rows, c);
+  free(rows);
+  ERROR_CHECK_FAIL(cuCtxPopCurrent(&((gpu_context)(c->acc_context))->pCtx));
+  return GIB_SUC;
+}
+
+/* The GPU's writes cannot be checksummed as they happen, so the CRCs are
+ * taken in one pass over the stripe after the kernel is done.  All of the
+ * buffers are read together, which at least keeps it to a single pass.
+ */
+static void gib_cuda_crcs ( void *buffers, int buf_size, int nbufs,
+			    unsigned int *crcs ) {
+  unsigned char *bufs[256];
+  int i;
+  for (i = 0; i < nbufs; i++) {
+    bufs[i] = (unsigned char *)buffers + i*buf_size;
+    crcs[i] = 0;
+  }
+  gib_crc32c_multi(crcs, bufs, nbufs, 0, buf_size);
+}
+
+static int gib_cuda_generate_crc ( void *buffers, int buf_size,
+				   unsigned int *crcs, gib_context c ) {
+  int rc;
+  if ((rc = gib_cuda_generate(buffers, buf_size, c)))
+    return rc;
+  gib_cuda_crcs(buffers, buf_size, c->n+c->m, crcs);
+  return GIB_SUC;
+}
+
+static int gib_cuda_recover_crc ( void *buffers, int buf_size, int *buf_ids,
+				  int recover_last, unsigned int *crcs, gib_context c ) {
+  int rc;
+  if ((rc = gib_cuda_recover(buffers, buf_size, buf_ids, recover_last, c)))
+    return rc;
+  gib_cuda_crcs(buffers, buf_size, c->n+recover_last, crcs);
   return GIB_SUC;
 }
 
@@ -422,13 +705,87 @@ int gib_recover ( void *buffers, int buf_size, int *buf_ids, int recover_last,
    TODO:  The MMapped version can benefit from this if the buffer isn't full.
    Bring this to life for that implementation only.
 */
-int gib_generate_nc ( void *buffers, int buf_size, int work_size,  
-		      gib_context c) {
+static int gib_cuda_generate_nc ( void *buffers, int buf_size, int work_size,  
+				  gib_context c) {
   return gib_cpu_generate_nc(buffers, buf_size, work_size, c);
 }
-int gib_recover_nc ( void *buffers, int buf_size, int work_size, int *buf_ids, 
-		     int recover_last, gib_context c ) {
+static int gib_cuda_recover_nc ( void *buffers, int buf_size, int work_size,
+				 int *buf_ids, int recover_last, gib_context c ) {
   return gib_cpu_recover_nc(buffers, buf_size, work_size, buf_ids, 
 			    recover_last, c);
 }
 
+static int gib_cuda_recover_sparse_nc ( void *buffers, int buf_size,
+					int work_size, char *failed_bufs,
+					gib_context c ) {
+  return gib_cpu_recover_sparse_nc(buffers, buf_size, work_size, failed_bufs,
+				   c);
+}
+
+/* Scatter/gather buffers are not in memory the GPU can map, so these are
+ * done on the CPU.
+ */
+static int gib_cuda_generate_iov ( void **data, void **parity, int buf_size, 
+				   gib_context c ) {
+  return gib_cpu_generate_iov(data, parity, buf_size, c);
+}
+
+static int gib_cuda_recover_iov ( void **bufs, int buf_size, int *buf_ids, 
+				  int recover_last, gib_context c ) {
+  return gib_cpu_recover_iov(bufs, buf_size, buf_ids, recover_last, c);
+}
+
+/* Parity updates touch too little data to be worth a kernel launch. */
+static int gib_cuda_update ( void *buffers, int buf_size, int index,
+			     int offset, int len, void *old_data,
+			     void *new_data, gib_context c ) {
+  return gib_cpu_update(buffers, buf_size, index, offset, len, old_data, 
+			new_data, c);
+}
+
+static int gib_cuda_update_delta ( void *buffers, int buf_size, int index,
+				   int offset, int len, void *delta,
+				   gib_context c ) {
+  return gib_cpu_update(buffers, buf_size, index, offset, len, delta, NULL, 
+			c);
+}
+
+/* Automatic selection asks this of every implementation, so unlike
+ * gib_init_opts it reports what is missing instead of exiting.
+ */
+static int gib_cuda_available ( int n, int m ) {
+  int device_count;
+  if (m < 2 || n < 2 || getenv("GIB_CACHE_DIR") == NULL)
+    return 0;
+  if (cuInit(0) != CUDA_SUCCESS ||
+      cuDeviceGetCount(&device_count) != CUDA_SUCCESS)
+    return 0;
+  return device_count > 0;
+}
+
+const struct gib_ops gib_cuda_ops = {
+  "cuda",
+  GIB_BACKEND_CUDA,
+  1,
+  gib_cuda_available,
+  gib_cuda_init_opts,
+  gib_cuda_destroy,
+  gib_cuda_alloc,
+  gib_cuda_free,
+  gib_cuda_generate,
+  gib_cuda_generate_nc,
+  gib_cuda_generate_crc,
+  gib_cuda_generate_batch,
+  gib_cuda_recover,
+  gib_cuda_recover_nc,
+  gib_cuda_recover_crc,
+  gib_cuda_regenerate,
+  gib_cuda_recover_sparse,
+  gib_cuda_recover_sparse_nc,
+  gib_cuda_generate_iov,
+  gib_cuda_recover_iov,
+  gib_cpu_generate_iovec, /* As the pointer-array calls are */
+  gib_cpu_recover_iovec,
+  gib_cuda_update,
+  gib_cuda_update_delta
+};
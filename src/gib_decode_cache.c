@@ -0,0 +1,291 @@
+/* The decode-matrix cache.  Each entry maps a buf_ids layout (the n
+ * survivors in order, then the buffers being rebuilt) to the rows that
+ * rebuild them.  Entries live in a chained hash table and on an LRU list;
+ * once the cache is full, the least recently used entry is replaced.
+ */
+
+#include "../inc/gibraltar.h"
+#include "../inc/gib_decode_cache.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+struct gib_dc_entry {
+  struct gib_dc_entry *hnext;       /* Hash chain */
+  struct gib_dc_entry *prev, *next; /* LRU list, most recently used first */
+  unsigned int hash;
+  int nids;
+  unsigned char *ids;               /* nids entries, all < 256 */
+  unsigned char *rows;              /* (nids - n)*n coefficients */
+};
+
+struct gib_decode_cache {
+  pthread_mutex_t lock;
+  int n, capacity, count;
+  unsigned int nbuckets;            /* A power of two */
+  struct gib_dc_entry **buckets;
+  struct gib_dc_entry *head, *tail;
+  unsigned long hits, misses;
+};
+
+/* Saved caches start with this, followed by n, m, F and the entries from
+ * least to most recently used.
+ */
+static const char gib_dc_magic[8] = "GIBDC01";
+
+static unsigned int gib_dc_hash ( const int *ids, int nids ) {
+  /* FNV-1a */
+  unsigned int h = 2166136261u;
+  int i;
+  for (i = 0; i < nids; i++) {
+    h ^= (unsigned char)ids[i];
+    h *= 16777619u;
+  }
+  return h ^ nids;
+}
+
+static int gib_dc_match ( const struct gib_dc_entry *e, unsigned int hash,
+			  const int *ids, int nids ) {
+  int i;
+  if (e->hash != hash || e->nids != nids)
+    return 0;
+  for (i = 0; i < nids; i++)
+    if (e->ids[i] != ids[i])
+      return 0;
+  return 1;
+}
+
+static void gib_dc_unlink ( struct gib_decode_cache *dc,
+			    struct gib_dc_entry *e ) {
+  if (e->prev != NULL)
+    e->prev->next = e->next;
+  else
+    dc->head = e->next;
+  if (e->next != NULL)
+    e->next->prev = e->prev;
+  else
+    dc->tail = e->prev;
+}
+
+static void gib_dc_push_front ( struct gib_decode_cache *dc,
+				struct gib_dc_entry *e ) {
+  e->prev = NULL;
+  e->next = dc->head;
+  if (dc->head != NULL)
+    dc->head->prev = e;
+  else
+    dc->tail = e;
+  dc->head = e;
+}
+
+static void gib_dc_evict ( struct gib_decode_cache *dc ) {
+  struct gib_dc_entry *e = dc->tail, **pp;
+  gib_dc_unlink(dc, e);
+  pp = &dc->buckets[e->hash & (dc->nbuckets - 1)];
+  while (*pp != e)
+    pp = &(*pp)->hnext;
+  *pp = e->hnext;
+  free(e);
+  dc->count--;
+}
+
+int gib_dc_create ( struct gib_decode_cache **dc, int n, int capacity ) {
+  struct gib_decode_cache *d;
+  d = (struct gib_decode_cache *)calloc(1, sizeof(struct gib_decode_cache));
+  if (d == NULL)
+    return GIB_OOM;
+  d->n = n;
+  d->capacity = capacity;
+  d->nbuckets = 1;
+  while (d->nbuckets < 2*(unsigned int)capacity)
+    d->nbuckets <<= 1;
+  d->buckets = (struct gib_dc_entry **)calloc(d->nbuckets,
+					       sizeof(struct gib_dc_entry *));
+  if (d->buckets == NULL) {
+    free(d);
+    return GIB_OOM;
+  }
+  pthread_mutex_init(&d->lock, NULL);
+  *dc = d;
+  return GIB_SUC;
+}
+
+static void gib_dc_clear ( struct gib_decode_cache *dc ) {
+  while (dc->tail != NULL)
+    gib_dc_evict(dc);
+}
+
+void gib_dc_destroy ( struct gib_decode_cache *dc ) {
+  gib_dc_clear(dc);
+  pthread_mutex_destroy(&dc->lock);
+  free(dc->buckets);
+  free(dc);
+}
+
+int gib_dc_get ( struct gib_decode_cache *dc, const int *ids, int nids,
+		 unsigned char *rows ) {
+  unsigned int hash = gib_dc_hash(ids, nids);
+  struct gib_dc_entry *e;
+
+  pthread_mutex_lock(&dc->lock);
+  for (e = dc->buckets[hash & (dc->nbuckets - 1)]; e != NULL; e = e->hnext)
+    if (gib_dc_match(e, hash, ids, nids))
+      break;
+  if (e == NULL) {
+    dc->misses++;
+    pthread_mutex_unlock(&dc->lock);
+    return 0;
+  }
+  dc->hits++;
+  memcpy(rows, e->rows, (nids - dc->n)*dc->n);
+  if (e != dc->head) {
+    gib_dc_unlink(dc, e);
+    gib_dc_push_front(dc, e);
+  }
+  pthread_mutex_unlock(&dc->lock);
+  return 1;
+}
+
+void gib_dc_put ( struct gib_decode_cache *dc, const int *ids, int nids,
+		  const unsigned char *rows ) {
+  unsigned int hash = gib_dc_hash(ids, nids);
+  int i, nrows = (nids - dc->n)*dc->n;
+  struct gib_dc_entry *e, **bucket;
+
+  if (dc->capacity <= 0)
+    return;
+  e = (struct gib_dc_entry *)malloc(sizeof(struct gib_dc_entry) + nids +
+				    nrows);
+  if (e == NULL)
+    return; /* Caching is only an optimization. */
+  e->hash = hash;
+  e->nids = nids;
+  e->ids = (unsigned char *)(e + 1);
+  e->rows = e->ids + nids;
+  for (i = 0; i < nids; i++)
+    e->ids[i] = (unsigned char)ids[i];
+  memcpy(e->rows, rows, nrows);
+
+  pthread_mutex_lock(&dc->lock);
+  bucket = &dc->buckets[hash & (dc->nbuckets - 1)];
+  {
+    /* Another thread may have computed the same rows meanwhile. */
+    struct gib_dc_entry *o;
+    for (o = *bucket; o != NULL; o = o->hnext)
+      if (gib_dc_match(o, hash, ids, nids)) {
+	pthread_mutex_unlock(&dc->lock);
+	free(e);
+	return;
+      }
+  }
+  if (dc->count == dc->capacity)
+    gib_dc_evict(dc);
+  e->hnext = *bucket;
+  *bucket = e;
+  gib_dc_push_front(dc, e);
+  dc->count++;
+  pthread_mutex_unlock(&dc->lock);
+}
+
+/* Public interface */
+
+int gib_decode_cache_stats ( gib_context c, unsigned long *hits,
+			     unsigned long *misses ) {
+  struct gib_decode_cache *dc = c->dcache;
+  *hits = *misses = 0;
+  if (dc == NULL)
+    return GIB_SUC;
+  pthread_mutex_lock(&dc->lock);
+  *hits = dc->hits;
+  *misses = dc->misses;
+  pthread_mutex_unlock(&dc->lock);
+  return GIB_SUC;
+}
+
+int gib_decode_cache_clear ( gib_context c ) {
+  struct gib_decode_cache *dc = c->dcache;
+  if (dc == NULL)
+    return GIB_SUC;
+  pthread_mutex_lock(&dc->lock);
+  gib_dc_clear(dc);
+  dc->hits = dc->misses = 0;
+  pthread_mutex_unlock(&dc->lock);
+  return GIB_SUC;
+}
+
+int gib_decode_cache_save ( gib_context c, const char *path ) {
+  struct gib_decode_cache *dc = c->dcache;
+  struct gib_dc_entry *e;
+  FILE *fp;
+  int ok;
+
+  if (dc == NULL)
+    return GIB_ERR;
+  fp = fopen(path, "wb");
+  if (fp == NULL) {
+    perror(path);
+    return GIB_ERR;
+  }
+  pthread_mutex_lock(&dc->lock);
+  ok = fwrite(gib_dc_magic, sizeof(gib_dc_magic), 1, fp) == 1 &&
+    fwrite(&c->n, sizeof(int), 1, fp) == 1 &&
+    fwrite(&c->m, sizeof(int), 1, fp) == 1 &&
+    fwrite(c->F, c->m*c->n, 1, fp) == 1 &&
+    fwrite(&dc->count, sizeof(int), 1, fp) == 1;
+  for (e = dc->tail; ok && e != NULL; e = e->prev)
+    ok = fwrite(&e->nids, sizeof(int), 1, fp) == 1 &&
+      fwrite(e->ids, e->nids + (e->nids - dc->n)*dc->n, 1, fp) == 1;
+  pthread_mutex_unlock(&dc->lock);
+  if (fclose(fp) != 0)
+    ok = 0;
+  return ok ? GIB_SUC : GIB_ERR;
+}
+
+/* Entries are added to whatever the cache already holds.  A file written
+ * for a different n, m or coding matrix is rejected.
+ */
+int gib_decode_cache_load ( gib_context c, const char *path ) {
+  struct gib_decode_cache *dc = c->dcache;
+  char magic[sizeof(gib_dc_magic)];
+  unsigned char *buf;
+  int ids[256];
+  int n, m, count, nids, i, k, rc = GIB_SUC;
+  FILE *fp;
+
+  if (dc == NULL)
+    return GIB_ERR;
+  fp = fopen(path, "rb");
+  if (fp == NULL)
+    return GIB_ERR;
+  if (fread(magic, sizeof(magic), 1, fp) != 1 ||
+      memcmp(magic, gib_dc_magic, sizeof(magic)) ||
+      fread(&n, sizeof(int), 1, fp) != 1 ||
+      fread(&m, sizeof(int), 1, fp) != 1 ||
+      n != c->n || m != c->m) {
+    fclose(fp);
+    return GIB_ERR;
+  }
+  /* Room for F or for the largest entry, which has n+m ids and m rows */
+  buf = (unsigned char *)malloc(n + m + m*n);
+  if (buf == NULL) {
+    fclose(fp);
+    return GIB_OOM;
+  }
+  if (fread(buf, m*n, 1, fp) != 1 || memcmp(buf, c->F, m*n) ||
+      fread(&count, sizeof(int), 1, fp) != 1)
+    rc = GIB_ERR;
+  for (k = 0; rc == GIB_SUC && k < count; k++) {
+    if (fread(&nids, sizeof(int), 1, fp) != 1 || nids <= n || nids > n+m ||
+	fread(buf, nids + (nids - n)*n, 1, fp) != 1) {
+      rc = GIB_ERR;
+      break;
+    }
+    for (i = 0; i < nids; i++)
+      ids[i] = buf[i];
+    gib_dc_put(dc, ids, nids, buf + nids);
+  }
+  free(buf);
+  fclose(fp);
+  return rc;
+}
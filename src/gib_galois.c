@@ -14,6 +14,7 @@
 unsigned char gib_gf_log[256];
 unsigned char gib_gf_ilog[256];
 unsigned char gib_gf_table[256][256];
+unsigned char gib_gf_nib_table[256][32];
 
 unsigned char gib_galois_mul(unsigned char a, unsigned char b) {
   int sum_log;
@@ -58,6 +59,16 @@ int gib_galois_init() {
       gib_gf_table[i][j] = gib_galois_mul(i,j);
     }
   
+  /* The vector kernels split each byte into nibbles and look both halves up
+   * with a byte shuffle.  Row i holds i*x for x in 0..15 in the first 16
+   * bytes and i*(x<<4) in the last 16.
+   */
+  for (i = 0; i < 256; i++)
+    for (j = 0; j < 16; j++) {
+      gib_gf_nib_table[i][j] = gib_gf_table[i][j];
+      gib_gf_nib_table[i][16+j] = gib_gf_table[i][j << 4];
+    }
+  
   return 0;
 }
 
@@ -151,3 +162,101 @@ int gib_galois_gaussian_elim(unsigned char *mat, unsigned char *inv, int rows,
   }
   return 0;
 }
+
+/* Number of ones in the 8x8 GF(2) matrix that multiplies by e, which is the
+ * number of XORs the XOR engine spends on it.
+ */
+int gib_galois_bit_weight(unsigned char e) {
+  int c, weight = 0;
+  for (c = 0; c < 8; c++)
+    weight += __builtin_popcount(gib_gf_table[e][1 << c]);
+  return weight;
+}
+
+int gib_galois_gen_cauchy(unsigned char *mat, int rows, int cols) {
+  /* F[i][j] = 1/(x_i + y_j) with x_i = i and y_j = rows + j.  Every square
+   * submatrix of a Cauchy matrix is invertible, and scaling rows or columns
+   * keeps it so.  Following Plank's "good" Cauchy matrices, the columns are
+   * scaled to make the first row all ones, and each other row by whichever
+   * of its elements leaves it with the fewest ones in bit-matrix form.
+   */
+  int i, j, k;
+  if (rows + cols > 256)
+    return GIB_ERR;
+  for (i = 0; i < rows; i++)
+    for (j = 0; j < cols; j++)
+      mat[i*cols+j] = gib_galois_div(1, i ^ (rows + j));
+  for (j = 0; j < cols; j++) {
+    unsigned char d = mat[j];
+    for (i = 0; i < rows; i++)
+      mat[i*cols+j] = gib_galois_div(mat[i*cols+j], d);
+  }
+  for (i = 1; i < rows; i++) {
+    unsigned char *row = mat + i*cols, best_d = 1;
+    int best = -1;
+    for (k = 0; k < cols; k++) {
+      int weight = 0;
+      for (j = 0; j < cols; j++)
+	weight += gib_galois_bit_weight(gib_galois_div(row[j], row[k]));
+      if (best < 0 || weight < best) {
+	best = weight;
+	best_d = row[k];
+      }
+    }
+    for (j = 0; j < cols; j++)
+      row[j] = gib_galois_div(row[j], best_d);
+  }
+  return 0;
+}
+
+/* Inverts the e x e submatrix of a gib_galois_gen_cauchy matrix made of rows
+ * par[0..e) and columns lost[0..e), in O(e^2).  The submatrix is a_p b_j /
+ * (x_p + y_j) for the scales a and b applied after generation, and an
+ * unscaled Cauchy matrix C has the closed-form inverse
+ *
+ *   C^-1[j][p] = X(y_j) Y(x_p) / ((x_p + y_j) X'(x_p) Y'(y_j)),
+ *
+ * where X and Y are the products of (t + x_k) and (t + y_k) over the rows
+ * and columns taken, and X' and Y' the same products skipping the factor
+ * that vanishes.  inv[l*e+q] receives the coefficient of row par[q] in the
+ * solution for column lost[l].
+ */
+int gib_galois_cauchy_inverse(const unsigned char *mat, int rows, int cols,
+			      const int *par, const int *lost, int e,
+			      unsigned char *inv) {
+  unsigned char x[256], y[256], a[256], b[256];
+  unsigned char Xy[256], Yx[256], Xd[256], Yd[256];
+  int p, j, k;
+  /* Only the products a_i b_j = (x_i + y_j) F[i][j] are fixed, so take
+   * a_0 = 1, which gives b_j = y_j F[0][j] and a_i = (x_i + y_0) F[i][0] / b_0.
+   */
+  for (k = 0; k < e; k++) {
+    x[k] = par[k];
+    y[k] = rows + lost[k];
+    b[k] = gib_galois_mul(mat[lost[k]], y[k]);
+    a[k] = gib_galois_div(gib_galois_mul(mat[par[k]*cols], x[k] ^ rows),
+			  gib_galois_mul(mat[0], rows));
+  }
+  for (k = 0; k < e; k++) {
+    Xy[k] = Yx[k] = Xd[k] = Yd[k] = 1;
+    for (j = 0; j < e; j++) {
+      Xy[k] = gib_galois_mul(Xy[k], y[k] ^ x[j]);
+      Yx[k] = gib_galois_mul(Yx[k], x[k] ^ y[j]);
+      if (j != k) {
+	Xd[k] = gib_galois_mul(Xd[k], x[k] ^ x[j]);
+	Yd[k] = gib_galois_mul(Yd[k], y[k] ^ y[j]);
+      }
+    }
+  }
+  for (j = 0; j < e; j++)
+    for (p = 0; p < e; p++) {
+      unsigned char num = gib_galois_mul(Xy[j], Yx[p]);
+      unsigned char den = gib_galois_mul(gib_galois_mul(x[p] ^ y[j], Xd[p]),
+					 Yd[j]);
+      den = gib_galois_mul(den, gib_galois_mul(a[p], b[j]));
+      if (den == 0)
+	return GIB_ERR;
+      inv[j*e+p] = gib_galois_div(num, den);
+    }
+  return 0;
+}
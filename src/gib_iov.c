@@ -0,0 +1,232 @@
+/* Scatter/gather coding over chains of iovecs.  The chains are walked in
+ * step, and each stretch where no buffer crosses a segment boundary is
+ * coded as one piece.  The CPU routines work out the rows and the plan
+ * once per call and code each piece with them; other implementations are
+ * handed each piece through their pointer-array calls.
+ */
+
+#include "../inc/gibraltar.h"
+#include "../inc/gib_iov.h"
+#include "../inc/gib_cpu_funcs.h"
+#include "../inc/gib_ops.h"
+#include "../inc/gib_xor.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef int (*gib_iov_fn) ( void **ptrs, int len, void *arg );
+
+/* Copies len bytes between buf and the chain v from segment *seg, offset
+ * *off, leaving those just past them.  Into buf if out is zero, and out of
+ * it otherwise.
+ */
+static void gib_iov_copy ( const struct iovec *v, int *seg, size_t *off,
+			   unsigned char *buf, size_t len, int out ) {
+  size_t n;
+  while (len > 0) {
+    while (*off == v[*seg].iov_len) {
+      (*seg)++;
+      *off = 0;
+    }
+    n = v[*seg].iov_len - *off;
+    if (n > len)
+      n = len;
+    if (out)
+      memcpy((unsigned char *)v[*seg].iov_base + *off, buf, n);
+    else
+      memcpy(buf, (unsigned char *)v[*seg].iov_base + *off, n);
+    *off += n;
+    buf += n;
+    len -= n;
+  }
+}
+
+/* Calls fn on each piece of the chains, the first nsrc of which are read
+ * and the rest written.  With unit above one, every piece starts at a
+ * multiple of unit bytes and is a multiple of unit long:  where a unit
+ * crosses a segment boundary in some buffer, it is copied through bounce,
+ * which has room for unit bytes of every buffer.
+ */
+static int gib_iov_walk ( struct iovec **shards, int *iovcnt, int nbufs,
+			  int nsrc, int buf_size, int unit,
+			  unsigned char *bounce, gib_iov_fn fn, void *arg ) {
+  int seg[256], iseg[256];
+  size_t off[256], ioff[256], avail[256];
+  void *ptrs[256];
+  int i, rc, done = 0;
+
+  for (i = 0; i < nbufs; i++) {
+    seg[i] = 0;
+    off[i] = 0;
+  }
+  while (done < buf_size) {
+    size_t len = buf_size - done;
+    for (i = 0; i < nbufs; i++) {
+      while (seg[i] < iovcnt[i] && off[i] == shards[i][seg[i]].iov_len) {
+	seg[i]++;
+	off[i] = 0;
+      }
+      if (seg[i] == iovcnt[i]) {
+	fprintf(stderr, "Buffer %i is shorter than buf_size.\n", i);
+	return GIB_ERR;
+      }
+      avail[i] = shards[i][seg[i]].iov_len - off[i];
+      if (avail[i] < len)
+	len = avail[i];
+      ptrs[i] = (unsigned char *)shards[i][seg[i]].iov_base + off[i];
+    }
+    if (len >= (size_t)unit) {
+      len -= len % unit;
+      if ((rc = fn(ptrs, (int)len, arg)))
+	return rc;
+      for (i = 0; i < nbufs; i++)
+	off[i] += len;
+      done += len;
+      continue;
+    }
+
+    /* A unit split across segments.  Only the buffers that split it need
+     * copying, but every one must hold the whole unit.
+     */
+    len = unit;
+    for (i = 0; i < nbufs; i++) {
+      size_t left = avail[i];
+      int s;
+      for (s = seg[i] + 1; left < len && s < iovcnt[i]; s++)
+	left += shards[i][s].iov_len;
+      if (left < len) {
+	fprintf(stderr, "Buffer %i is shorter than buf_size.\n", i);
+	return GIB_ERR;
+      }
+      if (avail[i] >= len)
+	continue;
+      ptrs[i] = bounce + (size_t)i*unit;
+      iseg[i] = seg[i];
+      ioff[i] = off[i];
+      if (i < nsrc)
+	gib_iov_copy(shards[i], &iseg[i], &ioff[i], (unsigned char *)ptrs[i],
+		     len, 0);
+    }
+    if ((rc = fn(ptrs, (int)len, arg)))
+      return rc;
+    for (i = 0; i < nbufs; i++) {
+      if (avail[i] >= len) {
+	off[i] += len;
+	continue;
+      }
+      if (i >= nsrc)
+	gib_iov_copy(shards[i], &seg[i], &off[i], (unsigned char *)ptrs[i],
+		     len, 1);
+      else {
+	seg[i] = iseg[i];
+	off[i] = ioff[i];
+      }
+    }
+    done += len;
+  }
+  return GIB_SUC;
+}
+
+/* What the CPU routines code each piece with */
+struct gib_cpu_iov_args {
+  gib_context c;
+  struct gib_cpu_plan plan;
+  const unsigned char *rows;
+  int nsrc, ndst;
+};
+
+static int gib_cpu_iov_piece ( void **ptrs, int len, void *arg ) {
+  struct gib_cpu_iov_args *a = (struct gib_cpu_iov_args *)arg;
+  struct gib_cpu_plan p = a->plan;
+  /* Short pieces are not worth handing to other threads. */
+  if (len < a->c->mt_threshold)
+    p.nthreads = 1;
+  return gib_cpu_code_plan(a->c, &p, a->rows, a->nsrc,
+			   (unsigned char **)ptrs, a->ndst,
+			   (unsigned char **)ptrs + a->nsrc, len, NULL);
+}
+
+/* The XOR engine codes whole blocks, laid out from the start of each
+ * buffer, so its pieces are cut to blocks, and blocks split across
+ * segments are copied through a bounce buffer.
+ */
+static int gib_cpu_iovec ( struct iovec **shards, int *iovcnt, int buf_size,
+			   const unsigned char *rows, int nsrc, int ndst,
+			   gib_context c ) {
+  struct gib_cpu_iov_args a;
+  unsigned char *bounce = NULL;
+  int rc, unit = 1;
+  if (c->bitmatrix != NULL) {
+    unit = GIB_XOR_BLOCK;
+    if (buf_size % unit != 0) {
+      fprintf(stderr, "The XOR engine needs lengths that are a multiple of "
+	      "%i bytes.\n", GIB_XOR_BLOCK);
+      return GIB_ERR;
+    }
+    bounce = (unsigned char *)malloc((size_t)(nsrc + ndst)*unit);
+    if (bounce == NULL)
+      return GIB_OOM;
+  }
+  a.c = c;
+  gib_cpu_plan_for(c, buf_size, &a.plan);
+  a.rows = rows;
+  a.nsrc = nsrc;
+  a.ndst = ndst;
+  rc = gib_iov_walk(shards, iovcnt, nsrc + ndst, nsrc, buf_size, unit,
+		    bounce, gib_cpu_iov_piece, &a);
+  free(bounce);
+  return rc;
+}
+
+int gib_cpu_generate_iovec ( struct iovec **shards, int *iovcnt,
+			     int buf_size, gib_context c ) {
+  return gib_cpu_iovec(shards, iovcnt, buf_size, c->F, c->n, c->m, c);
+}
+
+int gib_cpu_recover_iovec ( struct iovec **shards, int *iovcnt,
+			    int buf_size, int *buf_ids, int recover_last,
+			    gib_context c ) {
+  unsigned char *rows = (unsigned char *)malloc(recover_last*c->n);
+  int rc;
+  if (rows == NULL)
+    return GIB_OOM;
+  if ((rc = gib_cpu_recovery_rows(c, buf_ids, recover_last, rows)) == 0)
+    rc = gib_cpu_iovec(shards, iovcnt, buf_size, rows, c->n, recover_last,
+		       c);
+  free(rows);
+  return rc;
+}
+
+static int gib_generate_piece ( void **ptrs, int len, void *arg ) {
+  gib_context c = (gib_context)arg;
+  return c->ops->generate_iov(ptrs, ptrs + c->n, len, c);
+}
+
+int gib_iov_generate_iovec ( struct iovec **shards, int *iovcnt,
+			     int buf_size, gib_context c ) {
+  return gib_iov_walk(shards, iovcnt, c->n + c->m, c->n, buf_size, 1, NULL,
+		      gib_generate_piece, c);
+}
+
+struct gib_recover_args {
+  gib_context c;
+  int *buf_ids;
+  int recover_last;
+};
+
+static int gib_recover_piece ( void **ptrs, int len, void *arg ) {
+  struct gib_recover_args *a = (struct gib_recover_args *)arg;
+  return a->c->ops->recover_iov(ptrs, len, a->buf_ids, a->recover_last,
+				a->c);
+}
+
+int gib_iov_recover_iovec ( struct iovec **shards, int *iovcnt,
+			    int buf_size, int *buf_ids, int recover_last,
+			    gib_context c ) {
+  struct gib_recover_args a;
+  a.c = c;
+  a.buf_ids = buf_ids;
+  a.recover_last = recover_last;
+  return gib_iov_walk(shards, iovcnt, c->n + recover_last, c->n, buf_size,
+		      1, NULL, gib_recover_piece, &a);
+}
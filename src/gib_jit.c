@@ -0,0 +1,452 @@
+/* Run-time code generation for the CPU, after the CUDA version's practice of
+ * compiling a kernel for the geometry in use.  Here the specialization goes
+ * further, to the coefficients themselves:  each routine is straight-line
+ * AVX2 code for one matrix, with zero coefficients left out, coefficients
+ * of one done as a plain XOR, and the nibble tables of the rest stored with
+ * the code and loaded relative to the instruction pointer.
+ *
+ * A routine makes one pass over 32 byte columns.  Within a column, outputs
+ * are taken nine at a time, which is as many accumulators as fit in the ymm
+ * registers alongside the source and its tables:
+ *   ymm0        source vector
+ *   ymm1, ymm2  its low and high nibbles
+ *   ymm3, ymm4  the nibble tables of the coefficient being applied
+ *   ymm5        a product
+ *   ymm6-ymm14  accumulators
+ *   ymm15       0x0f in every byte
+ */
+
+#include "../inc/gibraltar.h"
+#include "../inc/gib_galois.h"
+#include "../inc/gib_jit.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#define GIB_HAVE_JIT 1
+#include <sys/mman.h>
+#endif
+
+/* Routines other than encoding kept per context */
+#define GIB_JIT_CACHE_SIZE 64
+#define GIB_JIT_WIDTH 32
+#define GIB_JIT_GROUP 9
+
+/* Generated routines take (int len, int offset, unsigned char **src,
+ * unsigned char **dst) and code the whole columns in that range.
+ */
+typedef void (*gib_jit_fn) ( int len, int offset, unsigned char **src,
+			     unsigned char **dst );
+
+struct gib_jit_code {
+  int nsrc, ndst;
+  gib_jit_fn fn;
+  void *map;
+  size_t map_len;
+  int refs;
+  unsigned int hash;
+  unsigned long stamp;
+  unsigned char *rows; /* ndst*nsrc, to match cache entries and for tails */
+};
+
+struct gib_jit {
+  pthread_mutex_t lock;
+  const unsigned char *F;
+  struct gib_jit_code *enc;
+  struct gib_jit_code *cache[GIB_JIT_CACHE_SIZE];
+  unsigned long clock;
+};
+
+static void gib_jit_code_free ( struct gib_jit_code *k ) {
+#if GIB_HAVE_JIT
+  if (k->map != NULL)
+    munmap(k->map, k->map_len);
+#endif
+  free(k->rows);
+  free(k);
+}
+
+#if GIB_HAVE_JIT
+/* An assembler for the handful of instructions used.  Loads of the tables
+ * are recorded as fixups, and resolved once the code is done and the data
+ * placed after it.
+ */
+struct gib_jit_asm {
+  unsigned char *buf;
+  int len, cap, failed;
+  int *fix_at, *fix_to, nfix;
+};
+
+enum { GIB_JIT_MEM_COL = -1, GIB_JIT_MEM_RIP = -2 };
+
+static void gib_jit_byte ( struct gib_jit_asm *a, int b ) {
+  if (a->len == a->cap) {
+    int cap = (a->cap == 0) ? 4096 : 2*a->cap;
+    unsigned char *buf = (unsigned char *)realloc(a->buf, cap);
+    if (buf == NULL) {
+      a->failed = 1;
+      return;
+    }
+    a->buf = buf;
+    a->cap = cap;
+  }
+  a->buf[a->len++] = (unsigned char)b;
+}
+
+static void gib_jit_u32 ( struct gib_jit_asm *a, unsigned int v ) {
+  int i;
+  for (i = 0; i < 4; i++)
+    gib_jit_byte(a, (v >> 8*i) & 0xff);
+}
+
+/* A 256-bit VEX instruction with ymm registers reg and vvvv.  rm is a third
+ * register, or GIB_JIT_MEM_COL for [rax+rsi], the current column of the
+ * buffer in rax, or GIB_JIT_MEM_RIP for data at offset to in the data area.
+ * map 1 is the 0F opcode map and 2 is 0F38; pp 1 is a 66 prefix and 2 F3.
+ */
+static void gib_jit_vex ( struct gib_jit_asm *a, int map, int pp, int op,
+			  int reg, int vvvv, int rm, int to ) {
+  int b = (rm >= 8) ? 0 : 0x20;
+  gib_jit_byte(a, 0xc4);
+  gib_jit_byte(a, ((reg & 8) ? 0 : 0x80) | 0x40 | b | map);
+  gib_jit_byte(a, ((~vvvv & 15) << 3) | 0x04 | pp);
+  gib_jit_byte(a, op);
+  if (rm >= 0) {
+    gib_jit_byte(a, 0xc0 | (reg & 7) << 3 | (rm & 7));
+  } else if (rm == GIB_JIT_MEM_COL) {
+    gib_jit_byte(a, 0x04 | (reg & 7) << 3);
+    gib_jit_byte(a, 0x30); /* base rax, index rsi */
+  } else {
+    gib_jit_byte(a, 0x05 | (reg & 7) << 3);
+    a->fix_at[a->nfix] = a->len;
+    a->fix_to[a->nfix++] = to;
+    gib_jit_u32(a, 0);
+  }
+}
+
+static void gib_jit_vpxor ( struct gib_jit_asm *a, int d, int s1, int s2 ) {
+  gib_jit_vex(a, 1, 1, 0xef, d, s1, s2, 0);
+}
+
+static void gib_jit_vpand ( struct gib_jit_asm *a, int d, int s1, int s2 ) {
+  gib_jit_vex(a, 1, 1, 0xdb, d, s1, s2, 0);
+}
+
+static void gib_jit_vpshufb ( struct gib_jit_asm *a, int d, int table,
+			      int idx ) {
+  gib_jit_vex(a, 2, 1, 0x00, d, table, idx, 0);
+}
+
+static void gib_jit_vmovdqa ( struct gib_jit_asm *a, int d, int s ) {
+  gib_jit_vex(a, 1, 1, 0x6f, d, 0, s, 0);
+}
+
+static void gib_jit_vpsrlq4 ( struct gib_jit_asm *a, int d, int s ) {
+  gib_jit_vex(a, 1, 1, 0x73, 2, d, s, 0);
+  gib_jit_byte(a, 4);
+}
+
+/* mov rax, [base + disp32], where base is rdx (the sources) or rcx (the
+ * outputs)
+ */
+static void gib_jit_ptr ( struct gib_jit_asm *a, int base, int disp ) {
+  gib_jit_byte(a, 0x48);
+  gib_jit_byte(a, 0x8b);
+  gib_jit_byte(a, 0x80 | base);
+  gib_jit_u32(a, disp);
+}
+
+#define GIB_JIT_RCX 1
+#define GIB_JIT_RDX 2
+
+/* One group of outputs for the current column.  rows holds the group's
+ * coefficients, with stride nsrc, and slot the data offset of each
+ * coefficient's tables.
+ */
+static void gib_jit_group ( struct gib_jit_asm *a, const unsigned char *rows,
+			    int nsrc, int first, int count, const int *slot ) {
+  int init[GIB_JIT_GROUP] = { 0 };
+  int i, r;
+  for (i = 0; i < nsrc; i++) {
+    int any = 0, mul = 0;
+    for (r = 0; r < count; r++) {
+      unsigned char e = rows[r*nsrc + i];
+      any |= (e != 0);
+      mul |= (e > 1);
+    }
+    if (!any)
+      continue;
+    gib_jit_ptr(a, GIB_JIT_RDX, 8*i);
+    gib_jit_vex(a, 1, 2, 0x6f, 0, 0, GIB_JIT_MEM_COL, 0); /* vmovdqu */
+    if (mul) {
+      gib_jit_vpand(a, 1, 0, 15);
+      gib_jit_vpsrlq4(a, 2, 0);
+      gib_jit_vpand(a, 2, 2, 15);
+    }
+    for (r = 0; r < count; r++) {
+      unsigned char e = rows[r*nsrc + i];
+      int acc = 6 + r;
+      if (e == 0)
+	continue;
+      if (e == 1) {
+	if (init[r])
+	  gib_jit_vpxor(a, acc, acc, 0);
+	else
+	  gib_jit_vmovdqa(a, acc, 0);
+      } else {
+	/* vbroadcasti128 */
+	gib_jit_vex(a, 2, 1, 0x5a, 3, 0, GIB_JIT_MEM_RIP, slot[e]);
+	gib_jit_vex(a, 2, 1, 0x5a, 4, 0, GIB_JIT_MEM_RIP, slot[e] + 16);
+	gib_jit_vpshufb(a, 5, 3, 1);
+	if (init[r]) {
+	  gib_jit_vpxor(a, acc, acc, 5);
+	  gib_jit_vpshufb(a, 5, 4, 2);
+	  gib_jit_vpxor(a, acc, acc, 5);
+	} else {
+	  gib_jit_vpshufb(a, acc, 4, 2);
+	  gib_jit_vpxor(a, acc, acc, 5);
+	}
+      }
+      init[r] = 1;
+    }
+  }
+  for (r = 0; r < count; r++) {
+    int acc = 6 + r;
+    if (!init[r])
+      gib_jit_vpxor(a, acc, acc, acc);
+    gib_jit_ptr(a, GIB_JIT_RCX, 8*(first + r));
+    gib_jit_vex(a, 1, 2, 0x7f, acc, 0, GIB_JIT_MEM_COL, 0); /* vmovdqu */
+  }
+}
+
+static const unsigned char gib_jit_prologue[] = {
+  0x48, 0x63, 0xff,       /* movsxd rdi, edi */
+  0x48, 0x63, 0xf6,       /* movsxd rsi, esi */
+  0x48, 0x01, 0xf7        /* add rdi, rsi:  rdi is now the end */
+};
+
+static const unsigned char gib_jit_test[] = {
+  0x48, 0x8d, 0x46, GIB_JIT_WIDTH, /* lea rax, [rsi+32] */
+  0x48, 0x39, 0xf8,                /* cmp rax, rdi */
+  0x0f, 0x8f                       /* jg rel32 (to the epilogue) */
+};
+
+/* Emits the routine and its data into a, returning nonzero on failure. */
+static int gib_jit_assemble ( struct gib_jit_asm *a,
+			      const unsigned char *rows, int nsrc, int ndst ) {
+  int slot[256], ndata = 1, i, j, top, exit_at, rel, data;
+  for (i = 0; i < 256; i++)
+    slot[i] = -1;
+  /* Data slot 0 is the nibble mask, then one per coefficient over one. */
+  for (i = 0; i < nsrc*ndst; i++)
+    if (rows[i] > 1 && slot[rows[i]] < 0)
+      slot[rows[i]] = 32*ndata++;
+  a->fix_at = (int *)malloc((2*nsrc*ndst + 1)*sizeof(int));
+  a->fix_to = (int *)malloc((2*nsrc*ndst + 1)*sizeof(int));
+  if (a->fix_at == NULL || a->fix_to == NULL)
+    return 1;
+
+  for (i = 0; i < (int)sizeof(gib_jit_prologue); i++)
+    gib_jit_byte(a, gib_jit_prologue[i]);
+  gib_jit_vex(a, 1, 2, 0x6f, 15, 0, GIB_JIT_MEM_RIP, 0); /* the mask */
+  top = a->len;
+  for (i = 0; i < (int)sizeof(gib_jit_test); i++)
+    gib_jit_byte(a, gib_jit_test[i]);
+  exit_at = a->len;
+  gib_jit_u32(a, 0);
+  for (j = 0; j < ndst; j += GIB_JIT_GROUP)
+    gib_jit_group(a, rows + j*nsrc, nsrc, j,
+		  (ndst - j < GIB_JIT_GROUP) ? ndst - j : GIB_JIT_GROUP, slot);
+  gib_jit_byte(a, 0x48); /* add rsi, 32 */
+  gib_jit_byte(a, 0x83);
+  gib_jit_byte(a, 0xc6);
+  gib_jit_byte(a, GIB_JIT_WIDTH);
+  gib_jit_byte(a, 0xe9); /* jmp top */
+  gib_jit_u32(a, top - (a->len + 4));
+  if (a->failed)
+    return 1;
+  rel = a->len - (exit_at + 4);
+  memcpy(a->buf + exit_at, &rel, 4);
+  gib_jit_byte(a, 0xc5); /* vzeroupper */
+  gib_jit_byte(a, 0xf8);
+  gib_jit_byte(a, 0x77);
+  gib_jit_byte(a, 0xc3); /* ret */
+
+  /* The data, 32 byte aligned, after the code */
+  data = (a->len + 31) & ~31;
+  while (a->len < data + 32*ndata)
+    gib_jit_byte(a, 0);
+  if (a->failed)
+    return 1;
+  memset(a->buf + data, 0x0f, 32);
+  for (i = 2; i < 256; i++)
+    if (slot[i] >= 0)
+      memcpy(a->buf + data + slot[i], gib_gf_nib_table[i], 32);
+  for (i = 0; i < a->nfix; i++) {
+    rel = data + a->fix_to[i] - (a->fix_at[i] + 4);
+    memcpy(a->buf + a->fix_at[i], &rel, 4);
+  }
+  return 0;
+}
+
+static int gib_jit_supported ( void ) {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+
+static struct gib_jit_code *gib_jit_build ( const unsigned char *rows,
+					    int nsrc, int ndst ) {
+  struct gib_jit_asm a;
+  struct gib_jit_code *k;
+  memset(&a, 0, sizeof(a));
+  k = (struct gib_jit_code *)calloc(1, sizeof(*k));
+  if (k == NULL)
+    return NULL;
+  k->rows = (unsigned char *)malloc(nsrc*ndst);
+  if (k->rows != NULL && gib_jit_assemble(&a, rows, nsrc, ndst) == 0) {
+    /* Written, then made executable, never both at once */
+    k->map_len = a.len;
+    k->map = mmap(NULL, k->map_len, PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (k->map == MAP_FAILED) {
+      k->map = NULL;
+    } else {
+      memcpy(k->map, a.buf, a.len);
+      if (mprotect(k->map, k->map_len, PROT_READ | PROT_EXEC) == 0)
+	k->fn = (gib_jit_fn)k->map;
+    }
+  }
+  free(a.buf);
+  free(a.fix_at);
+  free(a.fix_to);
+  if (k->fn == NULL) {
+    gib_jit_code_free(k);
+    return NULL;
+  }
+  memcpy(k->rows, rows, nsrc*ndst);
+  k->nsrc = nsrc;
+  k->ndst = ndst;
+  k->refs = 1;
+  return k;
+}
+#else
+static int gib_jit_supported ( void ) {
+  return 0;
+}
+
+static struct gib_jit_code *gib_jit_build ( const unsigned char *rows,
+					    int nsrc, int ndst ) {
+  return NULL;
+}
+#endif
+
+int gib_jit_create ( struct gib_jit **j, gib_context c ) {
+  *j = NULL;
+  if (!gib_jit_supported())
+    return GIB_SUC;
+  *j = (struct gib_jit *)calloc(1, sizeof(**j));
+  if (*j == NULL)
+    return GIB_OOM;
+  (*j)->F = c->F;
+  (*j)->enc = gib_jit_build(c->F, c->n, c->m);
+  if ((*j)->enc == NULL) {
+    /* Most likely the system does not allow executable mappings. */
+    free(*j);
+    *j = NULL;
+    return GIB_SUC;
+  }
+  pthread_mutex_init(&(*j)->lock, NULL);
+  return GIB_SUC;
+}
+
+void gib_jit_destroy ( struct gib_jit *j ) {
+  int i;
+  for (i = 0; i < GIB_JIT_CACHE_SIZE; i++)
+    if (j->cache[i] != NULL)
+      gib_jit_code_free(j->cache[i]);
+  gib_jit_code_free(j->enc);
+  pthread_mutex_destroy(&j->lock);
+  free(j);
+}
+
+static unsigned int gib_jit_hash ( const unsigned char *rows, int nsrc,
+				   int ndst ) {
+  /* FNV-1a */
+  unsigned int h = 2166136261u;
+  int i;
+  for (i = 0; i < nsrc*ndst; i++) {
+    h ^= rows[i];
+    h *= 16777619u;
+  }
+  return h ^ (nsrc << 8) ^ ndst;
+}
+
+struct gib_jit_code *gib_jit_get ( struct gib_jit *j,
+				   const unsigned char *rows, int nsrc,
+				   int ndst ) {
+  struct gib_jit_code *k;
+  unsigned int hash;
+  int i, victim = 0;
+  if (rows == j->F && nsrc == j->enc->nsrc && ndst == j->enc->ndst)
+    return j->enc;
+  hash = gib_jit_hash(rows, nsrc, ndst);
+  pthread_mutex_lock(&j->lock);
+  for (i = 0; i < GIB_JIT_CACHE_SIZE; i++) {
+    k = j->cache[i];
+    if (k != NULL && k->hash == hash && k->nsrc == nsrc && k->ndst == ndst &&
+	memcmp(k->rows, rows, nsrc*ndst) == 0) {
+      k->refs++;
+      k->stamp = ++j->clock;
+      pthread_mutex_unlock(&j->lock);
+      return k;
+    }
+  }
+  pthread_mutex_unlock(&j->lock);
+
+  /* Generated outside the lock */
+  k = gib_jit_build(rows, nsrc, ndst);
+  if (k == NULL)
+    return NULL;
+  k->hash = hash;
+
+  pthread_mutex_lock(&j->lock);
+  for (i = 0; i < GIB_JIT_CACHE_SIZE; i++) {
+    if (j->cache[i] == NULL) {
+      victim = i;
+      break;
+    }
+    if (j->cache[i]->stamp < j->cache[victim]->stamp)
+      victim = i;
+  }
+  if (j->cache[victim] != NULL && --j->cache[victim]->refs == 0)
+    gib_jit_code_free(j->cache[victim]);
+  k->refs = 2; /* The cache's and the caller's */
+  k->stamp = ++j->clock;
+  j->cache[victim] = k;
+  pthread_mutex_unlock(&j->lock);
+  return k;
+}
+
+void gib_jit_release ( struct gib_jit *j, struct gib_jit_code *k ) {
+  if (k == j->enc)
+    return;
+  pthread_mutex_lock(&j->lock);
+  if (--k->refs == 0)
+    gib_jit_code_free(k);
+  pthread_mutex_unlock(&j->lock);
+}
+
+void gib_jit_run ( const struct gib_jit_code *k, int len, int off,
+		   unsigned char **src, unsigned char **dst ) {
+  int whole = len - len % GIB_JIT_WIDTH, b, i, r;
+  if (whole > 0)
+    k->fn(whole, off, src, dst);
+  for (b = off + whole; b < off + len; b++)
+    for (r = 0; r < k->ndst; r++) {
+      unsigned char acc = 0;
+      for (i = 0; i < k->nsrc; i++)
+	acc ^= gib_gf_table[k->rows[r*k->nsrc + i]][src[i][b]];
+      dst[r][b] = acc;
+    }
+}
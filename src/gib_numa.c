@@ -0,0 +1,122 @@
+/* NUMA topology and placement.  The topology is read once from sysfs, and
+ * the memory policy calls are made directly, so that the library does not
+ * need libnuma.
+ */
+
+#define _GNU_SOURCE /* For cpu_set_t */
+#include "../inc/gib_numa.h"
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+/* From linux/mempolicy.h */
+#define GIB_MPOL_PREFERRED 1
+#define GIB_MPOL_F_NODE 1
+#define GIB_MPOL_F_ADDR 2
+
+#ifndef GIB_NUMA_SYSFS
+#define GIB_NUMA_SYSFS "/sys/devices/system/node"
+#endif
+
+static int gib_numa_count;
+static int gib_numa_ids[GIB_NUMA_MAX_NODES];
+static cpu_set_t gib_numa_sets[GIB_NUMA_MAX_NODES];
+static pthread_once_t gib_numa_once = PTHREAD_ONCE_INIT;
+
+/* Reads a list such as "0-3,8,10-11" from path, calling add(i, arg) for
+ * each number in it.  Returns nonzero if the file could not be read.
+ */
+static int gib_numa_read_list ( const char *path,
+				void (*add) ( int i, void *arg ),
+				void *arg ) {
+  char buf[4096], *s, *end;
+  long lo, hi;
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL)
+    return 1;
+  if (fgets(buf, sizeof(buf), fp) == NULL)
+    buf[0] = '\0';
+  fclose(fp);
+  for (s = buf; *s != '\0' && *s != '\n'; s = end) {
+    lo = hi = strtol(s, &end, 10);
+    if (end == s)
+      break;
+    if (*end == '-')
+      hi = strtol(end + 1, &end, 10);
+    for (; lo <= hi; lo++)
+      add(lo, arg);
+    if (*end == ',')
+      end++;
+  }
+  return 0;
+}
+
+static void gib_numa_add_cpu ( int cpu, void *arg ) {
+  if (cpu < CPU_SETSIZE)
+    CPU_SET(cpu, (cpu_set_t *)arg);
+}
+
+static void gib_numa_add_node ( int node, void *arg ) {
+  char path[256];
+  cpu_set_t *set = &gib_numa_sets[gib_numa_count];
+  if (node < 0 || node >= GIB_NUMA_MAX_NODES)
+    return;
+  CPU_ZERO(set);
+  snprintf(path, sizeof(path), GIB_NUMA_SYSFS "/node%i/cpulist", node);
+  if (gib_numa_read_list(path, gib_numa_add_cpu, set) || CPU_COUNT(set) == 0)
+    return;
+  gib_numa_ids[gib_numa_count++] = node;
+}
+
+static void gib_numa_init ( void ) {
+  const char *env = getenv("GIB_NUMA");
+  if (env != NULL && strcmp(env, "0") == 0)
+    return;
+  if (gib_numa_read_list(GIB_NUMA_SYSFS "/online", gib_numa_add_node, NULL))
+    gib_numa_count = 0;
+}
+
+int gib_numa_nnodes ( void ) {
+  pthread_once(&gib_numa_once, gib_numa_init);
+  return (gib_numa_count > 0) ? gib_numa_count : 1;
+}
+
+int gib_numa_node ( int i ) {
+  pthread_once(&gib_numa_once, gib_numa_init);
+  return (i < gib_numa_count) ? gib_numa_ids[i] : -1;
+}
+
+void gib_numa_pin ( pthread_attr_t *attr, int node ) {
+  int i;
+  pthread_once(&gib_numa_once, gib_numa_init);
+  for (i = 0; i < gib_numa_count; i++)
+    if (gib_numa_ids[i] == node)
+      pthread_attr_setaffinity_np(attr, sizeof(cpu_set_t),
+				  &gib_numa_sets[i]);
+}
+
+int gib_numa_node_of ( const void *p ) {
+  int node = -1;
+  if (gib_numa_nnodes() < 2)
+    return -1;
+  if (syscall(SYS_get_mempolicy, &node, NULL, 0UL, p,
+	      GIB_MPOL_F_NODE | GIB_MPOL_F_ADDR) != 0)
+    return -1;
+  return node;
+}
+
+void gib_numa_prefer ( void *p, size_t len, int node ) {
+  unsigned long mask[GIB_NUMA_MAX_NODES / (8*sizeof(unsigned long))];
+  if (gib_numa_nnodes() < 2 || node < 0 || node >= GIB_NUMA_MAX_NODES)
+    return;
+  memset(mask, 0, sizeof(mask));
+  mask[node / (8*sizeof(unsigned long))] |=
+    1UL << (node % (8*sizeof(unsigned long)));
+  /* A failure only costs locality, so it is ignored. */
+  syscall(SYS_mbind, p, len, GIB_MPOL_PREFERRED, mask,
+	  (unsigned long)GIB_NUMA_MAX_NODES + 1, 0U);
+}
@@ -0,0 +1,268 @@
+/* A small fixed-size pool of worker threads.  Work is handed out as batches
+ * of numbered tasks.  Batches are queued in the order they were submitted,
+ * and a worker always takes the next unclaimed task of the oldest batch.
+ * Tasks are expected to be coarse (a range of columns of a stripe), so a
+ * single mutex protects the queue.
+ *
+ * On NUMA machines the workers are spread across the nodes and pinned to
+ * them, and a batch can be routed to a node:  only that node's workers (and
+ * the thread running the batch) take its tasks, so that they work on local
+ * memory.  Batches for a node the pool has no workers on go to any worker.
+ */
+
+#include "../inc/gib_pool.h"
+#include "../inc/gibraltar.h" /* For error codes */
+#include "../inc/gib_numa.h"
+#include <stdlib.h>
+#include <pthread.h>
+
+/* The least stack a worker is given.  Coding keeps up to 64 KiB of XOR
+ * temporaries on the stack, and some C libraries start threads with as
+ * little as 128 KiB.
+ */
+#define GIB_POOL_STACK (1 << 20)
+
+struct gib_batch {
+  gib_task_fn fn;
+  void *arg;
+  int ntasks;
+  int node;     /* The node whose workers take it, or -1 for any */
+  int next;     /* Next task to hand out */
+  int pending;  /* Tasks handed out or not, but not yet finished */
+  int detached; /* Nobody waits; the last worker frees the batch */
+  pthread_cond_t done;
+  struct gib_batch *link;
+};
+
+struct gib_worker {
+  struct gib_pool *pool;
+  int node; /* -1 unless pinned */
+  pthread_t thread;
+};
+
+struct gib_pool {
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  struct gib_batch *head, *tail;
+  int shutdown;
+  int nworkers;
+  struct gib_worker *workers;
+  /* Workers pinned to each node, and the nodes that have any */
+  int node_workers[GIB_NUMA_MAX_NODES];
+  int nodes[GIB_NUMA_MAX_NODES];
+  int nnodes;
+  unsigned int next_node;
+};
+
+/* Whether a worker on node may take tasks of b */
+static int gib_pool_may_take ( struct gib_pool *pool, struct gib_batch *b,
+			       int node ) {
+  return b->node < 0 || b->node == node || b->node >= GIB_NUMA_MAX_NODES ||
+    pool->node_workers[b->node] == 0;
+}
+
+/* The oldest batch with tasks left that a worker on node may take, or NULL.
+ * Called with the lock held.
+ */
+static struct gib_batch *gib_pool_find ( struct gib_pool *pool, int node ) {
+  struct gib_batch *b;
+  for (b = pool->head; b != NULL; b = b->link)
+    if (gib_pool_may_take(pool, b, node))
+      return b;
+  return NULL;
+}
+
+/* Takes b off the queue.  Called with the lock held. */
+static void gib_pool_unlink ( struct gib_pool *pool, struct gib_batch *b ) {
+  struct gib_batch **pp = &pool->head, *prev = NULL;
+  while (*pp != b) {
+    prev = *pp;
+    pp = &(*pp)->link;
+  }
+  *pp = b->link;
+  if (pool->tail == b)
+    pool->tail = prev;
+}
+
+/* Claims the next task of b, taking b off the queue once all of its tasks
+ * are handed out.  Called with the lock held.
+ */
+static int gib_pool_claim ( struct gib_pool *pool, struct gib_batch *b ) {
+  int task = b->next++;
+  if (b->next == b->ntasks)
+    gib_pool_unlink(pool, b);
+  return task;
+}
+
+/* Queues b and wakes the workers.  Called with the lock held.  With
+ * batches routed to nodes, the worker a signal would wake might not be
+ * allowed to take b, so every worker is woken.
+ */
+static void gib_pool_queue ( struct gib_pool *pool, struct gib_batch *b ) {
+  if (pool->tail != NULL)
+    pool->tail->link = b;
+  else
+    pool->head = b;
+  pool->tail = b;
+  pthread_cond_broadcast(&pool->work);
+}
+
+/* Marks a task of b finished and returns nonzero if it was the last one.
+ * Called with the lock held.
+ */
+static int gib_pool_finish ( struct gib_batch *b ) {
+  if (--b->pending > 0)
+    return 0;
+  if (!b->detached)
+    pthread_cond_signal(&b->done);
+  return 1;
+}
+
+static void *gib_pool_worker ( void *arg ) {
+  struct gib_worker *w = (struct gib_worker *)arg;
+  struct gib_pool *pool = w->pool;
+  struct gib_batch *b;
+  int task;
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while ((b = gib_pool_find(pool, w->node)) == NULL && !pool->shutdown)
+      pthread_cond_wait(&pool->work, &pool->lock);
+    if (b == NULL)
+      break;
+    task = gib_pool_claim(pool, b);
+    pthread_mutex_unlock(&pool->lock);
+    b->fn(b->arg, task);
+    pthread_mutex_lock(&pool->lock);
+    if (gib_pool_finish(b) && b->detached)
+      free(b);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+int gib_pool_create ( struct gib_pool **pool, int nworkers ) {
+  struct gib_pool *p;
+  pthread_attr_t attr;
+  size_t stack;
+  int i, node, nnodes = gib_numa_nnodes();
+
+  p = (struct gib_pool *)calloc(1, sizeof(struct gib_pool));
+  if (p == NULL)
+    return GIB_OOM;
+  p->workers = (struct gib_worker *)malloc(nworkers*sizeof(*p->workers));
+  if (p->workers == NULL) {
+    free(p);
+    return GIB_OOM;
+  }
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->work, NULL);
+  for (i = 0; i < nworkers; i++) {
+    struct gib_worker *w = &p->workers[p->nworkers];
+    /* Round-robin across the nodes, so each gets a share of the workers */
+    node = (nnodes > 1) ? gib_numa_node(i % nnodes) : -1;
+    w->pool = p;
+    w->node = node;
+    pthread_attr_init(&attr);
+    if (pthread_attr_getstacksize(&attr, &stack) == 0 &&
+	stack < GIB_POOL_STACK)
+      pthread_attr_setstacksize(&attr, GIB_POOL_STACK);
+    if (node >= 0)
+      gib_numa_pin(&attr, node);
+    if (pthread_create(&w->thread, &attr, gib_pool_worker, w)) {
+      pthread_attr_destroy(&attr);
+      break;
+    }
+    pthread_attr_destroy(&attr);
+    p->nworkers++;
+    if (node >= 0 && p->node_workers[node]++ == 0)
+      p->nodes[p->nnodes++] = node;
+  }
+  if (p->nworkers == 0) {
+    gib_pool_destroy(p);
+    return GIB_ERR;
+  }
+  *pool = p;
+  return GIB_SUC;
+}
+
+void gib_pool_destroy ( struct gib_pool *pool ) {
+  int i;
+  pthread_mutex_lock(&pool->lock);
+  pool->shutdown = 1;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+  for (i = 0; i < pool->nworkers; i++)
+    pthread_join(pool->workers[i].thread, NULL);
+  pthread_cond_destroy(&pool->work);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->workers);
+  free(pool);
+}
+
+int gib_pool_next_node ( struct gib_pool *pool ) {
+  int node;
+  if (pool == NULL || pool->nnodes < 2)
+    return -1;
+  pthread_mutex_lock(&pool->lock);
+  node = pool->nodes[pool->next_node++ % pool->nnodes];
+  pthread_mutex_unlock(&pool->lock);
+  return node;
+}
+
+void gib_pool_run ( struct gib_pool *pool, int node, int ntasks,
+		    gib_task_fn fn, void *arg ) {
+  struct gib_batch b;
+  int task;
+
+  if (ntasks <= 0)
+    return;
+  b.fn = fn;
+  b.arg = arg;
+  b.ntasks = ntasks;
+  b.node = node;
+  b.next = 0;
+  b.pending = ntasks;
+  b.detached = 0;
+  b.link = NULL;
+  pthread_cond_init(&b.done, NULL);
+
+  pthread_mutex_lock(&pool->lock);
+  gib_pool_queue(pool, &b);
+
+  /* Help with our own batch until every task has been handed out, then wait
+   * for the ones still running elsewhere.
+   */
+  while (b.next < b.ntasks) {
+    /* Older batches may be ahead of ours; only take from our own. */
+    task = gib_pool_claim(pool, &b);
+    pthread_mutex_unlock(&pool->lock);
+    fn(arg, task);
+    pthread_mutex_lock(&pool->lock);
+    gib_pool_finish(&b);
+  }
+  while (b.pending > 0)
+    pthread_cond_wait(&b.done, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+  pthread_cond_destroy(&b.done);
+}
+
+int gib_pool_submit ( struct gib_pool *pool, int node, gib_task_fn fn,
+		      void *arg ) {
+  struct gib_batch *b = (struct gib_batch *)malloc(sizeof(struct gib_batch));
+  if (b == NULL)
+    return GIB_OOM;
+  b->fn = fn;
+  b->arg = arg;
+  b->ntasks = 1;
+  b->node = node;
+  b->next = 0;
+  b->pending = 1;
+  b->detached = 1;
+  b->link = NULL;
+
+  pthread_mutex_lock(&pool->lock);
+  gib_pool_queue(pool, b);
+  pthread_mutex_unlock(&pool->lock);
+  return GIB_SUC;
+}
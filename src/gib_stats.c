@@ -0,0 +1,171 @@
+/* Per-context counters.  Every thread that codes for a context gets its own
+ * block of counters, which only it writes, so counting is a plain add with
+ * no lock or atomic read-modify-write.  A few recently used blocks are
+ * remembered in thread-local storage.  gib_get_stats adds up the blocks,
+ * and gib_reset_stats records the totals it will subtract from then on, so
+ * that readers never have to write another thread's block.
+ */
+
+#include "../inc/gibraltar.h"
+#include "../inc/gib_stats.h"
+#include "../inc/gib_cpu_funcs.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+struct gib_stats_block {
+  _Atomic unsigned long v[GIB_STAT_COUNT];
+  struct gib_stats_block *next;
+  const void *owner; /* Identifies the thread writing it */
+};
+
+struct gib_stats_set {
+  unsigned long serial; /* Never reused, unlike the set's address */
+  pthread_mutex_t lock;
+  struct gib_stats_block *blocks;
+  unsigned long base[GIB_STAT_COUNT]; /* The totals at the last reset */
+};
+
+static atomic_ulong gib_stats_serial = 1;
+
+/* Direct-mapped by serial.  A slot that was taken by another context is
+ * refilled from that context's list, so a thread keeps one block per
+ * context however the slots collide.
+ */
+#define GIB_STATS_TLS_SLOTS 4
+static __thread struct {
+  unsigned long serial;
+  struct gib_stats_block *block;
+} gib_stats_tls[GIB_STATS_TLS_SLOTS];
+/* Its address tells live threads apart. */
+static __thread char gib_stats_me;
+
+int gib_stats_create ( struct gib_stats_set **s ) {
+  *s = (struct gib_stats_set *)calloc(1, sizeof(struct gib_stats_set));
+  if (*s == NULL)
+    return GIB_OOM;
+  (*s)->serial = atomic_fetch_add(&gib_stats_serial, 1);
+  pthread_mutex_init(&(*s)->lock, NULL);
+  return GIB_SUC;
+}
+
+void gib_stats_destroy ( struct gib_stats_set *s ) {
+  struct gib_stats_block *b, *next;
+  if (s == NULL)
+    return;
+  for (b = s->blocks; b != NULL; b = next) {
+    next = b->next;
+    free(b);
+  }
+  pthread_mutex_destroy(&s->lock);
+  free(s);
+}
+
+/* Finds or makes the calling thread's block.  Blocks are cache-line
+ * aligned so that threads do not share lines.
+ */
+static struct gib_stats_block *gib_stats_block ( struct gib_stats_set *s ) {
+  struct gib_stats_block *b;
+  void *mem;
+  pthread_mutex_lock(&s->lock);
+  for (b = s->blocks; b != NULL; b = b->next)
+    if (b->owner == &gib_stats_me)
+      break;
+  if (b == NULL && posix_memalign(&mem, 64, sizeof(*b)) == 0) {
+    b = (struct gib_stats_block *)mem;
+    memset(b, 0, sizeof(*b));
+    b->owner = &gib_stats_me;
+    b->next = s->blocks;
+    s->blocks = b;
+  }
+  pthread_mutex_unlock(&s->lock);
+  return b;
+}
+
+void gib_stats_add ( gib_context c, int stat, unsigned long v ) {
+  struct gib_stats_set *s = c->stats;
+  struct gib_stats_block *b;
+  int slot;
+  if (s == NULL)
+    return;
+  slot = s->serial % GIB_STATS_TLS_SLOTS;
+  if (gib_stats_tls[slot].serial != s->serial) {
+    if ((b = gib_stats_block(s)) == NULL)
+      return;
+    gib_stats_tls[slot].serial = s->serial;
+    gib_stats_tls[slot].block = b;
+  }
+  b = gib_stats_tls[slot].block;
+  /* Only this thread writes the counter, so a relaxed load and store is
+   * enough to keep readers from seeing a torn value.
+   */
+  atomic_store_explicit(&b->v[stat],
+			atomic_load_explicit(&b->v[stat],
+					     memory_order_relaxed) + v,
+			memory_order_relaxed);
+}
+
+unsigned long gib_stats_ns ( void ) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000000ul + ts.tv_nsec;
+}
+
+/* Must be called with the set's lock held */
+static void gib_stats_sum ( struct gib_stats_set *s, unsigned long *v ) {
+  struct gib_stats_block *b;
+  int i;
+  memset(v, 0, GIB_STAT_COUNT*sizeof(*v));
+  for (b = s->blocks; b != NULL; b = b->next)
+    for (i = 0; i < GIB_STAT_COUNT; i++)
+      v[i] += atomic_load_explicit(&b->v[i], memory_order_relaxed);
+}
+
+int gib_get_stats ( gib_context c, struct gib_stats *stats ) {
+  unsigned long v[GIB_STAT_COUNT];
+  const struct gib_cpu_kernel *k;
+  int i;
+  memset(stats, 0, sizeof(*stats));
+  if (c->stats == NULL)
+    return GIB_ERR;
+  pthread_mutex_lock(&c->stats->lock);
+  gib_stats_sum(c->stats, v);
+  for (i = 0; i < GIB_STAT_COUNT; i++)
+    v[i] -= c->stats->base[i];
+  pthread_mutex_unlock(&c->stats->lock);
+
+  stats->generate_calls = v[GIB_STAT_GENERATE_CALLS];
+  stats->recover_calls = v[GIB_STAT_RECOVER_CALLS];
+  stats->update_calls = v[GIB_STAT_UPDATE_CALLS];
+  stats->bytes_encoded = v[GIB_STAT_BYTES_ENCODED];
+  stats->bytes_recovered = v[GIB_STAT_BYTES_RECOVERED];
+  stats->setup_ns = v[GIB_STAT_SETUP_NS];
+  stats->kernel_ns = v[GIB_STAT_KERNEL_NS];
+  stats->dcache_hits = v[GIB_STAT_DC_HITS];
+  stats->dcache_misses = v[GIB_STAT_DC_MISSES];
+  stats->passes = v[GIB_STAT_PASSES];
+  stats->mt_passes = v[GIB_STAT_MT_PASSES];
+  stats->mt_tasks = v[GIB_STAT_MT_TASKS];
+  for (k = gib_cpu_kernels, i = 0; k->name != NULL; k++, i++) {
+    stats->variant_names[stats->nvariants] = k->name;
+    stats->variant_passes[stats->nvariants++] = v[GIB_STAT_VARIANT + i];
+  }
+  stats->variant_names[stats->nvariants] = "jit";
+  stats->variant_passes[stats->nvariants++] =
+    v[GIB_STAT_VARIANT + GIB_STAT_VARIANT_JIT];
+  stats->variant_names[stats->nvariants] = "xor";
+  stats->variant_passes[stats->nvariants++] =
+    v[GIB_STAT_VARIANT + GIB_STAT_VARIANT_XOR];
+  return GIB_SUC;
+}
+
+int gib_reset_stats ( gib_context c ) {
+  if (c->stats == NULL)
+    return GIB_ERR;
+  pthread_mutex_lock(&c->stats->lock);
+  gib_stats_sum(c->stats, c->stats->base);
+  pthread_mutex_unlock(&c->stats->lock);
+  return GIB_SUC;
+}
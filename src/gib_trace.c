@@ -0,0 +1,187 @@
+/* Phase tracing.  Each thread records its events in a ring of its own,
+ * which it alone writes:  an event is stored in the next slot and then
+ * published by a release store of the ring's head, so recording takes no
+ * lock.  Once a ring is full the oldest events are overwritten.  Rings are
+ * made on a thread's first event and kept until the process exits, so that
+ * a dump still has the events of threads that have finished.
+ *
+ * gib_trace_dump copies each ring from the head it reads, then drops the
+ * copied events that the owner may have overwritten meanwhile, and writes
+ * what is left in the Chrome trace event format, which chrome://tracing
+ * and Perfetto load.
+ */
+
+#include "../inc/gibraltar.h"
+#include "../inc/gib_trace.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/syscall.h>
+
+/* Events kept per thread; a power of two */
+#define GIB_TRACE_RING (64*1024)
+
+struct gib_trace_rec {
+  unsigned long ns;
+  long arg;
+  int phase;
+  char type;
+};
+
+struct gib_trace_ring {
+  _Atomic unsigned long head;  /* Events ever recorded */
+  unsigned long since;         /* The head when tracing last started */
+  long tid;
+  struct gib_trace_ring *next;
+  struct gib_trace_rec recs[GIB_TRACE_RING];
+};
+
+int gib_trace_on = 0;
+
+static const char *const gib_trace_names[] = {
+#define GIB_TRACE_NAME(ph) #ph,
+  GIB_TRACE_PHASES(GIB_TRACE_NAME)
+#undef GIB_TRACE_NAME
+};
+
+static struct gib_trace_ring *_Atomic gib_trace_rings;
+static __thread struct gib_trace_ring *gib_trace_mine;
+/* Serializes starting and dumping, never recording */
+static pthread_mutex_t gib_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t gib_trace_once = PTHREAD_ONCE_INIT;
+static char *gib_trace_path;
+
+static struct gib_trace_ring *gib_trace_ring_new ( void ) {
+  struct gib_trace_ring *r;
+  r = (struct gib_trace_ring *)malloc(sizeof(struct gib_trace_ring));
+  if (r == NULL)
+    return NULL;
+  atomic_init(&r->head, 0);
+  r->since = 0;
+  r->tid = syscall(SYS_gettid);
+  r->next = atomic_load(&gib_trace_rings);
+  while (!atomic_compare_exchange_weak(&gib_trace_rings, &r->next, r))
+    ;
+  return r;
+}
+
+void gib_trace_event ( int phase, char type, long arg ) {
+  struct gib_trace_ring *r = gib_trace_mine;
+  struct gib_trace_rec *rec;
+  struct timespec ts;
+  unsigned long head;
+  if (r == NULL && (r = gib_trace_mine = gib_trace_ring_new()) == NULL)
+    return;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  rec = &r->recs[head % GIB_TRACE_RING];
+  rec->ns = ts.tv_sec*1000000000ul + ts.tv_nsec;
+  rec->arg = arg;
+  rec->phase = phase;
+  rec->type = type;
+  atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+int gib_trace_start ( void ) {
+  struct gib_trace_ring *r;
+  pthread_mutex_lock(&gib_trace_lock);
+  for (r = atomic_load(&gib_trace_rings); r != NULL; r = r->next)
+    r->since = atomic_load_explicit(&r->head, memory_order_acquire);
+  __atomic_store_n(&gib_trace_on, 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&gib_trace_lock);
+  return GIB_SUC;
+}
+
+int gib_trace_stop ( void ) {
+  __atomic_store_n(&gib_trace_on, 0, __ATOMIC_RELEASE);
+  return GIB_SUC;
+}
+
+/* Copies the events of r that are still intact into recs, returning how
+ * many there are.
+ */
+static unsigned long gib_trace_copy ( struct gib_trace_ring *r,
+				      struct gib_trace_rec *recs ) {
+  unsigned long head, lo, i;
+  head = atomic_load_explicit(&r->head, memory_order_acquire);
+  lo = (head > GIB_TRACE_RING) ? head - GIB_TRACE_RING : 0;
+  if (lo < r->since)
+    lo = r->since;
+  for (i = lo; i < head; i++)
+    recs[i - lo] = r->recs[i % GIB_TRACE_RING];
+  atomic_thread_fence(memory_order_acquire);
+  /* The slot of event h is also that of event h-GIB_TRACE_RING, so any
+   * copied event at or before the new head less the ring's size may have
+   * been overwritten while it was copied.
+   */
+  i = atomic_load_explicit(&r->head, memory_order_relaxed);
+  if (i >= GIB_TRACE_RING && i - GIB_TRACE_RING + 1 > lo) {
+    unsigned long skip = i - GIB_TRACE_RING + 1 - lo;
+    if (skip >= head - lo)
+      return 0;
+    memmove(recs, recs + skip, (head - lo - skip)*sizeof(*recs));
+    lo += skip;
+  }
+  return head - lo;
+}
+
+int gib_trace_dump ( const char *path ) {
+  struct gib_trace_ring *r;
+  struct gib_trace_rec *recs;
+  unsigned long i, nrecs;
+  int first = 1, pid = getpid();
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL) {
+    perror(path);
+    return GIB_ERR;
+  }
+  recs = (struct gib_trace_rec *)malloc(GIB_TRACE_RING*sizeof(*recs));
+  if (recs == NULL) {
+    fclose(fp);
+    return GIB_OOM;
+  }
+  pthread_mutex_lock(&gib_trace_lock);
+  fprintf(fp, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+  for (r = atomic_load(&gib_trace_rings); r != NULL; r = r->next) {
+    nrecs = gib_trace_copy(r, recs);
+    for (i = 0; i < nrecs; i++) {
+      fprintf(fp, "%s{\"name\": \"%s\", \"cat\": \"gibraltar\", "
+	      "\"ph\": \"%c\", \"pid\": %i, \"tid\": %li, \"ts\": %.3f, "
+	      "\"args\": {\"arg\": %li}}", first ? "" : ",\n",
+	      gib_trace_names[recs[i].phase], recs[i].type, pid, r->tid,
+	      recs[i].ns/1000.0, recs[i].arg);
+      first = 0;
+    }
+  }
+  fprintf(fp, "\n]}\n");
+  pthread_mutex_unlock(&gib_trace_lock);
+  free(recs);
+  if (fclose(fp) != 0) {
+    perror(path);
+    return GIB_ERR;
+  }
+  return GIB_SUC;
+}
+
+static void gib_trace_atexit ( void ) {
+  gib_trace_stop();
+  gib_trace_dump(gib_trace_path);
+}
+
+static void gib_trace_env_once ( void ) {
+  const char *path = getenv("GIB_TRACE");
+  if (path == NULL || path[0] == '\0')
+    return;
+  if ((gib_trace_path = strdup(path)) == NULL)
+    return;
+  atexit(gib_trace_atexit);
+  gib_trace_start();
+}
+
+void gib_trace_env ( void ) {
+  pthread_once(&gib_trace_once, gib_trace_env_once);
+}
@@ -0,0 +1,319 @@
+/* The CPU tuner.  The best kernel, tile size and thread count depend on the
+ * processor's vector units, caches and cores, so no single default suits
+ * every host.  For each class of call sizes, a stripe of that size is coded
+ * with the context's defaults, and then the kernel, the tile size and the
+ * thread count are varied in turn, keeping whatever is faster.  The plans
+ * are saved under GIB_CACHE_DIR, in the spirit of the GPU's compiled
+ * kernels, and are timed again only if the file is missing or was written
+ * on another kind of host.
+ */
+
+#include "../inc/gibraltar.h"
+#include "../inc/gib_tune.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#define GIB_HAVE_CPUID 1
+#endif
+
+/* Bytes per buffer timed for each class, cut down so the stripe stays
+ * under GIB_TUNE_MAX_STRIPE bytes in all.
+ */
+static const int gib_tune_sizes[GIB_TUNE_CLASSES] = {
+  8*1024, 64*1024, 1024*1024, 8*1024*1024
+};
+#define GIB_TUNE_MAX_STRIPE (64*1024*1024)
+/* Multiple of every length the engines need */
+#define GIB_TUNE_ALIGN 4096
+
+/* Tile sizes tried besides the context's */
+static const int gib_tune_tiles[] = { 4096, 8192, 16384, 32768, 65536, 0 };
+/* Saved tiles must be one the CPU routines could have chosen themselves:
+ * a multiple of GIB_TUNE_TILE_MIN from it up to GIB_TUNE_TILE_MAX.  The
+ * context's default, which is often kept, is only a multiple of 1 KiB.
+ */
+#define GIB_TUNE_TILE_MIN 1024
+#define GIB_TUNE_TILE_MAX (64*1024)
+
+/* Each candidate is run at least this many times and for at least this
+ * many seconds, and its fastest run is the one compared.
+ */
+#define GIB_TUNE_MIN_RUNS 2
+#define GIB_TUNE_MIN_TIME 0.005
+
+/* Saved plans start with this and the host, followed by the kernel name,
+ * tile size and thread count of each class.
+ */
+static const char gib_tune_magic[8] = "GIBTN01";
+#define GIB_TUNE_HOST_LEN 64
+#define GIB_TUNE_NAME_LEN 16
+
+int gib_tune_class ( int len ) {
+  if (len < 16*1024)
+    return 0;
+  if (len < 256*1024)
+    return 1;
+  if (len < 4*1024*1024)
+    return 2;
+  return 3;
+}
+
+static double gib_tune_now ( void ) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+/* The processor's brand string and the number of processors online, which
+ * is enough to tell a cache directory shared across a mixed fleet apart.
+ */
+static void gib_tune_host ( char *host ) {
+  memset(host, 0, GIB_TUNE_HOST_LEN);
+#if GIB_HAVE_CPUID
+  unsigned int brand[12];
+  int i;
+  if (__get_cpuid_max(0x80000000, NULL) >= 0x80000004) {
+    for (i = 0; i < 3; i++)
+      __get_cpuid(0x80000002 + i, &brand[4*i], &brand[4*i+1],
+		  &brand[4*i+2], &brand[4*i+3]);
+    memcpy(host, brand, sizeof(brand));
+  }
+#endif
+  snprintf(host + 48, GIB_TUNE_HOST_LEN - 48, "%ld",
+	   sysconf(_SC_NPROCESSORS_ONLN));
+}
+
+/* Returns the fastest time to encode len bytes per buffer with p, or a
+ * negative value if p cannot code it.
+ */
+static double gib_tune_time ( gib_context c, const struct gib_cpu_plan *p,
+			      unsigned char **src, unsigned char **dst,
+			      int len ) {
+  double best = -1, total = 0, start, t;
+  int runs;
+  for (runs = 0; runs < GIB_TUNE_MIN_RUNS || total < GIB_TUNE_MIN_TIME;
+       runs++) {
+    start = gib_tune_now();
+    if (gib_cpu_code_plan(c, p, c->F, c->n, src, c->m, dst, len, NULL))
+      return -1;
+    t = gib_tune_now() - start;
+    total += t;
+    if (best < 0 || t < best)
+      best = t;
+  }
+  return best;
+}
+
+static void gib_tune_try ( gib_context c, const struct gib_cpu_plan *p,
+			   unsigned char **src, unsigned char **dst, int len,
+			   struct gib_cpu_plan *best, double *best_t ) {
+  double t = gib_tune_time(c, p, src, dst, len);
+  if (t >= 0 && (*best_t < 0 || t < *best_t)) {
+    *best = *p;
+    *best_t = t;
+  }
+}
+
+static void gib_tune_plan ( gib_context c, unsigned char **src,
+			    unsigned char **dst, int len,
+			    struct gib_cpu_plan *best ) {
+  const struct gib_cpu_kernel *k;
+  struct gib_cpu_plan p;
+  double best_t;
+  int i, nt;
+
+  best->kernel = c->kernel;
+  best->tile_size = c->tile_size;
+  best->nthreads = 1;
+  best_t = gib_tune_time(c, best, src, dst, len);
+
+  /* The XOR and JIT engines do not use the kernels, and a kernel named in
+   * GIB_CPU_KERNEL is kept.
+   */
+  if (c->bitmatrix == NULL && c->jit == NULL &&
+      getenv("GIB_CPU_KERNEL") == NULL) {
+    for (k = gib_cpu_kernels; k->name != NULL; k++) {
+      if (k == c->kernel || !k->supported())
+	continue;
+      p = *best;
+      p.kernel = k;
+      gib_tune_try(c, &p, src, dst, len, best, &best_t);
+    }
+  }
+  for (i = 0; gib_tune_tiles[i] != 0; i++) {
+    if (gib_tune_tiles[i] == c->tile_size || gib_tune_tiles[i] > len)
+      continue;
+    p = *best;
+    p.tile_size = gib_tune_tiles[i];
+    gib_tune_try(c, &p, src, dst, len, best, &best_t);
+  }
+  /* Powers of two, and all of the context's threads */
+  for (nt = 2; c->pool != NULL; nt *= 2) {
+    if (nt > c->nthreads)
+      nt = c->nthreads;
+    p = *best;
+    p.nthreads = nt;
+    gib_tune_try(c, &p, src, dst, len, best, &best_t);
+    if (nt == c->nthreads)
+      break;
+  }
+}
+
+static int gib_tune_run ( struct gib_tune *t, gib_context c ) {
+  unsigned char *stripe, *src[256], *dst[256];
+  int sizes[GIB_TUNE_CLASSES];
+  int i, cls, max_size = 0, nbufs = c->n + c->m;
+
+  for (cls = 0; cls < GIB_TUNE_CLASSES; cls++) {
+    sizes[cls] = gib_tune_sizes[cls];
+    if (sizes[cls] > GIB_TUNE_MAX_STRIPE / nbufs)
+      sizes[cls] = GIB_TUNE_MAX_STRIPE / nbufs;
+    sizes[cls] -= sizes[cls] % GIB_TUNE_ALIGN;
+    if (sizes[cls] < GIB_TUNE_ALIGN)
+      sizes[cls] = GIB_TUNE_ALIGN;
+    if (sizes[cls] > max_size)
+      max_size = sizes[cls];
+  }
+  stripe = (unsigned char *)malloc((size_t)nbufs*max_size);
+  if (stripe == NULL)
+    return GIB_OOM;
+  for (i = 0; i < c->n*max_size; i++)
+    stripe[i] = (unsigned char)(i*2654435761u >> 13);
+
+  for (cls = 0; cls < GIB_TUNE_CLASSES; cls++) {
+    for (i = 0; i < c->n; i++)
+      src[i] = stripe + i*sizes[cls];
+    for (i = 0; i < c->m; i++)
+      dst[i] = stripe + (c->n+i)*sizes[cls];
+    gib_tune_plan(c, src, dst, sizes[cls], &t->plans[cls]);
+  }
+  free(stripe);
+  return GIB_SUC;
+}
+
+static int gib_tune_load ( struct gib_tune *t, gib_context c,
+			   const char *path ) {
+  char magic[sizeof(gib_tune_magic)];
+  char host[GIB_TUNE_HOST_LEN], saved[GIB_TUNE_HOST_LEN];
+  char name[GIB_TUNE_NAME_LEN];
+  const struct gib_cpu_kernel *k;
+  struct gib_cpu_plan *p;
+  int cls;
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL)
+    return GIB_ERR;
+  gib_tune_host(host);
+  if (fread(magic, sizeof(magic), 1, fp) != 1 ||
+      memcmp(magic, gib_tune_magic, sizeof(magic)) ||
+      fread(saved, sizeof(saved), 1, fp) != 1 ||
+      memcmp(saved, host, sizeof(host))) {
+    fclose(fp);
+    return GIB_ERR;
+  }
+  for (cls = 0; cls < GIB_TUNE_CLASSES; cls++) {
+    p = &t->plans[cls];
+    if (fread(name, sizeof(name), 1, fp) != 1 ||
+	fread(&p->tile_size, sizeof(int), 1, fp) != 1 ||
+	fread(&p->nthreads, sizeof(int), 1, fp) != 1)
+      break;
+    name[sizeof(name) - 1] = '\0';
+    for (k = gib_cpu_kernels; k->name != NULL; k++)
+      if (strcmp(k->name, name) == 0)
+	break;
+    if (k->name == NULL || !k->supported() ||
+	p->tile_size < GIB_TUNE_TILE_MIN || p->tile_size > GIB_TUNE_TILE_MAX ||
+	p->tile_size % GIB_TUNE_TILE_MIN != 0 || p->nthreads < 1 ||
+	p->nthreads > c->nthreads)
+      break;
+    p->kernel = k;
+  }
+  fclose(fp);
+  return (cls == GIB_TUNE_CLASSES) ? GIB_SUC : GIB_ERR;
+}
+
+/* Written aside and renamed into place, so that a process loading the
+ * plans never sees half of them.
+ */
+static int gib_tune_save ( const struct gib_tune *t, const char *path ) {
+  char host[GIB_TUNE_HOST_LEN], name[GIB_TUNE_NAME_LEN];
+  char *tmp = (char *)malloc(strlen(path) + 32);
+  const struct gib_cpu_plan *p;
+  int cls, ok;
+  FILE *fp;
+  if (tmp == NULL)
+    return GIB_OOM;
+  sprintf(tmp, "%s.%ld", path, (long)getpid());
+  fp = fopen(tmp, "wb");
+  if (fp == NULL) {
+    free(tmp);
+    return GIB_ERR;
+  }
+  gib_tune_host(host);
+  ok = fwrite(gib_tune_magic, sizeof(gib_tune_magic), 1, fp) == 1 &&
+    fwrite(host, sizeof(host), 1, fp) == 1;
+  for (cls = 0; ok && cls < GIB_TUNE_CLASSES; cls++) {
+    p = &t->plans[cls];
+    memset(name, 0, sizeof(name));
+    strncpy(name, p->kernel->name, sizeof(name) - 1);
+    ok = fwrite(name, sizeof(name), 1, fp) == 1 &&
+      fwrite(&p->tile_size, sizeof(int), 1, fp) == 1 &&
+      fwrite(&p->nthreads, sizeof(int), 1, fp) == 1;
+  }
+  if (fclose(fp) != 0)
+    ok = 0;
+  if (ok && rename(tmp, path) != 0)
+    ok = 0;
+  if (!ok)
+    remove(tmp);
+  free(tmp);
+  return ok ? GIB_SUC : GIB_ERR;
+}
+
+int gib_tune_create ( struct gib_tune **t, gib_context c ) {
+  const char *dir = getenv("GIB_CACHE_DIR");
+  char *path = NULL;
+  int rc, engine = GIB_ENGINE_TABLE;
+
+  *t = (struct gib_tune *)malloc(sizeof(struct gib_tune));
+  if (*t == NULL)
+    return GIB_OOM;
+  if (c->bitmatrix != NULL)
+    engine = GIB_ENGINE_XOR;
+  else if (c->jit != NULL)
+    engine = GIB_ENGINE_JIT;
+
+  /* Plans differ by shape, engine and thread budget. */
+  if (dir != NULL) {
+    path = (char *)malloc(strlen(dir) + 64);
+    if (path == NULL) {
+      free(*t);
+      *t = NULL;
+      return GIB_OOM;
+    }
+    sprintf(path, "%s/gib_cpu_%i+%i_e%i_t%i.tune", dir, c->n, c->m, engine,
+	    c->nthreads);
+    if (gib_tune_load(*t, c, path) == GIB_SUC) {
+      free(path);
+      return GIB_SUC;
+    }
+  }
+  if ((rc = gib_tune_run(*t, c))) {
+    free(path);
+    free(*t);
+    *t = NULL;
+    return rc;
+  }
+  if (path != NULL && gib_tune_save(*t, path) != GIB_SUC)
+    fprintf(stderr, "The tuned plans could not be saved to %s.\n", path);
+  free(path);
+  return GIB_SUC;
+}
+
+void gib_tune_destroy ( struct gib_tune *t ) {
+  free(t);
+}
@@ -0,0 +1,435 @@
+/* The XOR engine.  A coding matrix is expanded into a bit-matrix, where
+ * output packet (i, r) is the XOR of every source packet (j, c) with bit r
+ * of rows[i][j]*x^c set.  Pairs of packets that several outputs share are
+ * then factored out into temporaries, greedily taking the most common pair
+ * each time (Paar's algorithm), and what is left is a flat list of packet
+ * XORs.  It needs no byte shuffles, only wide XORs.
+ */
+
+#include "../inc/gibraltar.h"
+#include "../inc/gib_galois.h"
+#include "../inc/gib_xor.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/* Common pairs are only searched for with at most this many source packets,
+ * as the pair counts take its square in memory.
+ */
+#define GIB_XOR_CSE_MAX_INPUTS 256
+/* Temporaries a schedule may use.  They live on the stack while it runs,
+ * which is why the pool gives its workers at least 1 MiB.
+ */
+#define GIB_XOR_MAX_TEMPS 256
+/* Schedules other than encoding kept per context */
+#define GIB_XOR_CACHE_SIZE 64
+
+enum {
+  GIB_XOR_ZERO, /* d = 0 */
+  GIB_XOR_COPY, /* d = a */
+  GIB_XOR_XOR2, /* d = a ^ b */
+  GIB_XOR_ACC,  /* d ^= a */
+  GIB_XOR_ACC2  /* d ^= a ^ b; only when accumulating */
+};
+
+/* Operands are slots (the sources, the outputs, then the temporaries, laid
+ * out eight to a block like the buffers) and byte offsets from the block
+ * within them.
+ */
+struct gib_xor_op {
+  unsigned char type;
+  unsigned char init; /* The first write to an output */
+  unsigned short d, a, b;
+  unsigned short doff, aoff, boff;
+};
+
+struct gib_xor_sched {
+  int nsrc, ndst, nops;
+  struct gib_xor_op *ops;
+  int refs;
+  unsigned int hash;
+  unsigned long stamp;
+  unsigned char *rows; /* ndst*nsrc, to match cache entries */
+};
+
+struct gib_xor {
+  pthread_mutex_t lock;
+  const unsigned char *F;
+  struct gib_xor_sched *enc;
+  struct gib_xor_sched *cache[GIB_XOR_CACHE_SIZE];
+  unsigned long clock;
+};
+
+static void gib_xor_sched_free ( struct gib_xor_sched *s ) {
+  free(s->ops);
+  free(s->rows);
+  free(s);
+}
+
+static void gib_xor_operand ( int v, int nsrc, int ndst, unsigned short *slot,
+			      unsigned short *off ) {
+  if (v < 8*nsrc) {
+    *slot = v / 8;
+    *off = (v % 8)*GIB_XOR_PACKET;
+  } else {
+    *slot = nsrc + ndst + (v - 8*nsrc)/8;
+    *off = ((v - 8*nsrc) % 8)*GIB_XOR_PACKET;
+  }
+}
+
+/* Factors pairs shared by two or more outputs into temporaries.  vars[o]
+ * lists the len[o] variables XORed into output o; inputs are numbered from
+ * 0 and the temporaries from ninputs.  Returns the number of temporaries.
+ */
+static int gib_xor_cse ( int **vars, int *len, int nout, int ninputs,
+			 int (*temps)[2] ) {
+  int nvars = ninputs + GIB_XOR_MAX_TEMPS;
+  int ntemps = 0, o, p, q;
+  unsigned short *count;
+  if (ninputs > GIB_XOR_CSE_MAX_INPUTS)
+    return 0;
+  count = (unsigned short *)calloc(nvars*nvars, sizeof(*count));
+  if (count == NULL)
+    return 0; /* The schedule works without it, just more slowly. */
+  while (ntemps < GIB_XOR_MAX_TEMPS) {
+    int best = 1, best_a = 0, best_b = 0, t;
+    for (o = 0; o < nout; o++)
+      for (p = 0; p < len[o]; p++)
+	for (q = p+1; q < len[o]; q++) {
+	  int a = vars[o][p], b = vars[o][q];
+	  int k = (a < b) ? a*nvars + b : b*nvars + a;
+	  if (++count[k] > best) {
+	    best = count[k];
+	    best_a = (a < b) ? a : b;
+	    best_b = (a < b) ? b : a;
+	  }
+	}
+    for (o = 0; o < nout; o++)
+      for (p = 0; p < len[o]; p++)
+	for (q = p+1; q < len[o]; q++) {
+	  int a = vars[o][p], b = vars[o][q];
+	  count[(a < b) ? a*nvars + b : b*nvars + a] = 0;
+	}
+    if (best < 2)
+      break;
+    t = ninputs + ntemps;
+    temps[ntemps][0] = best_a;
+    temps[ntemps][1] = best_b;
+    ntemps++;
+    for (o = 0; o < nout; o++) {
+      int pa = -1, pb = -1;
+      for (p = 0; p < len[o]; p++) {
+	if (vars[o][p] == best_a)
+	  pa = p;
+	else if (vars[o][p] == best_b)
+	  pb = p;
+      }
+      if (pa < 0 || pb < 0)
+	continue;
+      /* Drop both, filling the holes from the end, and add t. */
+      if (pa < pb) {
+	p = pa;
+	pa = pb;
+	pb = p;
+      }
+      vars[o][pa] = vars[o][--len[o]];
+      vars[o][pb] = vars[o][--len[o]];
+      vars[o][len[o]++] = t;
+    }
+  }
+  free(count);
+  return ntemps;
+}
+
+/* Turns the factored outputs into a schedule:  the temporaries in the order
+ * they were made, then each output in turn.
+ */
+static struct gib_xor_sched *gib_xor_emit ( int **vars, int *len,
+					    int (*temps)[2], int ntemps,
+					    int total, int nsrc, int ndst ) {
+  struct gib_xor_sched *s;
+  int ninputs = 8*nsrc, nout = 8*ndst, nops = 0, i, j, o;
+  s = (struct gib_xor_sched *)calloc(1, sizeof(*s));
+  if (s == NULL)
+    return NULL;
+  s->ops = (struct gib_xor_op *)malloc((ntemps + total + nout)*
+				       sizeof(*s->ops));
+  if (s->ops == NULL) {
+    free(s);
+    return NULL;
+  }
+  for (i = 0; i < ntemps; i++) {
+    struct gib_xor_op *op = &s->ops[nops++];
+    op->type = GIB_XOR_XOR2;
+    op->init = 0;
+    gib_xor_operand(ninputs + i, nsrc, ndst, &op->d, &op->doff);
+    gib_xor_operand(temps[i][0], nsrc, ndst, &op->a, &op->aoff);
+    gib_xor_operand(temps[i][1], nsrc, ndst, &op->b, &op->boff);
+  }
+  for (o = 0; o < nout; o++) {
+    struct gib_xor_op *op = &s->ops[nops++];
+    op->d = nsrc + o/8;
+    op->doff = (o % 8)*GIB_XOR_PACKET;
+    op->init = 1;
+    if (len[o] == 0) {
+      op->type = GIB_XOR_ZERO;
+      continue;
+    }
+    gib_xor_operand(vars[o][0], nsrc, ndst, &op->a, &op->aoff);
+    if (len[o] == 1) {
+      op->type = GIB_XOR_COPY;
+      continue;
+    }
+    op->type = GIB_XOR_XOR2;
+    gib_xor_operand(vars[o][1], nsrc, ndst, &op->b, &op->boff);
+    for (j = 2; j < len[o]; j++) {
+      op = &s->ops[nops++];
+      op->type = GIB_XOR_ACC;
+      op->init = 0;
+      op->d = nsrc + o/8;
+      op->doff = (o % 8)*GIB_XOR_PACKET;
+      gib_xor_operand(vars[o][j], nsrc, ndst, &op->a, &op->aoff);
+    }
+  }
+  /* gib_xor_run resolves every operand, used or not. */
+  for (i = 0; i < nops; i++) {
+    struct gib_xor_op *op = &s->ops[i];
+    if (op->type == GIB_XOR_ZERO) {
+      op->a = op->d;
+      op->aoff = op->doff;
+    }
+    if (op->type != GIB_XOR_XOR2) {
+      op->b = op->a;
+      op->boff = op->aoff;
+    }
+  }
+  s->nsrc = nsrc;
+  s->ndst = ndst;
+  s->nops = nops;
+  s->refs = 1;
+  return s;
+}
+
+static struct gib_xor_sched *gib_xor_build ( const unsigned char *rows,
+					     int nsrc, int ndst ) {
+  int nout = 8*ndst, i, r, j, c, o, total = 0, ntemps;
+  int *len, **vars, *pool = NULL, (*temps)[2];
+  struct gib_xor_sched *s = NULL;
+
+  for (i = 0; i < ndst; i++)
+    for (j = 0; j < nsrc; j++)
+      total += gib_galois_bit_weight(rows[i*nsrc+j]);
+  len = (int *)calloc(nout, sizeof(*len));
+  vars = (int **)malloc(nout*sizeof(*vars));
+  temps = (int (*)[2])malloc(GIB_XOR_MAX_TEMPS*sizeof(*temps));
+  if (len != NULL && vars != NULL && temps != NULL)
+    pool = (int *)malloc((total + 1)*sizeof(*pool));
+  if (pool != NULL) {
+    total = 0;
+    for (i = 0; i < ndst; i++)
+      for (r = 0; r < 8; r++) {
+	o = 8*i + r;
+	vars[o] = pool + total;
+	for (j = 0; j < nsrc; j++)
+	  for (c = 0; c < 8; c++)
+	    if ((gib_gf_table[rows[i*nsrc+j]][1 << c] >> r) & 1)
+	      vars[o][len[o]++] = 8*j + c;
+	total += len[o];
+      }
+    ntemps = gib_xor_cse(vars, len, nout, 8*nsrc, temps);
+    s = gib_xor_emit(vars, len, temps, ntemps, total, nsrc, ndst);
+  }
+  free(len);
+  free(vars);
+  free(pool);
+  free(temps);
+  return s;
+}
+
+/* The packet routines work on 16-byte vectors, which every x86-64 has, and
+ * which GCC splits into words elsewhere.  Packets need not be aligned.
+ */
+typedef uint64_t gib_xor_vec __attribute__((vector_size(16), aligned(1),
+					    may_alias));
+#define GIB_XOR_VECS (GIB_XOR_PACKET/16)
+
+static inline void gib_xor_copy ( unsigned char *d, const unsigned char *a ) {
+  memcpy(d, a, GIB_XOR_PACKET);
+}
+
+static inline void gib_xor_xor2 ( unsigned char *d, const unsigned char *a,
+				  const unsigned char *b ) {
+  gib_xor_vec *vd = (gib_xor_vec *)d;
+  const gib_xor_vec *va = (const gib_xor_vec *)a;
+  const gib_xor_vec *vb = (const gib_xor_vec *)b;
+  int i;
+  for (i = 0; i < GIB_XOR_VECS; i++)
+    vd[i] = va[i] ^ vb[i];
+}
+
+static inline void gib_xor_acc2 ( unsigned char *d, const unsigned char *a,
+				  const unsigned char *b ) {
+  gib_xor_vec *vd = (gib_xor_vec *)d;
+  const gib_xor_vec *va = (const gib_xor_vec *)a;
+  const gib_xor_vec *vb = (const gib_xor_vec *)b;
+  int i;
+  for (i = 0; i < GIB_XOR_VECS; i++)
+    vd[i] ^= va[i] ^ vb[i];
+}
+
+/* What the first write to an output becomes when accumulating */
+static const unsigned char gib_xor_acc_type[] = {
+  GIB_XOR_ZERO, GIB_XOR_ACC, GIB_XOR_ACC2, GIB_XOR_ACC, GIB_XOR_ACC2
+};
+
+/* Each op is applied to GIB_XOR_GROUP blocks at a time, which spreads the
+ * cost of decoding it.
+ */
+#define GIB_XOR_GROUP 4
+
+void gib_xor_run ( const struct gib_xor_sched *s, int len, int off,
+		   unsigned char **src, unsigned char **dst, int accumulate ) {
+  static const int B = GIB_XOR_BLOCK;
+  uint64_t tmp[GIB_XOR_MAX_TEMPS/8*GIB_XOR_GROUP*GIB_XOR_BLOCK/8];
+  unsigned char *ptr[256+256+GIB_XOR_MAX_TEMPS/8];
+  const struct gib_xor_op *op, *end = s->ops + s->nops;
+  int blk, i, g, group;
+  for (i = 0; i < GIB_XOR_MAX_TEMPS/8; i++)
+    ptr[s->nsrc+s->ndst+i] = (unsigned char *)tmp + i*GIB_XOR_GROUP*B;
+  for (blk = off; blk < off + len; blk += group*B) {
+    group = (off + len - blk)/B;
+    if (group > GIB_XOR_GROUP)
+      group = GIB_XOR_GROUP;
+    for (i = 0; i < s->nsrc; i++)
+      ptr[i] = src[i] + blk;
+    for (i = 0; i < s->ndst; i++)
+      ptr[s->nsrc+i] = dst[i] + blk;
+    for (op = s->ops; op < end; op++) {
+      unsigned char *d = ptr[op->d] + op->doff;
+      const unsigned char *a = ptr[op->a] + op->aoff;
+      const unsigned char *b = ptr[op->b] + op->boff;
+      int type = (accumulate && op->init) ? gib_xor_acc_type[op->type] :
+	op->type;
+      switch (type) {
+      case GIB_XOR_ZERO:
+	if (!accumulate)
+	  for (g = 0; g < group; g++)
+	    memset(d + g*B, 0, GIB_XOR_PACKET);
+	break;
+      case GIB_XOR_COPY:
+	for (g = 0; g < group; g++)
+	  gib_xor_copy(d + g*B, a + g*B);
+	break;
+      case GIB_XOR_XOR2:
+	for (g = 0; g < group; g++)
+	  gib_xor_xor2(d + g*B, a + g*B, b + g*B);
+	break;
+      case GIB_XOR_ACC:
+	for (g = 0; g < group; g++)
+	  gib_xor_xor2(d + g*B, d + g*B, a + g*B);
+	break;
+      case GIB_XOR_ACC2:
+	for (g = 0; g < group; g++)
+	  gib_xor_acc2(d + g*B, a + g*B, b + g*B);
+	break;
+      }
+    }
+  }
+}
+int gib_xor_create ( struct gib_xor **x, gib_context c ) {
+  *x = (struct gib_xor *)calloc(1, sizeof(**x));
+  if (*x == NULL)
+    return GIB_OOM;
+  (*x)->F = c->F;
+  (*x)->enc = gib_xor_build(c->F, c->n, c->m);
+  if ((*x)->enc == NULL) {
+    free(*x);
+    return GIB_OOM;
+  }
+  pthread_mutex_init(&(*x)->lock, NULL);
+  return GIB_SUC;
+}
+
+void gib_xor_destroy ( struct gib_xor *x ) {
+  int i;
+  for (i = 0; i < GIB_XOR_CACHE_SIZE; i++)
+    if (x->cache[i] != NULL)
+      gib_xor_sched_free(x->cache[i]);
+  gib_xor_sched_free(x->enc);
+  pthread_mutex_destroy(&x->lock);
+  free(x);
+}
+
+static unsigned int gib_xor_hash ( const unsigned char *rows, int nsrc,
+				   int ndst ) {
+  /* FNV-1a */
+  unsigned int h = 2166136261u;
+  int i;
+  for (i = 0; i < nsrc*ndst; i++) {
+    h ^= rows[i];
+    h *= 16777619u;
+  }
+  return h ^ (nsrc << 8) ^ ndst;
+}
+
+struct gib_xor_sched *gib_xor_get ( struct gib_xor *x,
+				    const unsigned char *rows, int nsrc,
+				    int ndst ) {
+  struct gib_xor_sched *s;
+  unsigned int hash;
+  int i, victim = 0;
+  if (rows == x->F && nsrc == x->enc->nsrc && ndst == x->enc->ndst)
+    return x->enc;
+  hash = gib_xor_hash(rows, nsrc, ndst);
+  pthread_mutex_lock(&x->lock);
+  for (i = 0; i < GIB_XOR_CACHE_SIZE; i++) {
+    s = x->cache[i];
+    if (s != NULL && s->hash == hash && s->nsrc == nsrc && s->ndst == ndst &&
+	memcmp(s->rows, rows, nsrc*ndst) == 0) {
+      s->refs++;
+      s->stamp = ++x->clock;
+      pthread_mutex_unlock(&x->lock);
+      return s;
+    }
+  }
+  pthread_mutex_unlock(&x->lock);
+
+  /* Built outside the lock, as it takes a while. */
+  s = gib_xor_build(rows, nsrc, ndst);
+  if (s == NULL)
+    return NULL;
+  s->hash = hash;
+  s->rows = (unsigned char *)malloc(nsrc*ndst);
+  if (s->rows == NULL) {
+    gib_xor_sched_free(s);
+    return NULL;
+  }
+  memcpy(s->rows, rows, nsrc*ndst);
+
+  pthread_mutex_lock(&x->lock);
+  for (i = 0; i < GIB_XOR_CACHE_SIZE; i++) {
+    if (x->cache[i] == NULL) {
+      victim = i;
+      break;
+    }
+    if (x->cache[i]->stamp < x->cache[victim]->stamp)
+      victim = i;
+  }
+  if (x->cache[victim] != NULL && --x->cache[victim]->refs == 0)
+    gib_xor_sched_free(x->cache[victim]);
+  s->refs = 2; /* The cache's and the caller's */
+  s->stamp = ++x->clock;
+  x->cache[victim] = s;
+  pthread_mutex_unlock(&x->lock);
+  return s;
+}
+
+void gib_xor_release ( struct gib_xor *x, struct gib_xor_sched *s ) {
+  if (s == x->enc)
+    return;
+  pthread_mutex_lock(&x->lock);
+  if (--s->refs == 0)
+    gib_xor_sched_free(s);
+  pthread_mutex_unlock(&x->lock);
+}
@@ -0,0 +1,404 @@
+/* The public entry points.  Every implementation built into the library
+ * provides a struct gib_ops, one of them is chosen when a context is
+ * created, and each call after that is a single indirect call through the
+ * context's table, after counting the call and its bytes for gib_get_stats.
+ */
+
+#include "../inc/gibraltar.h"
+#include "../inc/gib_ops.h"
+#include "../inc/gib_async.h"
+#include "../inc/gib_stats.h"
+#include "../inc/gib_trace.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+/* In order of preference when they tie.  Only those marked automatic are
+ * calibrated against each other.
+ */
+static const struct gib_ops *const gib_backends[] = {
+#ifdef GIB_HAVE_CUDA
+  &gib_cuda_ops,
+#endif
+  &gib_cpu_ops,
+#ifdef GIB_HAVE_JERASURE
+  &gib_jerasure_ops,
+#endif
+  NULL
+};
+
+/* Calibration codes a stripe of buffers this large a few times with each
+ * implementation, keeping the best time of each.  The first call is not
+ * timed, as it pays for setup such as compiling kernels.
+ */
+#define GIB_CALIBRATE_SIZE (256*1024)
+#define GIB_CALIBRATE_REPS 3
+/* Choices remembered per process */
+#define GIB_CALIBRATE_SLOTS 32
+
+struct gib_choice {
+  int n, m;
+  struct gib_options opts;
+  const struct gib_ops *ops;
+};
+
+static struct gib_choice gib_choices[GIB_CALIBRATE_SLOTS];
+static int gib_nchoices;
+static pthread_mutex_t gib_choice_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double gib_now ( void ) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+/* Returns the best time to encode a test stripe, or a negative value if
+ * the implementation could not do it.
+ */
+static double gib_calibrate ( const struct gib_ops *ops, int n, int m,
+			      const struct gib_options *opts ) {
+  gib_context c;
+  void *buffers;
+  int ld, rep;
+  double best = -1, start, t;
+  if (ops->init_opts(n, m, opts, &c) != GIB_SUC)
+    return -1;
+  c->ops = ops;
+  if (ops->alloc(&buffers, GIB_CALIBRATE_SIZE, &ld, c) == GIB_SUC) {
+    memset(buffers, 0x5a, (n+m)*GIB_CALIBRATE_SIZE);
+    if (ops->generate(buffers, GIB_CALIBRATE_SIZE, c) == GIB_SUC) {
+      for (rep = 0; rep < GIB_CALIBRATE_REPS; rep++) {
+	start = gib_now();
+	ops->generate(buffers, GIB_CALIBRATE_SIZE, c);
+	t = gib_now() - start;
+	if (best < 0 || t < best)
+	  best = t;
+      }
+    }
+    ops->free(buffers, c);
+  }
+  ops->destroy(c);
+  return best;
+}
+
+static const struct gib_ops *gib_backend_auto ( int n, int m,
+						const struct gib_options *opts ) {
+  struct gib_options none;
+  const struct gib_ops *const *b, *ops = NULL;
+  double t, best = -1;
+  int i, navailable = 0;
+
+  for (b = gib_backends; *b != NULL; b++)
+    if ((*b)->automatic && (*b)->available(n, m)) {
+      ops = *b;
+      navailable++;
+    }
+  if (navailable <= 1)
+    return ops;
+
+  if (opts == NULL) {
+    memset(&none, 0, sizeof(none));
+    opts = &none;
+  }
+  pthread_mutex_lock(&gib_choice_lock);
+  for (i = 0; i < gib_nchoices; i++)
+    if (gib_choices[i].n == n && gib_choices[i].m == m &&
+	memcmp(&gib_choices[i].opts, opts, sizeof(*opts)) == 0) {
+      ops = gib_choices[i].ops;
+      pthread_mutex_unlock(&gib_choice_lock);
+      return ops;
+    }
+  /* Held throughout, so that contexts created together calibrate once and
+   * do not disturb each other's timings.
+   */
+  ops = NULL;
+  for (b = gib_backends; *b != NULL; b++) {
+    if (!(*b)->automatic || !(*b)->available(n, m))
+      continue;
+    t = gib_calibrate(*b, n, m, opts);
+    if (t >= 0 && (ops == NULL || t < best)) {
+      ops = *b;
+      best = t;
+    }
+  }
+  if (ops != NULL) {
+    i = (gib_nchoices < GIB_CALIBRATE_SLOTS) ? gib_nchoices++ :
+      rand() % GIB_CALIBRATE_SLOTS;
+    gib_choices[i].n = n;
+    gib_choices[i].m = m;
+    gib_choices[i].opts = *opts;
+    gib_choices[i].ops = ops;
+  }
+  pthread_mutex_unlock(&gib_choice_lock);
+  return ops;
+}
+
+/* Picks the implementation for a new context, or NULL if the one asked for
+ * is not built in or cannot run here.
+ */
+static const struct gib_ops *gib_backend_pick ( int n, int m,
+						const struct gib_options *opts ) {
+  const struct gib_ops *const *b;
+  const char *name = getenv("GIB_BACKEND");
+  int backend = (opts != NULL) ? opts->backend : 0;
+
+  if (backend == 0 && name != NULL && strcmp(name, "auto") != 0) {
+    for (b = gib_backends; *b != NULL; b++)
+      if (strcmp((*b)->name, name) == 0)
+	break;
+    if (*b == NULL) {
+      fprintf(stderr, "GIB_BACKEND names an implementation (%s) that is not "
+	      "built into this library.\n", name);
+      return NULL;
+    }
+    backend = (*b)->backend;
+  }
+  if (backend == 0)
+    return gib_backend_auto(n, m, opts);
+  for (b = gib_backends; *b != NULL; b++)
+    if ((*b)->backend == backend) {
+      if (!(*b)->available(n, m)) {
+	fprintf(stderr, "The %s implementation cannot be used here.\n",
+		(*b)->name);
+	return NULL;
+      }
+      return *b;
+    }
+  fprintf(stderr, "Implementation %i is not built into this library.\n",
+	  backend);
+  return NULL;
+}
+
+int gib_init ( int n, int m, gib_context *c ) {
+  return gib_init_opts(n, m, NULL, c);
+}
+
+int gib_init_opts ( int n, int m, const struct gib_options *opts,
+		    gib_context *c ) {
+  const struct gib_ops *ops;
+  int rc;
+  gib_trace_env();
+  ops = gib_backend_pick(n, m, opts);
+  if (ops == NULL)
+    return GIB_ERR;
+  if ((rc = ops->init_opts(n, m, opts, c)))
+    return rc;
+  (*c)->ops = ops;
+  if ((rc = gib_stats_create(&(*c)->stats))) {
+    ops->destroy(*c);
+    return rc;
+  }
+  return GIB_SUC;
+}
+
+const char *gib_backend_name ( gib_context c ) {
+  return c->ops->name;
+}
+
+int gib_destroy ( gib_context c ) {
+  struct gib_stats_set *stats = c->stats;
+  int rc;
+  /* Every implementation's jobs finish before any of it is freed. */
+  if ((rc = gib_async_destroy(c)))
+    return rc;
+  rc = c->ops->destroy(c);
+  gib_stats_destroy(stats);
+  return rc;
+}
+
+/* Counts a call coding nbufs buffers of len bytes each */
+static void gib_count_generate ( gib_context c, int nbufs, int len ) {
+  gib_stats_add(c, GIB_STAT_GENERATE_CALLS, 1);
+  gib_stats_add(c, GIB_STAT_BYTES_ENCODED, (unsigned long)nbufs*len);
+}
+
+static void gib_count_recover ( gib_context c, int nbufs, int len ) {
+  gib_stats_add(c, GIB_STAT_RECOVER_CALLS, 1);
+  gib_stats_add(c, GIB_STAT_BYTES_RECOVERED, (unsigned long)nbufs*len);
+}
+
+static int gib_count_failed ( char *failed_bufs, gib_context c ) {
+  int i, count = 0;
+  for (i = 0; i < c->n+c->m; i++)
+    count += (failed_bufs[i] != 0);
+  return count;
+}
+
+int gib_alloc ( void **buffers, int buf_size, int *ld, gib_context c ) {
+  return c->ops->alloc(buffers, buf_size, ld, c);
+}
+
+int gib_free ( void *buffers, gib_context c ) {
+  return c->ops->free(buffers, c);
+}
+
+int gib_generate ( void *buffers, int buf_size, gib_context c ) {
+  int rc;
+  gib_count_generate(c, c->n, buf_size);
+  GIB_TRACE_BEGIN(generate, buf_size);
+  rc = c->ops->generate(buffers, buf_size, c);
+  GIB_TRACE_END(generate, buf_size);
+  return rc;
+}
+
+int gib_generate_nc ( void *buffers, int buf_size, int work_size,
+		      gib_context c ) {
+  int rc;
+  gib_count_generate(c, c->n, work_size);
+  GIB_TRACE_BEGIN(generate, buf_size);
+  rc = c->ops->generate_nc(buffers, buf_size, work_size, c);
+  GIB_TRACE_END(generate, buf_size);
+  return rc;
+}
+
+int gib_generate_crc ( void *buffers, int buf_size, unsigned int *crcs,
+		       gib_context c ) {
+  int rc;
+  gib_count_generate(c, c->n, buf_size);
+  GIB_TRACE_BEGIN(generate, buf_size);
+  rc = c->ops->generate_crc(buffers, buf_size, crcs, c);
+  GIB_TRACE_END(generate, buf_size);
+  return rc;
+}
+
+int gib_generate_batch ( struct gib_stripe *stripes, int count,
+			 gib_context c ) {
+  int rc, i;
+  gib_stats_add(c, GIB_STAT_GENERATE_CALLS, 1);
+  for (i = 0; i < count; i++)
+    gib_stats_add(c, GIB_STAT_BYTES_ENCODED,
+		  (unsigned long)c->n*stripes[i].buf_size);
+  GIB_TRACE_BEGIN(generate, count);
+  rc = c->ops->generate_batch(stripes, count, c);
+  GIB_TRACE_END(generate, count);
+  return rc;
+}
+
+int gib_recover ( void *buffers, int buf_size, int *buf_ids, int recover_last,
+		  gib_context c ) {
+  int rc;
+  gib_count_recover(c, recover_last, buf_size);
+  GIB_TRACE_BEGIN(recover, buf_size);
+  rc = c->ops->recover(buffers, buf_size, buf_ids, recover_last, c);
+  GIB_TRACE_END(recover, buf_size);
+  return rc;
+}
+
+int gib_recover_nc ( void *buffers, int buf_size, int work_size, int *buf_ids,
+		     int recover_last, gib_context c ) {
+  int rc;
+  gib_count_recover(c, recover_last, work_size);
+  GIB_TRACE_BEGIN(recover, buf_size);
+  rc = c->ops->recover_nc(buffers, buf_size, work_size, buf_ids,
+			  recover_last, c);
+  GIB_TRACE_END(recover, buf_size);
+  return rc;
+}
+
+int gib_recover_crc ( void *buffers, int buf_size, int *buf_ids,
+		      int recover_last, unsigned int *crcs, gib_context c ) {
+  int rc;
+  gib_count_recover(c, recover_last, buf_size);
+  GIB_TRACE_BEGIN(recover, buf_size);
+  rc = c->ops->recover_crc(buffers, buf_size, buf_ids, recover_last, crcs,
+			   c);
+  GIB_TRACE_END(recover, buf_size);
+  return rc;
+}
+
+int gib_regenerate ( void *buffers, int buf_size, int *parity_ids, int count,
+		     gib_context c ) {
+  int rc;
+  gib_count_recover(c, count, buf_size);
+  GIB_TRACE_BEGIN(recover, buf_size);
+  rc = c->ops->regenerate(buffers, buf_size, parity_ids, count, c);
+  GIB_TRACE_END(recover, buf_size);
+  return rc;
+}
+
+int gib_recover_sparse ( void *buffers, int buf_size, char *failed_bufs,
+			 gib_context c ) {
+  int rc;
+  gib_count_recover(c, gib_count_failed(failed_bufs, c), buf_size);
+  GIB_TRACE_BEGIN(recover, buf_size);
+  rc = c->ops->recover_sparse(buffers, buf_size, failed_bufs, c);
+  GIB_TRACE_END(recover, buf_size);
+  return rc;
+}
+
+int gib_recover_sparse_nc ( void *buffers, int buf_size, int work_size,
+			    char *failed_bufs, gib_context c ) {
+  int rc;
+  gib_count_recover(c, gib_count_failed(failed_bufs, c), work_size);
+  GIB_TRACE_BEGIN(recover, buf_size);
+  rc = c->ops->recover_sparse_nc(buffers, buf_size, work_size, failed_bufs,
+				 c);
+  GIB_TRACE_END(recover, buf_size);
+  return rc;
+}
+
+int gib_generate_iov ( void **data, void **parity, int buf_size,
+		       gib_context c ) {
+  int rc;
+  gib_count_generate(c, c->n, buf_size);
+  GIB_TRACE_BEGIN(generate, buf_size);
+  rc = c->ops->generate_iov(data, parity, buf_size, c);
+  GIB_TRACE_END(generate, buf_size);
+  return rc;
+}
+
+int gib_recover_iov ( void **bufs, int buf_size, int *buf_ids,
+		      int recover_last, gib_context c ) {
+  int rc;
+  gib_count_recover(c, recover_last, buf_size);
+  GIB_TRACE_BEGIN(recover, buf_size);
+  rc = c->ops->recover_iov(bufs, buf_size, buf_ids, recover_last, c);
+  GIB_TRACE_END(recover, buf_size);
+  return rc;
+}
+
+/* Counted and traced once, however many pieces the chains are cut into */
+int gib_generate_iovec ( struct iovec **shards, int *iovcnt, int buf_size,
+			 gib_context c ) {
+  int rc;
+  gib_count_generate(c, c->n, buf_size);
+  GIB_TRACE_BEGIN(generate, buf_size);
+  rc = c->ops->generate_iovec(shards, iovcnt, buf_size, c);
+  GIB_TRACE_END(generate, buf_size);
+  return rc;
+}
+
+int gib_recover_iovec ( struct iovec **shards, int *iovcnt, int buf_size,
+			int *buf_ids, int recover_last, gib_context c ) {
+  int rc;
+  gib_count_recover(c, recover_last, buf_size);
+  GIB_TRACE_BEGIN(recover, buf_size);
+  rc = c->ops->recover_iovec(shards, iovcnt, buf_size, buf_ids,
+			     recover_last, c);
+  GIB_TRACE_END(recover, buf_size);
+  return rc;
+}
+
+int gib_update ( void *buffers, int buf_size, int index, int offset, int len,
+		 void *old_data, void *new_data, gib_context c ) {
+  int rc;
+  gib_stats_add(c, GIB_STAT_UPDATE_CALLS, 1);
+  GIB_TRACE_BEGIN(update, buf_size);
+  rc = c->ops->update(buffers, buf_size, index, offset, len, old_data,
+		      new_data, c);
+  GIB_TRACE_END(update, buf_size);
+  return rc;
+}
+
+int gib_update_delta ( void *buffers, int buf_size, int index, int offset,
+		       int len, void *delta, gib_context c ) {
+  int rc;
+  gib_stats_add(c, GIB_STAT_UPDATE_CALLS, 1);
+  GIB_TRACE_BEGIN(update, buf_size);
+  rc = c->ops->update_delta(buffers, buf_size, index, offset, len, delta,
+			    c);
+  GIB_TRACE_END(update, buf_size);
+  return rc;
+}
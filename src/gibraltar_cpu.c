@@ -1,49 +1,55 @@
 /* Author:  Matthew Curry
  * Email:   mlcurry@sandia.gov
  *
- * Gibraltar contains a low-performance CPU failback implementation.  This can
- * be used instead of the GPU implementation by compiling this file instead of
- * gib_cuda_rt.c
+ * Gibraltar contains a low-performance CPU failback implementation.  It is
+ * always built, and is used whenever no other implementation is chosen or
+ * available.
  */
 
 #include "../inc/gibraltar.h"
-#include "../inc/gib_galois.h"
 #include "../inc/gib_cpu_funcs.h"
+#include "../inc/gib_ops.h"
+#include "../inc/gib_iov.h"
 #include <stdlib.h>
-#include <stdio.h>
 
-int gib_init ( int n, int m, gib_context *c ) {
-  return gib_cpu_init(n, m, c);
+static int gib_cpu_available ( int n, int m ) {
+  return 1;
 }
 
-int gib_destroy ( gib_context c ) {
-  return gib_cpu_destroy(c);
-}
-
-int gib_alloc ( void **buffers, int buf_size, int *ld, gib_context c ) {
-  return gib_cpu_alloc(buffers, buf_size, ld, c);
-}
-
-int gib_free ( void *buffers, gib_context c ) {
+static int gib_cpu_free_ctx ( void *buffers, gib_context c ) {
   return gib_cpu_free(buffers);
 }
 
-int gib_generate ( void *buffers, int buf_size, gib_context c ) {
-  return gib_cpu_generate(buffers, buf_size, c);
-}
-
-int gib_generate_nc ( void *buffers, int buf_size, int work_size,  
-		      gib_context c) {
-  return gib_cpu_generate_nc(buffers, buf_size, work_size, c);
-}
-
-int gib_recover ( void *buffers, int buf_size, int *buf_ids, int recover_last,
-		  gib_context c ) {
-  return gib_cpu_recover(buffers, buf_size, buf_ids, recover_last, c);
-}
-
-int gib_recover_nc ( void *buffers, int buf_size, int work_size, int *buf_ids, int recover_last,
-		     gib_context c ) {
-  return gib_cpu_recover_nc(buffers, buf_size, work_size, buf_ids, 
-			    recover_last, c);
-}
+static int gib_cpu_update_delta ( void *buffers, int buf_size, int index,
+				  int offset, int len, void *delta,
+				  gib_context c ) {
+  return gib_cpu_update(buffers, buf_size, index, offset, len, delta, NULL,
+			c);
+}
+
+const struct gib_ops gib_cpu_ops = {
+  "cpu",
+  GIB_BACKEND_CPU,
+  1,
+  gib_cpu_available,
+  gib_cpu_init_opts,
+  gib_cpu_destroy,
+  gib_cpu_alloc,
+  gib_cpu_free_ctx,
+  gib_cpu_generate,
+  gib_cpu_generate_nc,
+  gib_cpu_generate_crc,
+  gib_cpu_generate_batch,
+  gib_cpu_recover,
+  gib_cpu_recover_nc,
+  gib_cpu_recover_crc,
+  gib_cpu_regenerate,
+  gib_cpu_recover_sparse,
+  gib_cpu_recover_sparse_nc,
+  gib_cpu_generate_iov,
+  gib_cpu_recover_iov,
+  gib_cpu_generate_iovec,
+  gib_cpu_recover_iovec,
+  gib_cpu_update,
+  gib_cpu_update_delta
+};
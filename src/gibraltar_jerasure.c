@@ -3,16 +3,34 @@
  * 
  * This file implements an adapter from the Gibraltar API to the Jerasure API
  * in order to allow for non-GPU use and performance comparisons between the
- * GPU and CPU implementations.
+ * GPU and CPU implementations.  It is built in with "make jerasure=1".
  */
 
 #include "../inc/gibraltar.h"
+#include "../inc/gib_crc32c.h"
+#include "../inc/gib_ops.h"
+#include "../inc/gib_iov.h"
 #include "../lib/Jerasure-1.2/jerasure.h"
 #include "../lib/Jerasure-1.2/reed_sol.h"
+#include "../lib/Jerasure-1.2/galois.h"
 
-int gib_init ( int n, int m, gib_context *c ) {
-  *c = (gib_context) malloc(sizeof(struct gib_context_t));
-  if (c == NULL)
+/* Jerasure does its own coding on the calling thread, so there is nothing
+ * here for the options to change.  None of its codes is the one the CPU
+ * routines write:  even its Vandermonde matrix,
+ * reed_sol_vandermonde_coding_matrix, has a first row of all ones where F
+ * does not.  Stripes written through this adapter can only be recovered
+ * through it, so it is never picked automatically, and only its
+ * Vandermonde code is offered.
+ */
+static int gib_jerasure_init_opts(int n, int m,
+				  const struct gib_options *opts,
+				  gib_context *c) {
+  if (opts != NULL && (opts->engine != GIB_ENGINE_TABLE ||
+		       (opts->matrix != 0 &&
+			opts->matrix != GIB_MATRIX_VANDERMONDE)))
+    return GIB_ERR;
+  *c = (gib_context) calloc(1, sizeof(struct gib_context_t));
+  if (*c == NULL)
     return GIB_OOM;
   (*c)->n = n;
   (*c)->m = m;
@@ -24,13 +42,14 @@ int gib_init ( int n, int m, gib_context *c ) {
   return 0;
 }
 
-int gib_destroy( gib_context c ) {
+static int gib_jerasure_destroy(gib_context c) {
   free(c->F);
   free(c);
   return 0;
 }
 
-int gib_alloc(void **buffers, int buf_size, int *ld, gib_context c) {
+static int gib_jerasure_alloc(void **buffers, int buf_size, int *ld,
+			      gib_context c) {
   *ld = buf_size;
   *buffers = malloc((c->n+c->m)*buf_size);
   if (*buffers == NULL)
@@ -38,12 +57,16 @@ int gib_alloc(void **buffers, int buf_size, int *ld, gib_context c) {
   return 0;
 }
 
-int gib_free(void *buffers, gib_context c) {
+static int gib_jerasure_free(void *buffers, gib_context c) {
   free(buffers);
   return 0;
 }
 
-int gib_generate(void *buffers, int buf_size, gib_context c) {
+/* The _nc forms code the first work_size bytes of buffers spaced buf_size
+ * apart, and the others are built on them.
+ */
+static int gib_jerasure_generate_nc(void *buffers, int buf_size, int work_size,
+				    gib_context c) {
   char *data[256];
   char *coding[256];
   int i;
@@ -53,12 +76,29 @@ int gib_generate(void *buffers, int buf_size, gib_context c) {
   for (i = 0; i < (c->m); i++) {
     coding[i] = ((char *)buffers) + (i+(c->n))*buf_size;
   }
-  jerasure_matrix_encode(c->n, c->m, 8, (int *)(c->F), data, coding, buf_size);
+  jerasure_matrix_encode(c->n, c->m, 8, (int *)(c->F), data, coding,
+			 work_size);
   return 0;
 }
 
-int gib_recover(void *buffers, int buf_size, int *buf_ids, int recover_last, 
-		gib_context c) {
+static int gib_jerasure_generate(void *buffers, int buf_size, gib_context c) {
+  return gib_jerasure_generate_nc(buffers, buf_size, buf_size, c);
+}
+
+/* Jerasure has no batched encode; the matrix is already set up per context. */
+static int gib_jerasure_generate_batch(struct gib_stripe *stripes, int count,
+				       gib_context c) {
+  int i, rc;
+  for (i = 0; i < count; i++)
+    if ((rc = gib_jerasure_generate(stripes[i].buffers, stripes[i].buf_size,
+				    c)))
+      return rc;
+  return 0;
+}
+
+static int gib_jerasure_recover_nc(void *buffers, int buf_size, int work_size,
+				   int *buf_ids, int recover_last,
+				   gib_context c) {
   /* Gibraltar does not want to necessarily recover ALL of the lost buffers, as
    * sometimes this is not necessary or convenient.  However, Jerasure does 
    * want to recover all buffers, and will reference any intact buffers that it
@@ -100,7 +140,206 @@ int gib_recover(void *buffers, int buf_size, int *buf_ids, int recover_last,
       offset++;
     }
   erasures[counter] = -1;
+  jerasure_matrix_decode(c->n, c->m, 8, (int *)(c->F), 0, erasures, data, 
+			 coding, work_size);
+  return 0;
+}
+
+static int gib_jerasure_recover(void *buffers, int buf_size, int *buf_ids,
+				int recover_last, gib_context c) {
+  return gib_jerasure_recover_nc(buffers, buf_size, buf_size, buf_ids,
+				 recover_last, c);
+}
+
+/* Jerasure's loops cannot be fused with the checksums, so these take them in
+ * one pass over the stripe after coding it.
+ */
+static void gib_jerasure_crcs(void *buffers, int buf_size, int nbufs,
+			      unsigned int *crcs) {
+  unsigned char *bufs[256];
+  int i;
+  for (i = 0; i < nbufs; i++) {
+    bufs[i] = (unsigned char *)buffers + i*buf_size;
+    crcs[i] = 0;
+  }
+  gib_crc32c_multi(crcs, bufs, nbufs, 0, buf_size);
+}
+
+static int gib_jerasure_generate_crc(void *buffers, int buf_size,
+				     unsigned int *crcs, gib_context c) {
+  int rc;
+  if ((rc = gib_jerasure_generate(buffers, buf_size, c)))
+    return rc;
+  gib_jerasure_crcs(buffers, buf_size, c->n+c->m, crcs);
+  return 0;
+}
+
+static int gib_jerasure_recover_crc(void *buffers, int buf_size, int *buf_ids,
+				    int recover_last, unsigned int *crcs,
+				    gib_context c) {
+  int rc;
+  if ((rc = gib_jerasure_recover(buffers, buf_size, buf_ids, recover_last,
+				 c)))
+    return rc;
+  gib_jerasure_crcs(buffers, buf_size, c->n+recover_last, crcs);
+  return 0;
+}
+
+static int gib_jerasure_recover_sparse_nc(void *buffers, int buf_size,
+					  int work_size, char *failed_bufs,
+					  gib_context c) {
+  /* This is the layout Jerasure wants in the first place. */
+  char *data[256];
+  char *coding[256];
+  int erasures[257];
+  int i, counter = 0;
+  for (i = 0; i < c->n; i++)
+    data[i] = (char *)buffers + i*buf_size;
+  for (i = 0; i < c->m; i++)
+    coding[i] = (char *)buffers + (i+c->n)*buf_size;
+  for (i = 0; i < c->n+c->m; i++)
+    if (failed_bufs[i])
+      erasures[counter++] = i;
+  erasures[counter] = -1;
+  if (jerasure_matrix_decode(c->n, c->m, 8, (int *)(c->F), 0, erasures, data,
+			     coding, work_size))
+    return GIB_ERR;
+  return 0;
+}
+
+static int gib_jerasure_recover_sparse(void *buffers, int buf_size,
+				       char *failed_bufs, gib_context c) {
+  return gib_jerasure_recover_sparse_nc(buffers, buf_size, buf_size,
+					failed_bufs, c);
+}
+
+static int gib_jerasure_regenerate(void *buffers, int buf_size,
+				   int *parity_ids, int count, gib_context c) {
+  char *data[256];
+  char *coding[256];
+  int i;
+  for (i = 0; i < c->n; i++)
+    data[i] = (char *)buffers + i*buf_size;
+  for (i = 0; i < c->m; i++)
+    coding[i] = (char *)buffers + (i+c->n)*buf_size;
+  for (i = 0; i < count; i++) {
+    int p = parity_ids[i] - c->n;
+    if (p < 0 || p >= c->m)
+      return GIB_ERR;
+    jerasure_matrix_dotprod(c->n, 8, ((int *)(c->F)) + p*c->n, NULL,
+			    parity_ids[i], data, coding, buf_size);
+  }
+  return 0;
+}
+
+static int gib_jerasure_generate_iov(void **data, void **parity, int buf_size,
+				     gib_context c) {
+  jerasure_matrix_encode(c->n, c->m, 8, (int *)(c->F), (char **)data, 
+			 (char **)parity, buf_size);
+  return 0;
+}
+
+static int gib_jerasure_recover_iov(void **bufs, int buf_size, int *buf_ids,
+				    int recover_last, gib_context c) {
+  /* As in gib_recover, except that there is no spare room in the caller's
+   * buffers for the lost ones Jerasure insists on rebuilding, so those get
+   * scratch space.
+   */
+  char *data[256];
+  char *coding[256];
+  int erasures[256];
+  int missing[256];
+  int i, counter = 0, nscratch = 0;
+  char *scratch;
+
+  for (i = 0; i < c->n+c->m; i++)
+    missing[i] = 1;
+  for (i = 0; i < c->n+recover_last; i++) {
+    if (buf_ids[i] < c->n)
+      data[buf_ids[i]] = (char *)bufs[i];
+    else
+      coding[buf_ids[i] - c->n] = (char *)bufs[i];
+    missing[buf_ids[i]] = 0;
+  }
+  for (i = c->n; i < c->n+recover_last; i++)
+    erasures[counter++] = buf_ids[i];
+  for (i = 0; i < c->n+c->m; i++)
+    if (missing[i])
+      nscratch++;
+  scratch = (char *)malloc(nscratch*buf_size + 1);
+  if (scratch == NULL)
+    return GIB_OOM;
+  nscratch = 0;
+  for (i = 0; i < c->n+c->m; i++)
+    if (missing[i]) {
+      erasures[counter++] = i;
+      if (i < c->n)
+	data[i] = scratch + nscratch*buf_size;
+      else
+	coding[i - c->n] = scratch + nscratch*buf_size;
+      nscratch++;
+    }
+  erasures[counter] = -1;
   jerasure_matrix_decode(c->n, c->m, 8, (int *)(c->F), 0, erasures, data, 
 			 coding, buf_size);
+  free(scratch);
   return 0;
 }
+
+static int gib_jerasure_update_delta(void *buffers, int buf_size, int index,
+				     int offset, int len, void *delta,
+				     gib_context c) {
+  int j;
+  for (j = 0; j < c->m; j++) {
+    char *parity = (char *)buffers + (c->n+j)*buf_size + offset;
+    galois_w08_region_multiply((char *)delta, ((int *)(c->F))[j*c->n+index],
+			       len, parity, 1);
+  }
+  return 0;
+}
+
+static int gib_jerasure_update(void *buffers, int buf_size, int index,
+			       int offset, int len, void *old_data,
+			       void *new_data, gib_context c) {
+  char *delta = (char *)malloc(len);
+  int i, rc;
+  if (delta == NULL)
+    return GIB_OOM;
+  for (i = 0; i < len; i++)
+    delta[i] = ((char *)old_data)[i] ^ ((char *)new_data)[i];
+  rc = gib_jerasure_update_delta(buffers, buf_size, index, offset, len, delta,
+				 c);
+  free(delta);
+  return rc;
+}
+
+static int gib_jerasure_available(int n, int m) {
+  return 1;
+}
+
+const struct gib_ops gib_jerasure_ops = {
+  "jerasure",
+  GIB_BACKEND_JERASURE,
+  0, /* Its own Vandermonde matrix differs from F */
+  gib_jerasure_available,
+  gib_jerasure_init_opts,
+  gib_jerasure_destroy,
+  gib_jerasure_alloc,
+  gib_jerasure_free,
+  gib_jerasure_generate,
+  gib_jerasure_generate_nc,
+  gib_jerasure_generate_crc,
+  gib_jerasure_generate_batch,
+  gib_jerasure_recover,
+  gib_jerasure_recover_nc,
+  gib_jerasure_recover_crc,
+  gib_jerasure_regenerate,
+  gib_jerasure_recover_sparse,
+  gib_jerasure_recover_sparse_nc,
+  gib_jerasure_generate_iov,
+  gib_jerasure_recover_iov,
+  gib_iov_generate_iovec,
+  gib_iov_recover_iovec,
+  gib_jerasure_update,
+  gib_jerasure_update_delta
+};